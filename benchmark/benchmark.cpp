@@ -0,0 +1,1047 @@
+#define NOMINMAX
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include "Settings.h"
+#include "FrameSource.h"
+#include "AveragingFilter.h"
+#include "MedianFilter.h"
+#include "HoleFiller.h"
+#include "ParallelRows.h"
+#include "TileRenderer.h"
+#include "Colorize.h"
+#include "Compositor.h"
+#include "Treasure.h"
+#include "SandPlane.h"
+#include "SessionFile.h"
+
+using namespace cv;
+using namespace std;
+
+//
+// Headless benchmark of the sandbox kernels. Every kernel runs on depth frames
+// from a frame source scaled to several resolutions. Optimized kernels are
+// compared with their reference implementation, all but the averaging filter
+// and the blending effects have to be bit-exact.
+//
+
+namespace {
+
+struct BenchmarkSettings {
+	size_t frames;          // Timed frames per kernel
+	size_t referenceFrames; // Timed frames for slow reference kernels
+	vector<Size> resolutions;
+	string colorFile;
+	string csvFile;
+};
+
+BenchmarkSettings benchmarkSettings;
+
+/**
+ * @brief One line of the result table.
+ */
+struct Result {
+	string kernel;
+	string parameters;
+	Size resolution;
+	double nsPerPixel;
+	double fps;
+	int difference; // Largest difference to the reference, -1 if not compared
+	int tolerance;  // Allowed difference, 0 for bit-exact kernels
+};
+
+vector<Result> results;
+
+/**
+ * @return Largest difference of two CV_8U or CV_16U images, INT_MAX if they don't match in size or type
+ */
+int maxDifference(const Mat &a, const Mat &b)
+{
+	if (a.size() != b.size() || a.type() != b.type())
+		return INT_MAX;
+
+	const int values = a.cols * a.channels();
+
+	int difference = 0;
+	for (int row = 0; row < a.rows; ++row)
+	{
+		if (a.depth() == CV_16U)
+		{
+			const uint16_t *pa = a.ptr<uint16_t>(row);
+			const uint16_t *pb = b.ptr<uint16_t>(row);
+			for (int n = 0; n < values; ++n)
+				difference = std::max(difference, std::abs(pa[n] - pb[n]));
+		}
+		else if (a.depth() == CV_16S)
+		{
+			const int16_t *pa = a.ptr<int16_t>(row);
+			const int16_t *pb = b.ptr<int16_t>(row);
+			for (int n = 0; n < values; ++n)
+				difference = std::max(difference, std::abs(pa[n] - pb[n]));
+		}
+		else
+		{
+			const uint8_t *pa = a.ptr<uint8_t>(row);
+			const uint8_t *pb = b.ptr<uint8_t>(row);
+			for (int n = 0; n < values; ++n)
+				difference = std::max(difference, std::abs(pa[n] - pb[n]));
+		}
+	}
+
+	return difference;
+}
+
+void clampDepth(Mat &depth, uint16_t low, uint16_t high)
+{
+	for (int row = 0; row < depth.rows; ++row)
+	{
+		uint16_t *value = depth.ptr<uint16_t>(row);
+		for (int col = 0; col < depth.cols; ++col)
+		{
+			// Pixels without valid samples stay 0
+			if (value[col] != 0)
+				value[col] = std::min(high, std::max(low, value[col]));
+		}
+	}
+}
+
+/**
+ * @brief Measures the time of a number of iterations.
+ */
+class Stopwatch {
+public:
+	Stopwatch() : m_startTicks(cv::getTickCount()) {}
+
+	double getTime() const
+	{
+		return static_cast<double>(cv::getTickCount() - m_startTicks) / cv::getTickFrequency();
+	}
+
+private:
+	int64 m_startTicks;
+};
+
+void report(const string &kernel, const string &parameters, const Size &resolution, size_t frames, double seconds, int difference = -1, int tolerance = 0)
+{
+	Result result;
+	result.kernel = kernel;
+	result.parameters = parameters;
+	result.resolution = resolution;
+	result.nsPerPixel = seconds * 1e9 / (static_cast<double>(frames) * resolution.area());
+	result.fps = frames / seconds;
+	result.difference = difference;
+	result.tolerance = tolerance;
+	results.push_back(result);
+
+	stringstream res;
+	res << resolution.width << "x" << resolution.height;
+
+	cout << left << setw(14) << kernel
+		 << setw(22) << parameters
+		 << setw(11) << res.str()
+		 << right << fixed << setprecision(2)
+		 << setw(10) << result.nsPerPixel << " ns/px"
+		 << setw(10) << result.fps << " fps  ";
+
+	if (difference == 0)
+		cout << "exact";
+	else if (difference > 0 && difference <= tolerance)
+		cout << "max diff " << difference;
+	else if (difference > 0)
+		cout << "MISMATCH (max diff " << difference << ")";
+
+	cout << endl;
+}
+
+string describeFilter(size_t depth, size_t stepsize)
+{
+	stringstream ss;
+	ss << "depth " << depth << " step " << stepsize;
+	return ss.str();
+}
+
+/**
+ * @brief Moderate keystone like a beamer mounted slightly off axis.
+ */
+Mat createHomography(const Size &size)
+{
+	vector<Point2f> from, to;
+	from.push_back(Point2f(0, 0));
+	from.push_back(Point2f(static_cast<float>(size.width), 0));
+	from.push_back(Point2f(static_cast<float>(size.width), static_cast<float>(size.height)));
+	from.push_back(Point2f(0, static_cast<float>(size.height)));
+
+	to.push_back(Point2f(-0.05f * size.width, -0.03f * size.height));
+	to.push_back(Point2f(1.02f * size.width, -0.06f * size.height));
+	to.push_back(Point2f(1.06f * size.width, 1.04f * size.height));
+	to.push_back(Point2f(-0.02f * size.width, 1.01f * size.height));
+
+	return getPerspectiveTransform(from, to);
+}
+
+void benchmarkAveraging(const vector<Mat> &frames, const Size &resolution)
+{
+	const size_t depths[] = { 4, 16, 64 };
+	const size_t stepsizes[] = { 1, 2 };
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+	{
+		for (size_t s = 0; s < sizeof(stepsizes) / sizeof(stepsizes[0]); ++s)
+		{
+			AveragingFilter filter(depths[d], stepsizes[s], true);
+			AveragingFilter reference(depths[d], stepsizes[s], false);
+
+			Mat result, expected;
+
+			// Fill the history first, the app runs with a full one
+			for (size_t i = 0; i < depths[d]; ++i)
+			{
+				filter.addFrame(frames[i % frames.size()]);
+				reference.addFrame(frames[i % frames.size()]);
+			}
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[(depths[d] + i) % frames.size()];
+
+				Stopwatch timer;
+				filter.addFrame(frame);
+				filter.getFiltered(result);
+				seconds += timer.getTime();
+
+				Stopwatch referenceTimer;
+				reference.addFrame(frame);
+				reference.getFilteredReference(expected);
+				referenceSeconds += referenceTimer.getTime();
+
+				difference = std::max(difference, maxDifference(result, expected));
+			}
+
+			// The running sum rounds halves to even, the reference up
+			const int tolerance = 1;
+
+			report("average", describeFilter(depths[d], stepsizes[s]), resolution, benchmarkSettings.frames, seconds, difference, tolerance);
+			report("average ref", describeFilter(depths[d], stepsizes[s]), resolution, benchmarkSettings.frames, referenceSeconds);
+		}
+	}
+}
+
+void benchmarkMedian(const vector<Mat> &frames, const Size &resolution, uint16_t boxBottomDistanceInMM)
+{
+	const size_t depths[] = { 3, 5, 9, 15, 31, 101 };
+	const size_t stepsizes[] = { 1, 2 };
+
+	const uint16_t topOrig = boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+	{
+		for (size_t s = 0; s < sizeof(stepsizes) / sizeof(stepsizes[0]); ++s)
+		{
+			MedianFilter filter(depths[d], stepsizes[s]);
+			MedianFilter reference(depths[d], stepsizes[s]);
+
+			// Same as the app does, incremental results equal the clamped reference
+			const bool incremental = filter.enableIncremental(topOrig + 1, boxBottomDistanceInMM);
+
+			for (size_t i = 0; i < depths[d]; ++i)
+			{
+				filter.addFrame(frames[i % frames.size()]);
+				reference.addFrame(frames[i % frames.size()]);
+			}
+
+			Mat result, expected;
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[(depths[d] + i) % frames.size()];
+
+				Stopwatch timer;
+				filter.addFrame(frame);
+				filter.getFiltered<uint16_t>(result);
+				seconds += timer.getTime();
+
+				reference.addFrame(frame);
+				if (i >= benchmarkSettings.referenceFrames)
+					continue; // Sorting deep windows takes too long to check every frame
+
+				Stopwatch referenceTimer;
+				reference.getFilteredReference<uint16_t>(expected);
+				referenceSeconds += referenceTimer.getTime();
+
+				if (incremental)
+				{
+					clampDepth(expected, topOrig + 1, boxBottomDistanceInMM);
+				}
+
+				difference = std::max(difference, maxDifference(result, expected));
+			}
+
+			const size_t referenceFrames = std::min(benchmarkSettings.frames, benchmarkSettings.referenceFrames);
+
+			report(incremental ? "median inc" : "median", describeFilter(depths[d], stepsizes[s]), resolution, benchmarkSettings.frames, seconds, difference);
+			report("median ref", describeFilter(depths[d], stepsizes[s]), resolution, referenceFrames, referenceSeconds);
+		}
+	}
+}
+
+void benchmarkHoleFilling(const vector<Mat> &frames, const Size &resolution)
+{
+	// Sparse sensor dropouts only and with the shadow of a hand over the sand
+	const char *names[] = { "dropouts", "shadow" };
+
+	for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); ++n)
+	{
+		HoleFiller filler;
+		HoleFiller reference;
+
+		Mat depth, result, expected;
+
+		int difference = 0;
+		double seconds = 0.;
+		double referenceSeconds = 0.;
+		for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+		{
+			frames[i % frames.size()].copyTo(depth);
+			if (n == 1)
+			{
+				circle(depth, Point(depth.cols / 3, depth.rows / 2), depth.rows / 6, Scalar(0), -1);
+			}
+
+			Stopwatch timer;
+			filler.fill(depth, result);
+			seconds += timer.getTime();
+
+			Stopwatch referenceTimer;
+			reference.fillReference(depth, expected);
+			referenceSeconds += referenceTimer.getTime();
+
+			difference = std::max(difference, maxDifference(result, expected));
+		}
+
+		report("fill holes", names[n], resolution, benchmarkSettings.frames, seconds, difference);
+		report("fill holes ref", names[n], resolution, benchmarkSettings.frames, referenceSeconds);
+	}
+}
+
+void benchmarkSessionCoding(const vector<Mat> &frames, const Size &resolution)
+{
+	vector<uint8_t> encoded;
+	Mat decoded(resolution, CV_16UC1);
+
+	int difference = 0;
+	size_t encodedBytes = 0;
+	double seconds = 0.;
+	double decodeSeconds = 0.;
+	for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+	{
+		const Mat &depth = frames[i % frames.size()];
+
+		Stopwatch timer;
+		const size_t length = encodeDepth(depth, encoded);
+		seconds += timer.getTime();
+
+		Stopwatch decodeTimer;
+		if (!decodeDepth(&encoded[0], length, decoded))
+			decoded.setTo(Scalar(0));
+		decodeSeconds += decodeTimer.getTime();
+
+		encodedBytes += length;
+		difference = std::max(difference, maxDifference(decoded, depth));
+	}
+
+	// Coded size relative to the raw 16 bit frames
+	stringstream ss;
+	ss << fixed << setprecision(1) << "ratio " << 100. * encodedBytes / (benchmarkSettings.frames * resolution.area() * sizeof(uint16_t)) << "%";
+
+	report("delta rle", ss.str(), resolution, benchmarkSettings.frames, seconds, difference);
+	report("delta rle dec", ss.str(), resolution, benchmarkSettings.frames, decodeSeconds);
+}
+
+void benchmarkRendering(const vector<Mat> &frames, const Size &resolution, uint16_t boxBottomDistanceInMM, const Mat &colorBand, const Mat &treasure)
+{
+	const Mat homography = createHomography(resolution);
+	TileRenderer renderer(homography, resolution);
+
+	// Warping
+	{
+		Mat result, expected;
+
+		int difference = 0;
+		double seconds = 0.;
+		double referenceSeconds = 0.;
+		for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+		{
+			const Mat &frame = frames[i % frames.size()];
+
+			Stopwatch timer;
+			renderer.warp(frame, result);
+			seconds += timer.getTime();
+
+			Stopwatch referenceTimer;
+			warpPerspective(frame, expected, homography, resolution);
+			referenceSeconds += referenceTimer.getTime();
+
+			difference = std::max(difference, maxDifference(result, expected));
+		}
+
+		report("warp", "remap tables", resolution, benchmarkSettings.frames, seconds, difference);
+		report("warp ref", "warpPerspective", resolution, benchmarkSettings.frames, referenceSeconds);
+	}
+
+	Mat warped;
+	warpPerspective(frames[0], warped, homography, resolution);
+
+	const Mat bands[] = { Mat(), colorBand };
+	for (size_t b = 0; b < 2; ++b)
+	{
+		const string parameters = bands[b].empty() ? "greyscale" : "colorband";
+
+		ColorTable colors;
+		colors.update(boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM, bands[b]);
+
+		// Colorization
+		{
+			Mat result, expected;
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				Stopwatch timer;
+				colors.apply(warped, result);
+				seconds += timer.getTime();
+
+				Stopwatch referenceTimer;
+				sandboxNormalizeAndColor(warped, expected, boxBottomDistanceInMM, bands[b]);
+				referenceSeconds += referenceTimer.getTime();
+
+				difference = std::max(difference, maxDifference(result, expected));
+			}
+
+			report("colorize", parameters, resolution, benchmarkSettings.frames, seconds, difference);
+			report("colorize ref", parameters, resolution, benchmarkSettings.frames, referenceSeconds);
+		}
+
+		// Fused warp and colorize against the separate reference passes
+		{
+			Mat result, depthWarped, expected, expectedWarped;
+
+			int difference = 0;
+			double seconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[i % frames.size()];
+
+				Stopwatch timer;
+				renderer.render(frame, result, colors, &depthWarped);
+				seconds += timer.getTime();
+
+				warpPerspective(frame, expectedWarped, homography, resolution);
+				sandboxNormalizeAndColor(expectedWarped, expected, boxBottomDistanceInMM, bands[b]);
+
+				difference = std::max(difference, std::max(maxDifference(result, expected), maxDifference(depthWarped, expectedWarped)));
+			}
+
+			report("render", parameters, resolution, benchmarkSettings.frames, seconds, difference);
+		}
+
+		// Incremental rendering, with a threshold of 0 every change is taken over
+		{
+			Mat result, depthWarped, expected, expectedWarped;
+
+			int difference = 0;
+			double seconds = 0.;
+			double rendered = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[i % frames.size()];
+
+				Stopwatch timer;
+				rendered += renderer.renderChanged(frame, result, colors, 0, &depthWarped, i == 0);
+				seconds += timer.getTime();
+
+				renderer.render(frame, expected, colors, &expectedWarped);
+
+				difference = std::max(difference, std::max(maxDifference(result, expected), maxDifference(depthWarped, expectedWarped)));
+			}
+
+			stringstream ss;
+			ss << parameters << " " << static_cast<int>(100. * rendered / benchmarkSettings.frames + .5) << "% tiles";
+
+			report("render inc", ss.str(), resolution, benchmarkSettings.frames, seconds, difference);
+		}
+	}
+
+	// Sand plane of a tilted sensor, fitted to level sand and corrected while rendering
+	{
+		ColorTable colors;
+		colors.update(boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM, colorBand);
+
+		// Inverse depth linear in sensor coordinates, about 5% depth change over the width
+		const Mat &frame = frames[0];
+		const uint16_t sandLevelInMM = boxBottomDistanceInMM - settings.maxSandDepthInMM;
+		const double slope = 0.05 / frame.cols;
+
+		Mat truth(1, 3, CV_64FC1);
+		double *coefficients = truth.ptr<double>(0);
+		coefficients[0] = slope / sandLevelInMM;
+		coefficients[1] = 0.5 * slope / sandLevelInMM;
+		coefficients[2] = (1. - slope * frame.cols / 2 - 0.5 * slope * frame.rows / 2) / sandLevelInMM;
+
+		const SandPlane expectedPlane(truth);
+
+		// Every 7th pixel is a dropout and a hand is in the picture
+		Mat level(frame.size(), CV_16UC1);
+		for (int y = 0; y < level.rows; ++y)
+		{
+			for (int x = 0; x < level.cols; ++x)
+			{
+				const bool hand = x < level.cols / 4 && y < level.rows / 4;
+				const bool dropout = (x + y) % 7 == 0;
+				level.at<uint16_t>(y, x) = dropout ? 0 : saturate_cast<uint16_t>(expectedPlane.depthAt(x, y) - (hand ? 300 : 0));
+			}
+		}
+
+		Mat offsets, expectedOffsets;
+		expectedPlane.getCorrection(homography, resolution, sandLevelInMM, expectedOffsets);
+
+		SandPlane plane;
+		Stopwatch fitTimer;
+		const bool fitted = plane.fit(level, homography, resolution);
+		const double fitSeconds = fitTimer.getTime();
+
+		int difference = INT_MAX;
+		if (fitted)
+		{
+			plane.getCorrection(homography, resolution, sandLevelInMM, offsets);
+			difference = maxDifference(offsets, expectedOffsets);
+		}
+
+		report("plane fit", "ransac", resolution, 1, fitSeconds, difference, 1);
+
+		// Rendering with the correction against warp, offset and colorize
+		{
+			renderer.setDepthOffsets(expectedOffsets);
+
+			Mat result, depthWarped, expected, expectedWarped;
+
+			difference = 0;
+			double seconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[i % frames.size()];
+
+				Stopwatch timer;
+				renderer.render(frame, result, colors, &depthWarped);
+				seconds += timer.getTime();
+
+				warpPerspective(frame, expectedWarped, homography, resolution);
+				for (int y = 0; y < expectedWarped.rows; ++y)
+				{
+					for (int x = 0; x < expectedWarped.cols; ++x)
+					{
+						uint16_t &depth = expectedWarped.at<uint16_t>(y, x);
+						depth = depth ? saturate_cast<uint16_t>(depth + expectedOffsets.at<int16_t>(y, x)) : 0;
+					}
+				}
+				sandboxNormalizeAndColor(expectedWarped, expected, boxBottomDistanceInMM, colorBand);
+
+				difference = std::max(difference, std::max(maxDifference(result, expected), maxDifference(depthWarped, expectedWarped)));
+			}
+
+			renderer.setDepthOffsets(Mat());
+
+			report("render plane", "colorband", resolution, benchmarkSettings.frames, seconds, difference);
+		}
+	}
+
+	// Fading between colorbands by blending their tables against blending the colorized images
+	{
+		Mat reversedBand;
+		flip(colorBand, reversedBand, 1);
+
+		ColorTable from, to, blended;
+		from.update(boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM, colorBand);
+		to.update(boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM, reversedBand);
+
+		Mat result, fromImage, toImage, expected;
+
+		int difference = 0;
+		double seconds = 0.;
+		double referenceSeconds = 0.;
+		for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+		{
+			const uint8_t weight = static_cast<uint8_t>(255 * (i + 1) / benchmarkSettings.frames);
+
+			Stopwatch timer;
+			blended.blend(from, to, weight);
+			blended.apply(warped, result);
+			seconds += timer.getTime();
+
+			Stopwatch referenceTimer;
+			from.apply(warped, fromImage);
+			to.apply(warped, toImage);
+			addWeighted(fromImage, (255 - weight) / 255., toImage, weight / 255., 0., expected);
+			referenceSeconds += referenceTimer.getTime();
+
+			difference = std::max(difference, maxDifference(result, expected));
+		}
+
+		// Weights are rounded differently by addWeighted
+		report("lut fade", "table blend", resolution, benchmarkSettings.frames, seconds, difference, 1);
+		report("lut fade ref", "image blend", resolution, benchmarkSettings.frames, referenceSeconds);
+
+		// Cost of a fade frame in the sandbox, every step recolors all tiles. Compare with "render inc".
+		{
+			Mat depthWarped, expectedWarped;
+
+			difference = 0;
+			seconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[i % frames.size()];
+				const uint8_t weight = static_cast<uint8_t>(255 * (i + 1) / benchmarkSettings.frames);
+
+				Stopwatch timer;
+				blended.blend(from, to, weight);
+				renderer.renderChanged(frame, result, blended, 0, &depthWarped, true);
+				seconds += timer.getTime();
+
+				renderer.render(frame, expected, blended, &expectedWarped);
+
+				difference = std::max(difference, std::max(maxDifference(result, expected), maxDifference(depthWarped, expectedWarped)));
+			}
+
+			report("render fade", "blend + full render", resolution, benchmarkSettings.frames, seconds, difference);
+		}
+	}
+
+	// Treasure hunt and post effects on the colored image
+	{
+		ColorTable colors;
+		colors.update(boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM, colorBand);
+
+		Mat display;
+		colors.apply(warped, display);
+
+		const Mat sprite = treasure(Rect(0, 0, std::min(treasure.cols, resolution.width), std::min(treasure.rows, resolution.height)));
+
+		const size_t counts[] = { 1, 16, 64, 256 };
+		for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+		{
+			// Same positions for every run
+			RNG random(counts[c]);
+			TreasureField field;
+			for (size_t i = 0; i < counts[c]; ++i)
+			{
+				field.bury(sprite, random.uniform(0, resolution.width - sprite.cols + 1), random.uniform(0, resolution.height - sprite.rows + 1));
+			}
+
+			Compositor effects;
+			Mat result, expected;
+			Mat referenceSprite = sprite.clone(); // huntTreasure takes it non-const
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				display.copyTo(result);
+				display.copyTo(expected);
+
+				Stopwatch timer;
+				effects.clear();
+				field.draw(effects);
+				effects.apply(result, &warped);
+				const size_t found = field.hunt(warped);
+				seconds += timer.getTime();
+
+				size_t expectedFound = 0;
+				Stopwatch referenceTimer;
+				for (size_t n = 0; n < field.size(); ++n)
+				{
+					if (huntTreasure(warped, referenceSprite, expected, field.getRect(n).x, field.getRect(n).y))
+						++expectedFound;
+				}
+				referenceSeconds += referenceTimer.getTime();
+
+				difference = std::max(difference, found == expectedFound ? maxDifference(result, expected) : INT_MAX);
+			}
+
+			stringstream ss;
+			ss << counts[c] << " objects";
+
+			report("treasure", ss.str(), resolution, benchmarkSettings.frames, seconds, difference);
+			report("treasure ref", ss.str(), resolution, benchmarkSettings.frames, referenceSeconds);
+		}
+
+		// Single effects against full frame passes
+		Mat overlay = display.clone();
+		invertMat(overlay);
+
+		const Vec3b color(40, 160, 220);
+		const uint8_t alpha = 96;
+
+		const char *names[] = { "invert", "fade", "flash", "blend", "blit" };
+		for (int effect = 0; effect < 5; ++effect)
+		{
+			Compositor effects;
+			switch (effect)
+			{
+			case 0: effects.invert(); break;
+			case 1: effects.fade(color, alpha); break;
+			case 2: effects.flash(color, alpha); break;
+			case 3: effects.blend(overlay, 0, 0, alpha); break;
+			case 4: effects.blit(Sprite(overlay, display.at<Vec3b>(0, 0)), 0, 0); break;
+			}
+
+			Mat result, expected;
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				display.copyTo(result);
+
+				Stopwatch timer;
+				effects.apply(result);
+				seconds += timer.getTime();
+
+				Stopwatch referenceTimer;
+				switch (effect)
+				{
+				case 0:
+					display.copyTo(expected);
+					invertMat(expected);
+					break;
+				case 1:
+					addWeighted(display, (255 - alpha) / 255., Mat(display.rows, display.cols, CV_8UC3, Scalar(color[0], color[1], color[2])), alpha / 255., 0., expected);
+					break;
+				case 2:
+					add(display, Mat(display.rows, display.cols, CV_8UC3, Scalar(color[0] * alpha / 255., color[1] * alpha / 255., color[2] * alpha / 255.)), expected);
+					break;
+				case 3:
+					addWeighted(display, (255 - alpha) / 255., overlay, alpha / 255., 0., expected);
+					break;
+				case 4:
+					// Pixels with the key color stay
+					overlay.copyTo(expected);
+					for (int row = 0; row < expected.rows; ++row)
+					{
+						for (int col = 0; col < expected.cols; ++col)
+						{
+							if (overlay.at<Vec3b>(row, col) == display.at<Vec3b>(0, 0))
+								expected.at<Vec3b>(row, col) = display.at<Vec3b>(row, col);
+						}
+					}
+					break;
+				}
+				referenceSeconds += referenceTimer.getTime();
+
+				difference = std::max(difference, maxDifference(result, expected));
+			}
+
+			// Weights are rounded differently by addWeighted
+			const int tolerance = (effect == 1 || effect == 3) ? 1 : 0;
+			report(names[effect], "", resolution, benchmarkSettings.frames, seconds, difference, tolerance);
+			report(string(names[effect]) + " ref", "", resolution, benchmarkSettings.frames, referenceSeconds);
+		}
+
+		// Effects within the tile sweep against a separate pass
+		{
+			RNG random(64);
+			TreasureField field;
+			for (size_t i = 0; i < 64; ++i)
+			{
+				field.bury(sprite, random.uniform(0, resolution.width - sprite.cols + 1), random.uniform(0, resolution.height - sprite.rows + 1));
+			}
+
+			Compositor effects;
+			field.draw(effects);
+			effects.invert();
+
+			Mat result, depthWarped, expected, expectedWarped;
+
+			int difference = 0;
+			double seconds = 0.;
+			double referenceSeconds = 0.;
+			for (size_t i = 0; i < benchmarkSettings.frames; ++i)
+			{
+				const Mat &frame = frames[i % frames.size()];
+
+				Stopwatch timer;
+				renderer.render(frame, result, colors, &depthWarped, &effects);
+				seconds += timer.getTime();
+
+				Stopwatch referenceTimer;
+				renderer.render(frame, expected, colors, &expectedWarped);
+				effects.apply(expected, &expectedWarped);
+				referenceSeconds += referenceTimer.getTime();
+
+				difference = std::max(difference, maxDifference(result, expected));
+			}
+
+			report("render fx", "64 objects invert", resolution, benchmarkSettings.frames, seconds, difference);
+			report("render fx ref", "separate pass", resolution, benchmarkSettings.frames, referenceSeconds);
+		}
+	}
+}
+
+bool loadFrames(FrameSource &source, size_t count, vector<Mat> &frames)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		Mat depth;
+		if (!source.grab() || !source.retrieve(depth, CV_CAP_OPENNI_DEPTH_MAP))
+			break;
+
+		frames.push_back(depth.clone());
+	}
+
+	return !frames.empty();
+}
+
+/**
+ * @brief Box bottom like the automatic calibration of the app estimates it.
+ */
+uint16_t estimateBoxBottom(const Mat &depth)
+{
+	uint64_t val = 0;
+	unsigned int num = 0;
+	for (int x = 0; x < depth.cols; x += depth.cols / 16)
+	{
+		for (int y = 0; y < depth.rows; y += depth.rows / 16)
+		{
+			val += depth.at<uint16_t>(Point(x, y));
+			++num;
+		}
+	}
+
+	return static_cast<uint16_t>(val / num + settings.maxSandDepthInMM);
+}
+
+Mat createColorBand()
+{
+	const int fullRange = settings.maxSandDepthInMM + settings.maxSandHeightInMM;
+
+	if (!benchmarkSettings.colorFile.empty())
+	{
+		Mat band = imread(benchmarkSettings.colorFile, 1);
+		if (band.rows == 1 && band.cols == fullRange)
+			return band;
+
+		cerr << "Unusable colorband " << benchmarkSettings.colorFile << ", using a generated one" << endl;
+	}
+
+	// Blue to green to white
+	Mat band(1, fullRange, CV_8UC3);
+	for (int col = 0; col < fullRange; ++col)
+	{
+		const int v = col * 510 / fullRange;
+		band.at<Vec3b>(0, col) = v < 255 ? Vec3b(saturate_cast<uint8_t>(255 - v), saturate_cast<uint8_t>(v), 0)
+		                                 : Vec3b(saturate_cast<uint8_t>(v - 255), 255, saturate_cast<uint8_t>(v - 255));
+	}
+
+	return band;
+}
+
+Mat createTreasure()
+{
+	// Checkerboard with magenta (transparent) holes
+	Mat treasure(64, 64, CV_8UC3);
+	for (int y = 0; y < treasure.rows; ++y)
+	{
+		for (int x = 0; x < treasure.cols; ++x)
+		{
+			treasure.at<Vec3b>(y, x) = ((x / 8 + y / 8) % 2) ? Vec3b(0, 215, 255) : Vec3b(255, 0, 255);
+		}
+	}
+
+	return treasure;
+}
+
+bool writeCsv(const string &file)
+{
+	ofstream out(file.c_str());
+	if (!out)
+		return false;
+
+	out << "kernel,parameters,width,height,ns_per_pixel,fps,max_difference,tolerance" << endl;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result &r = results[i];
+		out << r.kernel << "," << r.parameters << "," << r.resolution.width << "," << r.resolution.height << ","
+			<< r.nsPerPixel << "," << r.fps << ",";
+
+		if (r.difference >= 0)
+			out << r.difference << "," << r.tolerance;
+		else
+			out << ",";
+
+		out << endl;
+	}
+
+	return out.good();
+}
+
+bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
+{
+	const char *keys =
+		"{src|source|synthetic|Frame source. synthetic for generated terrain or a recorded session file}"
+		"{n|frames|20|Timed frames per kernel}"
+		"{rn|referenceframes|3|Timed frames for the median reference which is slow for deep windows}"
+		"{r|resolutions|320x240,640x480,1024x768|Comma separated resolutions the depth frames are scaled to}"
+		"{d|depth|90|Maximum sand depth below plane in mm}"
+		"{t|top|200|Maximum sand height above plane in mm}"
+		"{g|ground|-1|Distance of the sand plane to the sensor. (-1 to estimate it from the first frame.)}"
+		"{c|colors|NONE|Colorband image to use. NONE for a generated one}"
+		"{thr|threads|0|Number of threads for filtering and colorization. (0 = one per core)}"
+		"{csv|csv|NONE|Write the results as CSV to the given file. NONE to disable}"
+		"{h|help|false|Print help}";
+
+	CommandLineParser clp(argc, argv, keys);
+
+	quit = false;
+	if (clp.get<bool>("h"))
+	{
+		cout << "Usage: " << argv[0] << " [options]" << endl;
+		clp.printParams();
+		quit = true;
+		return true;
+	}
+
+	settings.frameSource = clp.get<std::string>("src");
+	settings.realtime = false;
+	settings.maxSandDepthInMM = clp.get<int>("d");
+	settings.maxSandHeightInMM = clp.get<int>("t");
+	settings.sandPlaneDistanceInMM = clp.get<int>("g");
+	settings.threads = static_cast<size_t>(std::max(0, clp.get<int>("thr")));
+
+	benchmarkSettings.frames = static_cast<size_t>(std::max(1, clp.get<int>("n")));
+	benchmarkSettings.referenceFrames = static_cast<size_t>(std::max(1, clp.get<int>("rn")));
+
+	benchmarkSettings.colorFile = clp.get<std::string>("c");
+	if (benchmarkSettings.colorFile == "NONE") benchmarkSettings.colorFile.clear();
+
+	benchmarkSettings.csvFile = clp.get<std::string>("csv");
+	if (benchmarkSettings.csvFile == "NONE") benchmarkSettings.csvFile.clear();
+
+	stringstream resolutions(clp.get<std::string>("r"));
+	string resolution;
+	while (getline(resolutions, resolution, ','))
+	{
+		int width = 0, height = 0;
+		char x = 0;
+		stringstream rs(resolution);
+		if (!(rs >> width >> x >> height) || x != 'x' || width < 16 || height < 16)
+		{
+			cerr << "Invalid resolution " << resolution << endl;
+			return false;
+		}
+
+		benchmarkSettings.resolutions.push_back(Size(width, height));
+	}
+
+	return !benchmarkSettings.resolutions.empty();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	bool quit;
+	if (!parseSettingsFromCommandline(argc, argv, quit))
+		return 1;
+
+	if (quit)
+		return 0;
+
+	setWorkerThreads(settings.threads);
+	cout << "Using " << getWorkerThreads() << " worker thread(s)" << endl;
+
+	Ptr<FrameSource> source = createFrameSource(settings.frameSource, false);
+	if (source.empty() || !source->open())
+	{
+		cerr << "Failed to open frame source " << settings.frameSource << endl;
+		return 1;
+	}
+
+	// Enough distinct frames for the deepest filter window
+	vector<Mat> sourceFrames;
+	if (!loadFrames(*source, 120, sourceFrames))
+	{
+		cerr << "Failed to read frames from " << source->name() << endl;
+		return 1;
+	}
+
+	cout << "Read " << sourceFrames.size() << " frames from " << source->name() << endl;
+
+	const uint16_t boxBottomDistanceInMM = (settings.sandPlaneDistanceInMM >= 0)
+		? static_cast<uint16_t>(settings.sandPlaneDistanceInMM + settings.maxSandDepthInMM)
+		: estimateBoxBottom(sourceFrames[0]);
+
+	settings.boxBottomDistanceInMM = boxBottomDistanceInMM;
+	cout << "Box bottom at " << boxBottomDistanceInMM << "mm" << endl;
+
+	const Mat colorBand = createColorBand();
+	const Mat treasure = createTreasure();
+
+	for (size_t r = 0; r < benchmarkSettings.resolutions.size(); ++r)
+	{
+		const Size &resolution = benchmarkSettings.resolutions[r];
+
+		vector<Mat> frames(sourceFrames.size());
+		for (size_t i = 0; i < sourceFrames.size(); ++i)
+		{
+			// Nearest neighbour keeps the depth values of the sensor
+			resize(sourceFrames[i], frames[i], resolution, 0, 0, INTER_NEAREST);
+		}
+
+		cout << endl;
+		benchmarkAveraging(frames, resolution);
+		benchmarkMedian(frames, resolution, boxBottomDistanceInMM);
+		benchmarkHoleFilling(frames, resolution);
+		benchmarkSessionCoding(frames, resolution);
+		benchmarkRendering(frames, resolution, boxBottomDistanceInMM, colorBand, treasure);
+	}
+
+	if (!benchmarkSettings.csvFile.empty() && !writeCsv(benchmarkSettings.csvFile))
+	{
+		cerr << "Failed to write " << benchmarkSettings.csvFile << endl;
+		return 1;
+	}
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		if (results[i].difference > results[i].tolerance)
+			++mismatches;
+	}
+
+	if (mismatches > 0)
+	{
+		cerr << endl << mismatches << " kernel(s) differ from their reference beyond tolerance" << endl;
+		return 2;
+	}
+
+	cout << endl << "All optimized kernels match their reference" << endl;
+	return 0;
+}
@@ -1,13 +1,159 @@
 #include "AveragingFilter.h"
+#include "ParallelRows.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define AVERAGING_FILTER_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace cv;
 using namespace std;
 
-AveragingFilter::AveragingFilter(const size_t depth, const size_t stepsize)
+namespace {
+
+/**
+ * @brief Adds the incoming and subtracts the outgoing frame from the running sum.
+ */
+class SumUpdate : public RowBody {
+public:
+	SumUpdate(cv::Mat &sum, const cv::Mat &incoming, const cv::Mat &outgoing)
+		: m_sum(sum)
+		, m_incoming(incoming)
+		, m_outgoing(outgoing) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const size_t COLS = m_incoming.cols;
+
+		if (m_outgoing.data == NULL)
+		{
+			for (int row = begin; row < end; ++row)
+			{
+				int32_t *sum = m_sum.ptr<int32_t>(row);
+				const uint16_t *in = m_incoming.ptr<uint16_t>(row);
+
+				for (size_t col = 0; col < COLS; ++col)
+				{
+					sum[col] += in[col];
+				}
+			}
+		}
+		else
+		{
+			for (int row = begin; row < end; ++row)
+			{
+				int32_t *sum = m_sum.ptr<int32_t>(row);
+				const uint16_t *in = m_incoming.ptr<uint16_t>(row);
+				const uint16_t *out = m_outgoing.ptr<uint16_t>(row);
+
+				for (size_t col = 0; col < COLS; ++col)
+				{
+					sum[col] += static_cast<int32_t>(in[col]) - static_cast<int32_t>(out[col]);
+				}
+			}
+		}
+	}
+
+private:
+	cv::Mat &m_sum;
+	const cv::Mat &m_incoming;
+	const cv::Mat &m_outgoing;
+};
+
+/**
+ * @brief Divides the running sum by the number of valid samples of every pixel.
+ * Pixels without any valid sample stay 0.
+ */
+class SumScale : public RowBody {
+public:
+	SumScale(const cv::Mat &sum, const cv::Mat &counts, cv::Mat &result)
+		: m_sum(sum)
+		, m_counts(counts)
+		, m_result(result) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const int COLS = m_result.cols;
+
+		for (int row = begin; row < end; ++row)
+		{
+			const int32_t *sum = m_sum.ptr<int32_t>(row);
+			const uint16_t *count = m_counts.ptr<uint16_t>(row);
+			uint16_t *dst = m_result.ptr<uint16_t>(row);
+
+			int col = 0;
+
+#ifdef AVERAGING_FILTER_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i one = _mm_set1_epi32(1);
+			const __m128i bias32 = _mm_set1_epi32(0x8000);
+			const __m128i bias16 = _mm_set1_epi16(static_cast<short>(0x8000));
+			for (; col + 8 <= COLS; col += 8)
+			{
+				const __m128i counts = _mm_loadu_si128(reinterpret_cast<const __m128i*>(count + col));
+				__m128i low = _mm_unpacklo_epi16(counts, zero);
+				__m128i high = _mm_unpackhi_epi16(counts, zero);
+
+				// Sums of pixels without samples are 0, dividing them by 1 keeps them at 0
+				low = _mm_or_si128(low, _mm_and_si128(_mm_cmpeq_epi32(low, zero), one));
+				high = _mm_or_si128(high, _mm_and_si128(_mm_cmpeq_epi32(high, zero), one));
+
+				const __m128i first = _mm_cvtps_epi32(_mm_div_ps(
+					_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sum + col))), _mm_cvtepi32_ps(low)));
+				const __m128i second = _mm_cvtps_epi32(_mm_div_ps(
+					_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sum + col + 4))), _mm_cvtepi32_ps(high)));
+
+				// Unsigned saturation isn't available before SSE4.1, pack biased values
+				const __m128i result = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(first, bias32), _mm_sub_epi32(second, bias32)), bias16);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + col), result);
+			}
+#endif
+
+			for (; col < COLS; ++col)
+			{
+				// Same float division and rounding as the vectorized version
+				dst[col] = count[col] ? saturate_cast<uint16_t>(cvRound(static_cast<float>(sum[col]) / count[col])) : 0;
+			}
+		}
+	}
+
+private:
+	const cv::Mat &m_sum;
+	const cv::Mat &m_counts;
+	cv::Mat &m_result;
+};
+
+}
+
+AveragingFilter::AveragingFilter(const size_t depth, const size_t stepsize, const bool incremental)
 	: HistoryBuffer(depth)
 	, m_stepsize(stepsize)
+	, m_incremental(incremental)
 {
+	if (m_incremental)
+	{
+		enableValidCounts(m_stepsize);
+	}
+}
+
+void AveragingFilter::onFrameAdded(size_t slot, const cv::Mat &incoming, const cv::Mat &outgoing)
+{
+	if (!m_incremental || incoming.type() != CV_16UC1)
+		return;
+
+	if (slot % m_stepsize != 0)
+		return; // Slot isn't averaged
+
+	if (m_sum.data == NULL)
+	{
+		m_sum = Mat::zeros(incoming.rows, incoming.cols, CV_32SC1);
+	}
+
+	assert(m_sum.rows == incoming.rows);
+	assert(m_sum.cols == incoming.cols);
+	assert(outgoing.data == NULL || outgoing.type() == incoming.type());
 
+	parallelForRows(incoming.rows, incoming.cols * (2 * sizeof(uint16_t) + sizeof(int32_t)), SumUpdate(m_sum, incoming, outgoing));
 }
 
 void AveragingFilter::getFiltered(cv::Mat &result)
@@ -16,12 +162,56 @@ void AveragingFilter::getFiltered(cv::Mat &result)
 
 	assert(history.size() > 0);
 
+	if (!m_incremental || m_sum.data == NULL)
+	{
+		getFilteredReference(result);
+		return;
+	}
+
+	// Dropouts add 0 to the sum, only valid samples are counted
+	result.create(m_sum.rows, m_sum.cols, CV_16UC1);
+	parallelForRows(m_sum.rows, m_sum.cols * (sizeof(int32_t) + 2 * sizeof(uint16_t)), SumScale(m_sum, getValidCounts(), result));
+}
+
+void AveragingFilter::getFilteredReference(cv::Mat &result)
+{
+	std::vector<cv::Mat>& history = getHistory();
+
+	assert(history.size() > 0);
+
 	if(result.data == NULL)
 	{
 		// Reserve storage if not available
 		result = Mat(history[0].rows, history[0].cols, history[0].type());
 	}
 
+	if (result.type() == CV_16UC1)
+	{
+		// Depth maps only average valid samples, dropouts are 0
+		for (int row = 0; row < result.rows; ++row)
+		{
+			uint16_t *dst = result.ptr<uint16_t>(row);
+			for (int col = 0; col < result.cols; ++col)
+			{
+				uint32_t sum = 0;
+				uint32_t count = 0;
+				for (size_t pos = 0; pos < history.size(); pos += m_stepsize)
+				{
+					const uint16_t value = history[pos].at<uint16_t>(row, col);
+					if (value != 0)
+					{
+						sum += value;
+						++count;
+					}
+				}
+
+				dst[col] = count ? static_cast<uint16_t>((2 * sum + count) / (2 * count)) : 0;
+			}
+		}
+
+		return;
+	}
+
 	memset(result.data, 0, result.dataend - result.data);
 
 	double avgWeight = 1. / ceil((static_cast<double>(history.size()) / m_stepsize));
@@ -5,13 +5,34 @@
 
 class AveragingFilter : public HistoryBuffer {
 public:
-	AveragingFilter(const size_t depth, const size_t stepsize = 1);
+	/**
+	 * @param depth Number of frames in the history
+	 * @param stepsize Only every stepsize-th history slot is averaged
+	 * @param incremental If true CV_16UC1 frames are averaged with a running sum
+	 *                    updated as frames enter and leave the history.
+	 *
+	 * Depth maps (CV_16UC1) are averaged over their valid samples only, pixels
+	 * without any stay 0.
+	 */
+	AveragingFilter(const size_t depth, const size_t stepsize = 1, const bool incremental = true);
 
 	void getFiltered(cv::Mat &result);
 
+	/**
+	 * @brief Averages the whole history from scratch.
+	 * Cost grows with the history depth. Reference for the incremental version.
+	 */
+	void getFilteredReference(cv::Mat &result);
+
+protected:
+	virtual void onFrameAdded(size_t slot, const cv::Mat &incoming, const cv::Mat &outgoing);
+
 private:
 	const size_t m_stepsize;
+	const bool m_incremental;
 
+	// Per pixel sum (CV_32SC1) of all averaged frames currently in the history
+	cv::Mat m_sum;
 };
 
 #endif // AVERAGING_FILTER_H
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "CalibrationCache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "Settings.h"
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+const int SIGNATURE_COLS = 16;
+const int SIGNATURE_ROWS = 12;
+
+/**
+ * @brief Mean of the valid depth of every cell of a coarse grid.
+ */
+Mat computeSignature(const Mat &depthInMM)
+{
+	CV_Assert(depthInMM.type() == CV_16UC1);
+
+	vector<uint64_t> sums(SIGNATURE_COLS * SIGNATURE_ROWS, 0);
+	vector<uint32_t> counts(SIGNATURE_COLS * SIGNATURE_ROWS, 0);
+
+	for (int y = 0; y < depthInMM.rows; ++y)
+	{
+		const uint16_t *row = depthInMM.ptr<uint16_t>(y);
+		const int cellRow = (y * SIGNATURE_ROWS / depthInMM.rows) * SIGNATURE_COLS;
+
+		for (int x = 0; x < depthInMM.cols; ++x)
+		{
+			if (row[x] == 0)
+				continue; // Sensor dropout
+
+			const int cell = cellRow + x * SIGNATURE_COLS / depthInMM.cols;
+			sums[cell] += row[x];
+			++counts[cell];
+		}
+	}
+
+	Mat signature(SIGNATURE_ROWS, SIGNATURE_COLS, CV_16UC1);
+	uint16_t *cells = signature.ptr<uint16_t>(0);
+	for (size_t cell = 0; cell < sums.size(); ++cell)
+	{
+		cells[cell] = counts[cell] ? static_cast<uint16_t>(sums[cell] / counts[cell]) : 0;
+	}
+
+	return signature;
+}
+
+}
+
+CalibrationCache::CalibrationCache()
+	: boxBottomDistanceInMM(0)
+	, beamerXres(0)
+	, beamerYres(0)
+{
+}
+
+void CalibrationCache::set(const Mat &homography, uint16_t boxBottomDistanceInMM, const Mat &sandPlane, const Mat &depthInMM)
+{
+	this->homography = homography.clone();
+	this->boxBottomDistanceInMM = boxBottomDistanceInMM;
+	this->sandPlane = sandPlane.clone();
+	beamerXres = settings.beamerXres;
+	beamerYres = settings.beamerYres;
+	sensorSize = depthInMM.size();
+	depthSignature = computeSignature(depthInMM);
+}
+
+bool CalibrationCache::save(const std::string &file) const
+{
+	FileStorage fs(file, FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+
+	fs << "homography" << homography;
+	fs << "boxBottomDistanceInMM" << static_cast<int>(boxBottomDistanceInMM);
+	fs << "sandPlane" << sandPlane;
+	fs << "beamerXres" << beamerXres;
+	fs << "beamerYres" << beamerYres;
+	fs << "sensorCols" << sensorSize.width;
+	fs << "sensorRows" << sensorSize.height;
+	fs << "depthSignature" << depthSignature;
+
+	return true;
+}
+
+bool CalibrationCache::load(const std::string &file)
+{
+	FileStorage fs(file, FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+
+	int boxBottom = 0;
+	fs["homography"] >> homography;
+	fs["boxBottomDistanceInMM"] >> boxBottom;
+	fs["sandPlane"] >> sandPlane;
+	fs["beamerXres"] >> beamerXres;
+	fs["beamerYres"] >> beamerYres;
+	fs["sensorCols"] >> sensorSize.width;
+	fs["sensorRows"] >> sensorSize.height;
+	fs["depthSignature"] >> depthSignature;
+
+	if (homography.rows != 3 || homography.cols != 3 || homography.type() != CV_64FC1
+		|| depthSignature.rows != SIGNATURE_ROWS || depthSignature.cols != SIGNATURE_COLS || depthSignature.type() != CV_16UC1
+		|| (!sandPlane.empty() && (sandPlane.rows != 1 || sandPlane.cols != 3 || sandPlane.type() != CV_64FC1))
+		|| boxBottom <= 0 || boxBottom > std::numeric_limits<uint16_t>::max())
+	{
+		cerr << "Calibration file " << file << " is incomplete" << endl;
+		return false;
+	}
+
+	boxBottomDistanceInMM = static_cast<uint16_t>(boxBottom);
+	return true;
+}
+
+bool CalibrationCache::matches(const Mat &depthInMM, int toleranceInMM) const
+{
+	if (beamerXres != settings.beamerXres || beamerYres != settings.beamerYres)
+	{
+		cout << "Beamer resolution changed since the calibration" << endl;
+		return false;
+	}
+
+	if (depthInMM.size() != sensorSize)
+	{
+		cout << "Sensor resolution changed since the calibration" << endl;
+		return false;
+	}
+
+	const Mat live = computeSignature(depthInMM);
+	const uint16_t *reference = depthSignature.ptr<uint16_t>(0);
+	const uint16_t *current = live.ptr<uint16_t>(0);
+
+	vector<int> differences;
+	for (int cell = 0; cell < SIGNATURE_COLS * SIGNATURE_ROWS; ++cell)
+	{
+		if (reference[cell] == 0 || current[cell] == 0)
+			continue;
+
+		differences.push_back(std::abs(static_cast<int>(reference[cell]) - static_cast<int>(current[cell])));
+	}
+
+	// Too few valid cells to tell
+	if (differences.size() < static_cast<size_t>(SIGNATURE_COLS * SIGNATURE_ROWS / 2))
+	{
+		cout << "Too little valid depth to validate the calibration" << endl;
+		return false;
+	}
+
+	vector<int>::iterator median = differences.begin() + differences.size() / 2;
+	std::nth_element(differences.begin(), median, differences.end());
+
+	cout << "Depth differs from the calibration by " << *median << "mm (median)" << endl;
+	return *median <= toleranceInMM;
+}
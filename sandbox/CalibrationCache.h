@@ -0,0 +1,46 @@
+#ifndef CALIBRATION_CACHE_H
+#define CALIBRATION_CACHE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * @brief Result of the calibration stored between runs so an unmoved rig starts instantly.
+ * Besides homography and depth correction a coarse signature of the raw depth map is kept.
+ * A single live frame compared against it tells whether the sensor moved since.
+ */
+struct CalibrationCache {
+	CalibrationCache();
+
+	/**
+	 * @brief Stores the calibration, the depth signature is computed from the given frame.
+	 * @param depthInMM Raw depth map (CV_16UC1) taken right after calibration
+	 */
+	void set(const cv::Mat &homography, uint16_t boxBottomDistanceInMM, const cv::Mat &sandPlane, const cv::Mat &depthInMM);
+
+	bool save(const std::string &file) const;
+	bool load(const std::string &file);
+
+	/**
+	 * @brief Checks whether the cached calibration still fits the rig.
+	 * Beamer resolution and sensor size have to match. Signature cells are compared
+	 * by their median difference, so reshaped sand in a part of the box still passes
+	 * while a moved or tilted sensor shifts nearly every cell.
+	 * @param depthInMM Live raw depth map (CV_16UC1)
+	 * @param toleranceInMM Largest median difference of the signature cells
+	 */
+	bool matches(const cv::Mat &depthInMM, int toleranceInMM) const;
+
+	cv::Mat homography;
+	uint16_t boxBottomDistanceInMM;
+	cv::Mat sandPlane; // SandPlane coefficients, empty without plane correction
+	int beamerXres;
+	int beamerYres;
+	cv::Size sensorSize;
+
+	cv::Mat depthSignature; // CV_16UC1, mean depth per cell, 0 if the cell had no valid pixel
+};
+
+#endif // CALIBRATION_CACHE_H
@@ -0,0 +1,273 @@
+#include "ColorProfiles.h"
+
+#include <iostream>
+#include <sstream>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+/**
+ * @brief Loads a colorband, any width is accepted.
+ */
+bool loadColorFile(const std::string &colorFile, Mat &colors)
+{
+	colors = cv::imread(colorFile, 1);
+	if (colors.data == NULL)
+	{
+		cout << "Color file " << colorFile << " not found" << endl;
+		return false;
+	}
+
+	if (colors.rows != 1)
+	{
+		cout << "Color file " << colorFile << " ignored, the colorband must only have one row" << endl;
+		return false;
+	}
+
+	cout << "Loaded color file " << colorFile << endl;
+	return true;
+}
+
+/**
+ * @brief Stretches or squeezes a colorband to cover the sand range with one column per mm.
+ */
+Mat resampleBand(const Mat &band, int rangeInMM)
+{
+	if (band.empty() || band.cols == rangeInMM)
+		return band;
+
+	Mat resampled;
+	resize(band, resampled, Size(rangeInMM, 1), 0, 0, band.cols > rangeInMM ? INTER_AREA : INTER_LINEAR);
+	return resampled;
+}
+
+}
+
+ColorProfiles::ColorProfiles()
+	: m_stop(false)
+	, m_requested(0)
+	, m_published(MAX_PROFILES)
+	, m_tableAvailable(false)
+{
+	for (size_t profile = 0; profile < MAX_PROFILES; ++profile)
+	{
+		m_states[profile] = BAND_UNKNOWN;
+	}
+}
+
+ColorProfiles::~ColorProfiles()
+{
+	stop();
+}
+
+bool ColorProfiles::start(const std::string &prefix)
+{
+	m_prefix = prefix;
+
+	if (m_prefix.empty())
+	{
+		cout << "Displaying continous grey scale" << endl;
+
+		// Greyscale is the only profile
+		m_states[0] = BAND_LOADED;
+		for (size_t profile = 1; profile < MAX_PROFILES; ++profile)
+		{
+			m_states[profile] = BAND_MISSING;
+		}
+	}
+
+	return m_worker.start(workerThread, this);
+}
+
+void ColorProfiles::stop()
+{
+	{
+		ScopedLock lock(m_mutex);
+		m_stop = true;
+	}
+
+	m_wake.post();
+	m_worker.join();
+}
+
+void ColorProfiles::setLimits(uint16_t boxBottomDistanceInMM, int maxSandDepthInMM, int maxSandHeightInMM)
+{
+	Limits limits;
+	limits.boxBottomDistanceInMM = boxBottomDistanceInMM;
+	limits.maxSandDepthInMM = maxSandDepthInMM;
+	limits.maxSandHeightInMM = maxSandHeightInMM;
+
+	{
+		ScopedLock lock(m_mutex);
+		if (limits == m_limits)
+			return;
+
+		m_limits = limits;
+	}
+
+	m_wake.post();
+}
+
+bool ColorProfiles::select(size_t profile)
+{
+	{
+		ScopedLock lock(m_mutex);
+		if (profile >= MAX_PROFILES || m_states[profile] == BAND_MISSING)
+			return false;
+
+		m_requested = profile;
+	}
+
+	m_wake.post();
+	return true;
+}
+
+bool ColorProfiles::acquire(ColorTable &table)
+{
+	ScopedLock lock(m_mutex);
+	if (!m_tableAvailable)
+		return false;
+
+	// The old table goes back and is freed on the worker thread
+	table.swap(m_table);
+	m_tableAvailable = false;
+	return true;
+}
+
+void ColorProfiles::acquireBlocking(ColorTable &table)
+{
+	for (;;)
+	{
+		acquire(table);
+
+		{
+			ScopedLock lock(m_mutex);
+			if (m_published != MAX_PROFILES && !m_tableAvailable && !outdated())
+				return;
+		}
+
+		m_tableReady.wait();
+	}
+}
+
+bool ColorProfiles::pending()
+{
+	ScopedLock lock(m_mutex);
+	return m_tableAvailable || outdated();
+}
+
+void ColorProfiles::workerThread(void *arg)
+{
+	static_cast<ColorProfiles*>(arg)->work();
+}
+
+void ColorProfiles::work()
+{
+	// The first existing band is shown, load it before any other
+	size_t first = 0;
+	while (first < MAX_PROFILES && !loadBand(first))
+	{
+		++first;
+	}
+
+	{
+		ScopedLock lock(m_mutex);
+		if (first == MAX_PROFILES)
+		{
+			cout << "Displaying continous grey scale" << endl;
+			first = 0;
+			m_states[first] = BAND_LOADED;
+		}
+
+		m_requested = first;
+	}
+
+	bool prefetched = false;
+	for (;;)
+	{
+		bool build;
+		size_t profile;
+		Limits limits;
+		{
+			ScopedLock lock(m_mutex);
+			if (m_stop)
+				return;
+
+			build = buildPending();
+			profile = m_requested;
+			limits = m_limits;
+		}
+
+		if (build)
+		{
+			if (!loadBand(profile))
+			{
+				// Keep showing what was shown
+				ScopedLock lock(m_mutex);
+				if (m_requested == profile)
+					m_requested = (m_published != MAX_PROFILES) ? m_published : first;
+
+				continue;
+			}
+
+			// Fresh table, allocated and filled here instead of on the processing thread
+			ColorTable table;
+			table.update(limits.boxBottomDistanceInMM, limits.maxSandDepthInMM, limits.maxSandHeightInMM,
+				resampleBand(m_bands[profile], limits.maxSandDepthInMM + limits.maxSandHeightInMM));
+
+			{
+				ScopedLock lock(m_mutex);
+				if (m_requested == profile && m_limits == limits)
+				{
+					m_table.swap(table);
+					m_tableAvailable = true;
+					m_published = profile;
+					m_publishedLimits = limits;
+				}
+			}
+
+			m_tableReady.post();
+			continue;
+		}
+
+		if (!prefetched)
+		{
+			// Remaining bands so switching to them is quick, tables to build go first
+			prefetched = true;
+			for (size_t other = 0; other < MAX_PROFILES && prefetched; ++other)
+			{
+				{
+					ScopedLock lock(m_mutex);
+					prefetched = !m_stop && !buildPending();
+				}
+
+				if (prefetched)
+					loadBand(other);
+			}
+
+			continue;
+		}
+
+		m_wake.wait();
+	}
+}
+
+bool ColorProfiles::loadBand(size_t profile)
+{
+	{
+		ScopedLock lock(m_mutex);
+		if (m_states[profile] != BAND_UNKNOWN)
+			return m_states[profile] == BAND_LOADED;
+	}
+
+	stringstream ss;
+	ss << m_prefix << profile << ".png";
+
+	const bool loaded = loadColorFile(ss.str(), m_bands[profile]);
+
+	ScopedLock lock(m_mutex);
+	m_states[profile] = loaded ? BAND_LOADED : BAND_MISSING;
+	return loaded;
+}
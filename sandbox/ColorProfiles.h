@@ -0,0 +1,134 @@
+#ifndef COLOR_PROFILES_H
+#define COLOR_PROFILES_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <string>
+
+#include "Colorize.h"
+#include "Threading.h"
+
+/**
+ * @brief Loads colorbands and builds their color tables on a background thread.
+ * Bands of any width are resampled to the sand range. The processing thread only
+ * swaps a finished table in at the start of a frame, so switching profiles or
+ * changing the sand limits never stalls rendering.
+ *
+ * Only the first existing band is loaded before rendering starts, the others are
+ * loaded in the background afterwards.
+ */
+class ColorProfiles {
+public:
+	static const size_t MAX_PROFILES = 10;
+
+	ColorProfiles();
+	~ColorProfiles();
+
+	/**
+	 * @brief Starts loading in the background.
+	 * @param prefix Colorbands are prefix0.png to prefix9.png, empty for greyscale
+	 */
+	bool start(const std::string &prefix);
+
+	/**
+	 * @brief Stops the background thread.
+	 */
+	void stop();
+
+	/**
+	 * @brief Sets the depth range tables are built for, rebuilds the shown one if it changed.
+	 * Cheap if nothing changed so it can be called every frame.
+	 */
+	void setLimits(uint16_t boxBottomDistanceInMM, int maxSandDepthInMM, int maxSandHeightInMM);
+
+	/**
+	 * @brief Requests switching to a profile, shown once its table is ready.
+	 * @return False if there is no such colorband
+	 */
+	bool select(size_t profile);
+
+	/**
+	 * @brief Swaps in the newest table if one was finished since the last call.
+	 * @param table Table to replace, its buffers are reused in the background
+	 * @return True if the table was replaced
+	 */
+	bool acquire(ColorTable &table);
+
+	/**
+	 * @brief Waits until a table for the set limits is ready and swaps it in.
+	 */
+	void acquireBlocking(ColorTable &table);
+
+	/**
+	 * @return True while a requested profile or range isn't shown yet
+	 */
+	bool pending();
+
+private:
+	ColorProfiles(const ColorProfiles&);
+	ColorProfiles& operator=(const ColorProfiles&);
+
+	enum BandState {
+		BAND_UNKNOWN,
+		BAND_LOADED,
+		BAND_MISSING
+	};
+
+	struct Limits {
+		Limits() : boxBottomDistanceInMM(0), maxSandDepthInMM(-1), maxSandHeightInMM(-1) {}
+
+		bool operator==(const Limits &other) const
+		{
+			return boxBottomDistanceInMM == other.boxBottomDistanceInMM
+				&& maxSandDepthInMM == other.maxSandDepthInMM
+				&& maxSandHeightInMM == other.maxSandHeightInMM;
+		}
+
+		bool valid() const { return maxSandDepthInMM >= 0 && maxSandHeightInMM >= 0; }
+
+		uint16_t boxBottomDistanceInMM;
+		int maxSandDepthInMM;
+		int maxSandHeightInMM;
+	};
+
+	static void workerThread(void *arg);
+	void work();
+
+	/**
+	 * @brief Loads the band of a profile if that wasn't tried yet. Worker thread only.
+	 * @return True if the band exists
+	 */
+	bool loadBand(size_t profile);
+
+	/**
+	 * @return True if there is a request the published table doesn't match. Locked by caller.
+	 */
+	bool outdated() const { return m_requested != m_published || !(m_limits == m_publishedLimits); }
+
+	/**
+	 * @return True if there is a table to build. Locked by caller.
+	 */
+	bool buildPending() const { return outdated() && m_limits.valid(); }
+
+	std::string m_prefix;
+
+	Thread m_worker;
+	Semaphore m_wake;
+	Mutex m_mutex;
+	Semaphore m_tableReady;
+
+	// Guarded by m_mutex
+	bool m_stop;
+	size_t m_requested;
+	Limits m_limits;
+	size_t m_published;             // Profile and limits of the newest table built
+	Limits m_publishedLimits;
+	ColorTable m_table;             // Newest table until acquired, then the previous one
+	bool m_tableAvailable;
+	BandState m_states[MAX_PROFILES];
+
+	cv::Mat m_bands[MAX_PROFILES];  // Worker thread only
+};
+
+#endif // COLOR_PROFILES_H
@@ -0,0 +1,311 @@
+#define NOMINMAX
+
+#include "Colorize.h"
+#include "Settings.h"
+#include "ParallelRows.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define COLORIZE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+/**
+ * @brief Row band worker for sandboxNormalizeAndColor.
+ */
+class NormalizeAndColorRows : public RowBody {
+public:
+	NormalizeAndColorRows(const cv::Mat &depthWarped, cv::Mat &depthWarpedNormalized, uint16_t boxBottomDistanceInMM, const cv::Mat &colorBand)
+		: m_depthWarped(depthWarped)
+		, m_depthWarpedNormalized(depthWarpedNormalized)
+		, m_boxBottomDistanceInMM(boxBottomDistanceInMM)
+		, m_topOrig(boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM)
+		, m_colorBand(colorBand) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const bool colored = (m_colorBand.data != NULL);
+		const size_t cols = m_depthWarped.cols;
+
+		const uint16_t boxBottomDistanceInMM = m_boxBottomDistanceInMM;
+		const uint16_t topOrig = m_topOrig;
+
+		for (int row = begin; row < end; ++row)
+		{
+			const uint16_t *current = m_depthWarped.ptr<uint16_t>(row);
+			const uint16_t *rowEnd = current + cols;
+
+			if (colored)
+			{
+				uint16_t value;
+				uint8_t *target = m_depthWarpedNormalized.ptr<uint8_t>(row);
+				for(; current != rowEnd; ++current)
+				{
+					// Clip
+					value = boxBottomDistanceInMM - std::min<uint16_t>(boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, *current));
+					memcpy(target, m_colorBand.data + (value * 3), 3);
+
+					target += 3;
+				}
+			}
+			else
+			{
+				uint16_t value;
+				uint16_t *target = m_depthWarpedNormalized.ptr<uint16_t>(row);
+				const uint16_t range = boxBottomDistanceInMM - topOrig;
+				const uint16_t scale = std::numeric_limits<uint16_t>::max() / range;
+
+				for(; current != rowEnd; ++current)
+				{
+					// Clip
+					value = boxBottomDistanceInMM - std::min<uint16_t>(boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, *current));
+					*target = value * scale;
+
+					++target;
+				}
+			}
+		}
+	}
+
+private:
+	const cv::Mat &m_depthWarped;
+	cv::Mat &m_depthWarpedNormalized;
+	const uint16_t m_boxBottomDistanceInMM;
+	const uint16_t m_topOrig;
+	const cv::Mat &m_colorBand;
+};
+
+/**
+ * @brief Row band worker for ColorTable::apply.
+ */
+class ColorTableRows : public RowBody {
+public:
+	ColorTableRows(const ColorTable &table, const cv::Mat &depth, cv::Mat &colored)
+		: m_table(table)
+		, m_depth(depth)
+		, m_colored(colored) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int row = begin; row < end; ++row)
+		{
+			m_table.applyRow(m_depth.ptr<uint16_t>(row), m_colored.ptr<uint8_t>(row), m_depth.cols);
+		}
+	}
+
+private:
+	const ColorTable &m_table;
+	const cv::Mat &m_depth;
+	cv::Mat &m_colored;
+};
+
+}
+
+ColorTable::ColorTable()
+	: m_table(std::numeric_limits<uint16_t>::max() + 1)
+	, m_colored(false)
+	, m_boxBottomDistanceInMM(0)
+	, m_maxSandDepthInMM(-1)
+	, m_maxSandHeightInMM(-1)
+	, m_colorBandData(NULL)
+{
+}
+
+bool ColorTable::update(uint16_t boxBottomDistanceInMM, int maxSandDepthInMM, int maxSandHeightInMM, const cv::Mat &colorBand)
+{
+	if (boxBottomDistanceInMM == m_boxBottomDistanceInMM
+		&& maxSandDepthInMM == m_maxSandDepthInMM
+		&& maxSandHeightInMM == m_maxSandHeightInMM
+		&& colorBand.data == m_colorBandData)
+	{
+		return false; // Up to date
+	}
+
+	assert(colorBand.data == NULL || colorBand.type() == CV_8UC3);
+
+	m_boxBottomDistanceInMM = boxBottomDistanceInMM;
+	m_maxSandDepthInMM = maxSandDepthInMM;
+	m_maxSandHeightInMM = maxSandHeightInMM;
+	m_colorBandData = colorBand.data;
+	m_colored = (colorBand.data != NULL);
+
+	// Same arithmetic as sandboxNormalizeAndColor so results are bit-exact
+	const uint16_t topOrig = boxBottomDistanceInMM - maxSandDepthInMM - maxSandHeightInMM;
+	const uint16_t range = boxBottomDistanceInMM - topOrig;
+	const uint16_t scale = std::numeric_limits<uint16_t>::max() / range;
+
+	for (size_t depth = 0; depth < m_table.size(); ++depth)
+	{
+		// Clip
+		const uint16_t value = boxBottomDistanceInMM - std::min<uint16_t>(boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, static_cast<uint16_t>(depth)));
+
+		if (m_colored)
+		{
+			const uint8_t *color = colorBand.data + (value * 3);
+			m_table[depth] = color[0] | (color[1] << 8) | (color[2] << 16);
+		}
+		else
+		{
+			m_table[depth] = static_cast<uint16_t>(value * scale);
+		}
+	}
+
+	return true;
+}
+
+void ColorTable::swap(ColorTable &other)
+{
+	m_table.swap(other.m_table);
+	std::swap(m_colored, other.m_colored);
+	std::swap(m_boxBottomDistanceInMM, other.m_boxBottomDistanceInMM);
+	std::swap(m_maxSandDepthInMM, other.m_maxSandDepthInMM);
+	std::swap(m_maxSandHeightInMM, other.m_maxSandHeightInMM);
+	std::swap(m_colorBandData, other.m_colorBandData);
+}
+
+void ColorTable::blend(const ColorTable &from, const ColorTable &to, uint8_t weight)
+{
+	assert(from.m_colored && to.m_colored);
+
+	m_colored = true;
+	m_boxBottomDistanceInMM = to.m_boxBottomDistanceInMM;
+	m_maxSandDepthInMM = to.m_maxSandDepthInMM;
+	m_maxSandHeightInMM = to.m_maxSandHeightInMM;
+	m_colorBandData = NULL; // Not the table of any band, the next update rebuilds
+
+	// Every byte of the packed entries is a channel, blended as (a * (255 - w) + b * w) / 255 rounded
+	const uint8_t *a = reinterpret_cast<const uint8_t*>(&from.m_table[0]);
+	const uint8_t *b = reinterpret_cast<const uint8_t*>(&to.m_table[0]);
+	uint8_t *target = reinterpret_cast<uint8_t*>(&m_table[0]);
+
+	const size_t bytes = m_table.size() * sizeof(uint32_t);
+	const uint16_t keep = static_cast<uint16_t>(255 - weight);
+	size_t i = 0;
+
+#ifdef COLORIZE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i keepFactor = _mm_set1_epi16(keep);
+	const __m128i weightFactor = _mm_set1_epi16(weight);
+	const __m128i half = _mm_set1_epi16(128);
+
+	for (; i + 16 <= bytes; i += 16)
+	{
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+
+		// Sums stay below 2^16, div255 like the scalar path
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), keepFactor), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weightFactor)), half);
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), keepFactor), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weightFactor)), half);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+
+	for (; i < bytes; ++i)
+	{
+		const uint32_t t = a[i] * keep + b[i] * weight + 128;
+		target[i] = static_cast<uint8_t>((t + (t >> 8)) >> 8);
+	}
+}
+
+void ColorTable::applyRow(const uint16_t *depth, uint8_t *target, int count) const
+{
+	const uint32_t *table = &m_table[0];
+	const int end = count;
+	int col = 0;
+
+	if (m_colored)
+	{
+#ifdef __AVX2__
+		// Pack the 3 color bytes of each 32bit entry, 12 bytes per lane
+		const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+											  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+		// The second store writes 4 bytes past the 8 pixels which the next ones overwrite
+		for (; col + 10 <= end; col += 8)
+		{
+			const __m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + col)));
+			const __m256i colors = _mm256_shuffle_epi8(_mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 4), pack);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(target), _mm256_castsi256_si128(colors));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(target + 12), _mm256_extracti128_si256(colors, 1));
+			target += 24;
+		}
+#endif
+
+		// Whole 32bit stores, the spare byte is overwritten by the next pixel (little endian)
+		for (; col + 1 < end; ++col)
+		{
+			const uint32_t color = table[depth[col]];
+			memcpy(target, &color, 4);
+			target += 3;
+		}
+
+		if (col < end)
+		{
+			const uint32_t color = table[depth[col]];
+			memcpy(target, &color, 3);
+		}
+	}
+	else
+	{
+		uint16_t *grey = reinterpret_cast<uint16_t*>(target);
+
+#ifdef __AVX2__
+		for (; col + 16 <= end; col += 16)
+		{
+			const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(depth + col));
+			const __m256i lo = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(index)), 4);
+			const __m256i hi = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(index, 1)), 4);
+
+			// packus works per 128bit lane, restore the order afterwards
+			const __m256i values = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(grey), values);
+			grey += 16;
+		}
+#endif
+
+		for (; col < end; ++col)
+		{
+			*grey++ = static_cast<uint16_t>(table[depth[col]]);
+		}
+	}
+}
+
+void ColorTable::apply(const cv::Mat &depth, cv::Mat &colored) const
+{
+	assert(depth.type() == CV_16UC1);
+
+	colored.create(depth.rows, depth.cols, outputType());
+
+	const size_t rowBytes = depth.cols * (sizeof(uint16_t) + colored.elemSize());
+	parallelForRows(depth.rows, rowBytes, ColorTableRows(*this, depth, colored));
+}
+
+bool sandboxNormalizeAndColor(const cv::Mat &depthWarped, cv::Mat& depthWarpedNormalized, uint16_t boxBottomDistanceInMM, const cv::Mat &colorBand)
+{
+	const bool colored = (colorBand.data != NULL);
+
+	const size_t rows = depthWarped.rows;
+	const size_t cols = depthWarped.cols;
+	depthWarpedNormalized = Mat(rows, cols, colored ? colorBand.type() : depthWarped.type());
+
+	const size_t rowBytes = cols * (sizeof(uint16_t) + depthWarpedNormalized.elemSize());
+	parallelForRows(depthWarped.rows, rowBytes, NormalizeAndColorRows(depthWarped, depthWarpedNormalized, boxBottomDistanceInMM, colorBand));
+
+	return true;
+}
+
@@ -0,0 +1,84 @@
+#ifndef COLORIZE_H
+#define COLORIZE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Maps raw depth in mm to the projected color with a single table lookup.
+ * Clipping to the sand range, the offset from the box bottom and the colorband
+ * (or greyscale scale) are folded into one entry per possible depth value. The
+ * table only has to be rebuilt when one of them changes.
+ */
+class ColorTable {
+public:
+	ColorTable();
+
+	/**
+	 * @brief Rebuilds the table if any parameter differs from the last call.
+	 * @param boxBottomDistanceInMM Distance to box bottom from sensor in mm
+	 * @param maxSandDepthInMM Maximum sand depth below the plane
+	 * @param maxSandHeightInMM Maximum sand height above the plane
+	 * @param colorBand Color band to use for mapping (CV_8UC3), empty for grayscale.
+	 * @return True if the table was rebuilt
+	 */
+	bool update(uint16_t boxBottomDistanceInMM, int maxSandDepthInMM, int maxSandHeightInMM, const cv::Mat &colorBand);
+
+	/**
+	 * @brief Exchanges the tables without copying, e.g. to take over one built on another thread.
+	 */
+	void swap(ColorTable &other);
+
+	/**
+	 * @brief Fills the table with a mix of two colored tables, for fading between profiles.
+	 * Blending per depth value costs the same for any image size.
+	 * @param weight Weight of to, 0 gives from and 255 gives to
+	 */
+	void blend(const ColorTable &from, const ColorTable &to, uint8_t weight);
+
+	/**
+	 * @return Type of colorized images, CV_8UC3 with a colorband, CV_16UC1 otherwise
+	 */
+	int outputType() const { return m_colored ? CV_8UC3 : CV_16UC1; }
+	bool colored() const { return m_colored; }
+
+	/**
+	 * @brief Colorizes a whole depth map on the worker pool.
+	 * @param depth Depth map (CV_16UC1)
+	 * @param colored Destination, reallocated only if size or type don't fit
+	 */
+	void apply(const cv::Mat &depth, cv::Mat &colored) const;
+
+	/**
+	 * @brief Colorizes count consecutive pixels.
+	 * @param depth Source depth values
+	 * @param target First destination pixel, BGR triplets or 16bit grey values
+	 */
+	void applyRow(const uint16_t *depth, uint8_t *target, int count) const;
+
+private:
+	// Packed BGR (B in the lowest byte) or greyscale value per depth
+	std::vector<uint32_t> m_table;
+
+	bool m_colored;
+	uint16_t m_boxBottomDistanceInMM;
+	int m_maxSandDepthInMM;
+	int m_maxSandHeightInMM;
+	const uint8_t *m_colorBandData;
+};
+
+/**
+ * @brief Combined normalize and colorization of the depth map.
+ * Computes every pixel from scratch, reference for ColorTable.
+ *
+ * @param depthWarped Source depth map
+ * @param depthWarpedNormalized Destination image for colorized result.
+ * @param boxBottomDistanceInMM Distance to box bottom from sensor in mm
+ * @param colorBand Color band to use for mapping, empty for grayscale.
+ * @return True if successfull
+ */
+bool sandboxNormalizeAndColor(const cv::Mat &depthWarped, cv::Mat& depthWarpedNormalized, uint16_t boxBottomDistanceInMM, const cv::Mat &colorBand);
+
+#endif // COLORIZE_H
@@ -0,0 +1,496 @@
+#define NOMINMAX
+
+#include "Compositor.h"
+#include "ParallelRows.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define COMPOSITOR_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+const int BGR_BYTES = 3;
+
+/**
+ * @brief x / 255 rounded to nearest for x up to 255 * 255, exact.
+ */
+inline uint16_t div255(uint32_t x)
+{
+	const uint32_t t = x + 128;
+	return static_cast<uint16_t>((t + (t >> 8)) >> 8);
+}
+
+#ifdef COMPOSITOR_SSE2
+inline __m128i div255(const __m128i &x)
+{
+	const __m128i t = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/**
+ * @brief Weighted sum of 16 bytes and 16 words, divided by 255.
+ * @return div255(v * weight + added) per byte
+ */
+inline __m128i weightBytes(const __m128i &v, const __m128i &weight, const __m128i &addedLo, const __m128i &addedHi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), weight), addedLo);
+	const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), weight), addedHi);
+	return _mm_packus_epi16(div255(lo), div255(hi));
+}
+#endif
+
+void invertBytes(uint8_t *target, int bytes)
+{
+	int i = 0;
+
+#ifdef COMPOSITOR_SSE2
+	const __m128i ones = _mm_set1_epi8(-1);
+	for (; i + 16 <= bytes; i += 16)
+	{
+		__m128i *v = reinterpret_cast<__m128i*>(target + i);
+		_mm_storeu_si128(v, _mm_xor_si128(_mm_loadu_si128(v), ones));
+	}
+#endif
+
+	for (; i < bytes; ++i)
+	{
+		target[i] = 255 - target[i];
+	}
+}
+
+/**
+ * @param added Bytes added to 16 pixels, repeated over the row
+ */
+void flashPixels(uint8_t *target, int pixels, const uint8_t *added)
+{
+	const int bytes = pixels * BGR_BYTES;
+	int i = 0;
+
+#ifdef COMPOSITOR_SSE2
+	const __m128i add0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(added));
+	const __m128i add1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(added + 16));
+	const __m128i add2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(added + 32));
+	for (; i + 48 <= bytes; i += 48)
+	{
+		__m128i *v = reinterpret_cast<__m128i*>(target + i);
+		_mm_storeu_si128(v, _mm_adds_epu8(_mm_loadu_si128(v), add0));
+		_mm_storeu_si128(v + 1, _mm_adds_epu8(_mm_loadu_si128(v + 1), add1));
+		_mm_storeu_si128(v + 2, _mm_adds_epu8(_mm_loadu_si128(v + 2), add2));
+	}
+#endif
+
+	// Rest starts at a multiple of the pattern
+	for (int k = 0; i < bytes; ++i, ++k)
+	{
+		target[i] = static_cast<uint8_t>(std::min(255, target[i] + added[k]));
+	}
+}
+
+/**
+ * @param faded Color times alpha for 16 pixels, repeated over the row
+ */
+void fadePixels(uint8_t *target, int pixels, uint8_t alpha, const uint16_t *faded)
+{
+	const int bytes = pixels * BGR_BYTES;
+	const uint16_t keep = 255 - alpha;
+	int i = 0;
+
+#ifdef COMPOSITOR_SSE2
+	const __m128i weight = _mm_set1_epi16(keep);
+	for (; i + 48 <= bytes; i += 48)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			__m128i *v = reinterpret_cast<__m128i*>(target + i) + k;
+			const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(faded + k * 16));
+			const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(faded + k * 16 + 8));
+			_mm_storeu_si128(v, weightBytes(_mm_loadu_si128(v), weight, lo, hi));
+		}
+	}
+#endif
+
+	for (int k = 0; i < bytes; ++i, ++k)
+	{
+		target[i] = static_cast<uint8_t>(div255(target[i] * keep + faded[k]));
+	}
+}
+
+void blendPixels(uint8_t *target, const uint8_t *overlay, int pixels, uint8_t alpha)
+{
+	const int bytes = pixels * BGR_BYTES;
+	const uint16_t keep = 255 - alpha;
+	int i = 0;
+
+#ifdef COMPOSITOR_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weight = _mm_set1_epi16(keep);
+	const __m128i overlayWeight = _mm_set1_epi16(alpha);
+	for (; i + 16 <= bytes; i += 16)
+	{
+		__m128i *v = reinterpret_cast<__m128i*>(target + i);
+		const __m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(overlay + i));
+		const __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(o, zero), overlayWeight);
+		const __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(o, zero), overlayWeight);
+		_mm_storeu_si128(v, weightBytes(_mm_loadu_si128(v), weight, lo, hi));
+	}
+#endif
+
+	for (; i < bytes; ++i)
+	{
+		target[i] = static_cast<uint8_t>(div255(target[i] * keep + overlay[i] * alpha));
+	}
+}
+
+void blitPixels(uint8_t *target, const uint8_t *sprite, const uint8_t *mask, int pixels)
+{
+	const int bytes = pixels * BGR_BYTES;
+	int i = 0;
+
+#ifdef COMPOSITOR_SSE2
+	// Selecting twice doesn't change anything, a last iteration overlapping the previous one covers the rest
+	for (; i < bytes && bytes >= 16; i += 16)
+	{
+		i = std::min(i, bytes - 16);
+
+		__m128i *v = reinterpret_cast<__m128i*>(target + i);
+		const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i));
+		const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprite + i));
+		_mm_storeu_si128(v, _mm_or_si128(_mm_andnot_si128(m, _mm_loadu_si128(v)), _mm_and_si128(m, s)));
+	}
+#endif
+
+	for (; i < bytes; ++i)
+	{
+		target[i] = (target[i] & ~mask[i]) | (sprite[i] & mask[i]);
+	}
+}
+
+/**
+ * @brief Blits only where the depth is at least the limit.
+ */
+void blitDugPixels(uint8_t *target, const uint8_t *sprite, const uint8_t *mask, const uint16_t *depth, uint16_t limit, int pixels)
+{
+	int n = 0;
+
+#ifdef __AVX2__
+	// Spreads the depth comparison of 16 pixels over their 48 bytes
+	const __m128i spread0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+	const __m128i spread1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+	const __m128i spread2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+
+	// depth >= limit as signed comparison of biased values, limit is at least 1 here
+	const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+	const __m128i below = _mm_xor_si128(_mm_set1_epi16(static_cast<short>(limit - 1)), bias);
+
+	// Like in blitPixels the last iteration may overlap the previous one
+	for (; n < pixels && pixels >= 16; n += 16)
+	{
+		n = std::min(n, pixels - 16);
+
+		const __m128i d0 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + n)), bias);
+		const __m128i d1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + n + 8)), bias);
+		const __m128i dug = _mm_packs_epi16(_mm_cmpgt_epi16(d0, below), _mm_cmpgt_epi16(d1, below));
+
+		const __m128i spread[3] = { _mm_shuffle_epi8(dug, spread0), _mm_shuffle_epi8(dug, spread1), _mm_shuffle_epi8(dug, spread2) };
+		for (int k = 0; k < 3; ++k)
+		{
+			const int i = n * BGR_BYTES + k * 16;
+			__m128i *v = reinterpret_cast<__m128i*>(target + i);
+			const __m128i m = _mm_and_si128(spread[k], _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i)));
+			const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprite + i));
+			_mm_storeu_si128(v, _mm_or_si128(_mm_andnot_si128(m, _mm_loadu_si128(v)), _mm_and_si128(m, s)));
+		}
+	}
+#endif
+
+	for (; n < pixels; ++n)
+	{
+		if (depth[n] < limit)
+			continue;
+
+		for (int c = 0; c < BGR_BYTES; ++c)
+		{
+			const int i = n * BGR_BYTES + c;
+			target[i] = (target[i] & ~mask[i]) | (sprite[i] & mask[i]);
+		}
+	}
+}
+
+/**
+ * @brief Applies the effects to whole rows, optionally copying them first.
+ */
+class CompositeRows : public RowBody {
+public:
+	CompositeRows(const Compositor &compositor, const cv::Mat *source, cv::Mat &target, const cv::Mat *depthWarped)
+		: m_compositor(compositor)
+		, m_source(source)
+		, m_target(target)
+		, m_depthWarped(depthWarped) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const size_t pixelBytes = m_target.elemSize();
+
+		for (int row = begin; row < end; ++row)
+		{
+			uint8_t *target = m_target.ptr<uint8_t>(row);
+			if (m_source)
+			{
+				memcpy(target, m_source->ptr<uint8_t>(row), m_target.cols * pixelBytes);
+			}
+
+			const uint16_t *depth = m_depthWarped ? m_depthWarped->ptr<uint16_t>(row) : NULL;
+			m_compositor.applyRow(row, 0, m_target.cols, depth, target, pixelBytes);
+		}
+	}
+
+private:
+	const Compositor &m_compositor;
+	const cv::Mat *m_source;
+	cv::Mat &m_target;
+	const cv::Mat *m_depthWarped;
+};
+
+}
+
+Sprite::Sprite(const cv::Mat &image, const cv::Vec3b &key)
+	: image(image)
+{
+	assert(image.type() == CV_8UC3);
+
+	mask.create(image.rows, image.cols, CV_8UC3);
+	for (int row = 0; row < image.rows; ++row)
+	{
+		const Vec3b *pixel = image.ptr<Vec3b>(row);
+		Vec3b *opaque = mask.ptr<Vec3b>(row);
+		for (int col = 0; col < image.cols; ++col)
+		{
+			opaque[col] = (pixel[col] != key) ? Vec3b(255, 255, 255) : Vec3b(0, 0, 0);
+		}
+	}
+}
+
+void Compositor::clear()
+{
+	m_effects.clear();
+	m_imageEffects.clear();
+
+	// Bands and cells keep their memory for the next frame
+	for (size_t band = 0; band < m_bands.size(); ++band)
+	{
+		m_bands[band].clear();
+		for (size_t cell = 0; cell < m_cells[band].size(); ++cell)
+		{
+			m_cells[band][cell].clear();
+		}
+	}
+}
+
+Compositor::Effect& Compositor::add(EffectType type, const cv::Rect *rect)
+{
+	const int index = static_cast<int>(m_effects.size());
+	m_effects.push_back(Effect());
+
+	Effect &effect = m_effects.back();
+	effect.type = type;
+	effect.rect = rect ? *rect : Rect(0, 0, INT_MAX, INT_MAX);
+	effect.alpha = 0;
+	effect.digLimit = 0;
+
+	if (!rect)
+	{
+		m_imageEffects.push_back(index);
+	}
+	else if (rect->y + rect->height > 0 && rect->x + rect->width > 0)
+	{
+		const size_t first = std::max(0, rect->y) / BAND_ROWS;
+		const size_t last = (rect->y + rect->height - 1) / BAND_ROWS;
+		const size_t firstCell = std::max(0, rect->x) / CELL_COLS;
+		const size_t lastCell = (rect->x + rect->width - 1) / CELL_COLS;
+
+		if (m_bands.size() <= last)
+		{
+			m_bands.resize(last + 1);
+			m_cells.resize(last + 1);
+		}
+
+		for (size_t band = first; band <= last; ++band)
+		{
+			m_bands[band].push_back(index);
+
+			if (m_cells[band].size() <= lastCell)
+			{
+				m_cells[band].resize(lastCell + 1);
+			}
+
+			for (size_t cell = firstCell; cell <= lastCell; ++cell)
+			{
+				m_cells[band][cell].push_back(index);
+			}
+		}
+	}
+
+	return effect;
+}
+
+void Compositor::invert()
+{
+	add(INVERT, NULL);
+}
+
+void Compositor::fade(const cv::Vec3b &color, uint8_t alpha)
+{
+	Effect &effect = add(FADE, NULL);
+	effect.alpha = alpha;
+	for (int i = 0; i < PATTERN_BYTES; ++i)
+	{
+		effect.faded[i] = static_cast<uint16_t>(color[i % BGR_BYTES] * alpha);
+	}
+}
+
+void Compositor::flash(const cv::Vec3b &color, uint8_t intensity)
+{
+	Effect &effect = add(FLASH, NULL);
+	for (int i = 0; i < PATTERN_BYTES; ++i)
+	{
+		effect.added[i] = static_cast<uint8_t>(div255(color[i % BGR_BYTES] * intensity));
+	}
+}
+
+void Compositor::blend(const cv::Mat &overlay, int left, int top, uint8_t alpha)
+{
+	assert(overlay.type() == CV_8UC3);
+
+	const Rect rect(left, top, overlay.cols, overlay.rows);
+	Effect &effect = add(BLEND, &rect);
+	effect.image = overlay;
+	effect.alpha = alpha;
+}
+
+void Compositor::blit(const Sprite &sprite, int left, int top, uint16_t digLimit)
+{
+	const Rect rect(left, top, sprite.image.cols, sprite.image.rows);
+	Effect &effect = add(BLIT, &rect);
+	effect.image = sprite.image;
+	effect.mask = sprite.mask;
+	effect.digLimit = digLimit;
+}
+
+void Compositor::applyRow(int row, int left, int count, const uint16_t *depth, uint8_t *target, size_t pixelBytes) const
+{
+	const size_t band = row / BAND_ROWS;
+	const std::vector<int> *bandEffects = NULL;
+	if (band < m_bands.size())
+	{
+		// Spans within a single cell, like tiles, only need the effects of the cell
+		const size_t cell = left / CELL_COLS;
+		if (cell == (left + count - 1) / CELL_COLS)
+		{
+			bandEffects = (cell < m_cells[band].size()) ? &m_cells[band][cell] : NULL;
+		}
+		else
+		{
+			bandEffects = &m_bands[band];
+		}
+	}
+	const size_t bandCount = bandEffects ? bandEffects->size() : 0;
+
+	// Both lists are in order of scheduling, merge them
+	size_t i = 0, b = 0;
+	while (i < m_imageEffects.size() || b < bandCount)
+	{
+		int index;
+		if (b == bandCount || (i < m_imageEffects.size() && m_imageEffects[i] < (*bandEffects)[b]))
+			index = m_imageEffects[i++];
+		else
+			index = (*bandEffects)[b++];
+
+		applyEffect(m_effects[index], row, left, count, depth, target, pixelBytes);
+	}
+}
+
+void Compositor::applyEffect(const Effect &effect, int row, int left, int count, const uint16_t *depth, uint8_t *target, size_t pixelBytes) const
+{
+	// Part of the span the effect covers
+	const int begin = std::max(left, effect.rect.x);
+	const int end = std::min(left + count, effect.rect.x + effect.rect.width);
+	if (row < effect.rect.y || row - effect.rect.y >= effect.rect.height || begin >= end)
+		return;
+
+	uint8_t *pixels = target + (begin - left) * pixelBytes;
+	const int n = end - begin;
+
+	if (effect.type == INVERT)
+	{
+		invertBytes(pixels, static_cast<int>(n * pixelBytes));
+		return;
+	}
+
+	if (pixelBytes != BGR_BYTES)
+		return;
+
+	switch (effect.type)
+	{
+	case FADE:
+		fadePixels(pixels, n, effect.alpha, effect.faded);
+		break;
+	case FLASH:
+		flashPixels(pixels, n, effect.added);
+		break;
+	case BLEND:
+		blendPixels(pixels, effect.image.ptr<uint8_t>(row - effect.rect.y) + (begin - effect.rect.x) * BGR_BYTES, n, effect.alpha);
+		break;
+	case BLIT:
+		{
+			const uint8_t *sprite = effect.image.ptr<uint8_t>(row - effect.rect.y) + (begin - effect.rect.x) * BGR_BYTES;
+			const uint8_t *mask = effect.mask.ptr<uint8_t>(row - effect.rect.y) + (begin - effect.rect.x) * BGR_BYTES;
+
+			if (effect.digLimit == 0)
+			{
+				blitPixels(pixels, sprite, mask, n);
+			}
+			else
+			{
+				assert(depth);
+				blitDugPixels(pixels, sprite, mask, depth + (begin - left), effect.digLimit, n);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void Compositor::apply(cv::Mat &image, const cv::Mat *depthWarped) const
+{
+	if (m_effects.empty())
+		return;
+
+	assert(!depthWarped || depthWarped->size() == image.size());
+
+	const size_t rowBytes = image.cols * (2 * image.elemSize() + (depthWarped ? sizeof(uint16_t) : 0));
+	parallelForRows(image.rows, rowBytes, CompositeRows(*this, NULL, image, depthWarped));
+}
+
+void Compositor::apply(const cv::Mat &source, cv::Mat &target, const cv::Mat *depthWarped) const
+{
+	assert(!depthWarped || depthWarped->size() == source.size());
+
+	target.create(source.rows, source.cols, source.type());
+
+	const size_t rowBytes = source.cols * (2 * source.elemSize() + (depthWarped ? sizeof(uint16_t) : 0));
+	parallelForRows(source.rows, rowBytes, CompositeRows(*this, &source, target, depthWarped));
+}
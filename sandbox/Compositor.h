@@ -0,0 +1,134 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Image with a colour key for Compositor::blit.
+ * The key is resolved into a byte mask once so blitting is a plain select.
+ */
+struct Sprite {
+	Sprite() {}
+
+	/**
+	 * @param image Sprite image (CV_8UC3)
+	 * @param key Color of transparent pixels, magenta like huntTreasure by default
+	 */
+	Sprite(const cv::Mat &image, const cv::Vec3b &key = cv::Vec3b(255, 0, 255));
+
+	cv::Mat image;
+	cv::Mat mask; // CV_8UC3, 0xFF in every channel of opaque pixels
+};
+
+/**
+ * @brief Post effects on the projected image.
+ * Effects are scheduled for a frame and applied row by row while the rows are in cache
+ * anyway: within the tile sweep of TileRenderer::render or together with the copy of
+ * an image. They are applied in the order they were added.
+ *
+ * Only invert applies to greyscale (CV_16UC1) images, the others need CV_8UC3.
+ */
+class Compositor {
+public:
+	/**
+	 * @brief Removes all effects, call at the start of every frame.
+	 */
+	void clear();
+	bool empty() const { return m_effects.empty(); }
+
+	/**
+	 * @brief Inverts every byte of the image like invertMat.
+	 */
+	void invert();
+
+	/**
+	 * @brief Blends the whole image towards a color.
+	 * @param alpha Weight of the color, 255 replaces the image
+	 */
+	void fade(const cv::Vec3b &color, uint8_t alpha);
+
+	/**
+	 * @brief Brightens the whole image by adding a color, saturating.
+	 * @param intensity Fraction of the color to add, 255 for all of it
+	 */
+	void flash(const cv::Vec3b &color, uint8_t intensity);
+
+	/**
+	 * @brief Blends an image over a part of the image.
+	 * @param overlay Image to blend in (CV_8UC3), must stay unchanged until applied
+	 * @param alpha Weight of the overlay, 255 replaces the image
+	 */
+	void blend(const cv::Mat &overlay, int left, int top, uint8_t alpha);
+
+	/**
+	 * @brief Draws the opaque pixels of a sprite.
+	 * @param digLimit If not 0 pixels are only drawn where the warped depth is at least this
+	 */
+	void blit(const Sprite &sprite, int left, int top, uint16_t digLimit = 0);
+
+	/**
+	 * @brief Applies all effects to count consecutive pixels of a row.
+	 * @param row Row of the pixels in the image
+	 * @param left Column of the first pixel in the image
+	 * @param depth Warped depth of the pixels, only needed for blits with a dig limit
+	 * @param target First pixel
+	 * @param pixelBytes Size of a pixel, 3 for BGR and 2 for greyscale
+	 */
+	void applyRow(int row, int left, int count, const uint16_t *depth, uint8_t *target, size_t pixelBytes) const;
+
+	/**
+	 * @brief Applies all effects to an image in place on the worker pool.
+	 * @param depthWarped Warped depth map, only needed for blits with a dig limit
+	 */
+	void apply(cv::Mat &image, const cv::Mat *depthWarped = NULL) const;
+
+	/**
+	 * @brief Copies an image and applies all effects to the copy in the same pass.
+	 * @param target Destination, reallocated only if size or type don't fit
+	 */
+	void apply(const cv::Mat &source, cv::Mat &target, const cv::Mat *depthWarped = NULL) const;
+
+private:
+	enum EffectType {
+		INVERT,
+		FADE,
+		FLASH,
+		BLEND,
+		BLIT
+	};
+
+	// Color patterns cover 16 BGR pixels, the width of a SIMD iteration
+	static const int PATTERN_BYTES = 48;
+
+	// Effects on parts of the image are looked up by bands of rows and by cells
+	// within them, the size of a TileRenderer tile
+	static const int BAND_ROWS = 16;
+	static const int CELL_COLS = 64;
+
+	struct Effect {
+		EffectType type;
+		cv::Rect rect;     // Covered pixels
+		cv::Mat image;     // Overlay or sprite
+		cv::Mat mask;      // Sprite mask
+		uint8_t alpha;
+		uint16_t digLimit;
+		uint8_t added[PATTERN_BYTES];    // Flash, added to every byte
+		uint16_t faded[PATTERN_BYTES];   // Fade, color times alpha
+	};
+
+	/**
+	 * @param rect Covered pixels, NULL for the whole image
+	 */
+	Effect& add(EffectType type, const cv::Rect *rect);
+	void applyEffect(const Effect &effect, int row, int left, int count, const uint16_t *depth, uint8_t *target, size_t pixelBytes) const;
+
+	std::vector<Effect> m_effects;
+	std::vector<int> m_imageEffects;                        // Indices of effects on the whole image
+	std::vector<std::vector<int> > m_bands;                 // Indices of the other effects per band they cover
+	std::vector<std::vector<std::vector<int> > > m_cells;  // Same per cell of every band
+};
+
+#endif // COMPOSITOR_H
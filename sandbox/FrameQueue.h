@@ -0,0 +1,186 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include "Threading.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * @brief What a producer does when the queue is full.
+ */
+enum QueuePolicy {
+	QUEUE_BLOCK,      // Wait until the consumer frees a slot
+	QUEUE_DROP_OLDEST // Discard the oldest queued item to keep latency low
+};
+
+/**
+ * @brief Bounded lock-free queue between exactly one producer and one consumer thread.
+ *
+ * Items are exchanged with std::swap. With cv::Mat members that only swaps headers so
+ * after warm up buffers circulate between producer, slots and consumer without allocations.
+ *
+ * Every slot carries its state and the position of the item in it. Producer (dropping the
+ * oldest item) and consumer (popping it) race for a full slot with a single compare and
+ * swap on that state, so a slot the consumer is reading is never overwritten. Semaphores
+ * are only used to wait for items or space, not to protect the queue.
+ */
+template <typename T>
+class FrameQueue {
+public:
+	FrameQueue(size_t capacity, QueuePolicy policy)
+		: m_slots(std::max<size_t>(1, capacity))
+		, m_policy(policy)
+		, m_head(0)
+		, m_tail(0)
+		, m_dropped(0)
+		, m_closed(0)
+	{
+	}
+
+	/**
+	 * @brief Moves item into the queue, item receives a recycled one in exchange.
+	 * @return False if the queue was closed
+	 */
+	bool push(T &item)
+	{
+		const unsigned long head = static_cast<unsigned long>(m_head);
+		Slot &slot = m_slots[head % m_slots.size()];
+
+		for (;;)
+		{
+			if (isClosed())
+				return false;
+
+			const long state = atomicLoad(&slot.state);
+			if ((state & STATE_MASK) == EMPTY)
+				break;
+
+			if ((state & STATE_MASK) == FULL && m_policy == QUEUE_DROP_OLDEST)
+			{
+				// Queue is full and the slot holds the oldest item, evict it unless the consumer takes it first
+				if (atomicCompareExchange(&slot.state, EMPTY, state) == state)
+				{
+					atomicIncrement(&m_tail);
+					atomicIncrement(&m_dropped);
+					break;
+				}
+			}
+			else if ((state & STATE_MASK) == FULL)
+			{
+				m_freed.wait(WAIT_SLICE_IN_MS);
+			}
+			else
+			{
+				// Consumer is swapping the item out right now
+				sleepMs(0);
+			}
+		}
+
+		std::swap(slot.item, item);
+
+		atomicStore(&slot.state, encode(head, FULL));
+		atomicStore(&m_head, static_cast<long>(head + 1));
+		m_available.post();
+
+		return true;
+	}
+
+	/**
+	 * @brief Moves the oldest item into item, which hands its buffers to the queue.
+	 * @param timeoutInMs Time to wait for an item if the queue is empty
+	 * @return False if no item arrived in time or the queue is closed and empty
+	 */
+	bool pop(T &item, unsigned int timeoutInMs)
+	{
+		for (;;)
+		{
+			if (tryPop(item))
+				return true;
+
+			if (isClosed() || !m_available.wait(timeoutInMs))
+				return false;
+		}
+	}
+
+	/**
+	 * @brief Wakes up and fails all waiting and future pushes. Items left can still be popped.
+	 */
+	void close()
+	{
+		atomicStore(&m_closed, 1);
+		m_available.post();
+		m_freed.post();
+	}
+
+	bool isClosed() const { return atomicLoad(&m_closed) != 0; }
+
+	/**
+	 * @return Number of items dropped because the queue was full
+	 */
+	long dropped() const { return atomicLoad(&m_dropped); }
+
+private:
+	FrameQueue(const FrameQueue&);
+	FrameQueue& operator=(const FrameQueue&);
+
+	enum SlotState {
+		EMPTY = 0,
+		FULL = 1,
+		READING = 2
+	};
+
+	static const long STATE_MASK = 3;
+	static const unsigned int WAIT_SLICE_IN_MS = 10;
+
+	struct Slot {
+		Slot() : state(EMPTY) {}
+
+		volatile long state; // SlotState in the low bits, item position above
+		T item;
+	};
+
+	static long encode(unsigned long position, SlotState state)
+	{
+		return static_cast<long>((position << 2) | state);
+	}
+
+	bool tryPop(T &item)
+	{
+		for (;;)
+		{
+			const unsigned long tail = static_cast<unsigned long>(atomicLoad(&m_tail));
+			const unsigned long head = static_cast<unsigned long>(atomicLoad(&m_head));
+			if (static_cast<long>(head - tail) <= 0)
+				return false;
+
+			Slot &slot = m_slots[tail % m_slots.size()];
+
+			// Fails if the producer dropped this item meanwhile, tail has moved on then
+			const long full = encode(tail, FULL);
+			if (atomicCompareExchange(&slot.state, encode(tail, READING), full) == full)
+			{
+				atomicIncrement(&m_tail);
+
+				std::swap(slot.item, item);
+
+				atomicStore(&slot.state, EMPTY);
+				m_freed.post();
+				return true;
+			}
+		}
+	}
+
+	std::vector<Slot> m_slots;
+	const QueuePolicy m_policy;
+
+	volatile long m_head; // Position of the next push, written by the producer only
+	volatile long m_tail; // Position of the oldest item
+	volatile long m_dropped;
+	volatile long m_closed;
+
+	Semaphore m_available;
+	Semaphore m_freed;
+};
+
+#endif // FRAME_QUEUE_H
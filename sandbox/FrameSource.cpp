@@ -0,0 +1,317 @@
+#define NOMINMAX
+
+#include "FrameSource.h"
+#include "Settings.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+
+// Frame interval of the sensor in 30Hz VGA mode
+const uint64_t SENSOR_FRAME_INTERVAL_IN_US = 1000000 / 30;
+
+static void sleepFor(uint64_t timeInUs)
+{
+#ifdef _WIN32
+	Sleep(static_cast<DWORD>(timeInUs / 1000));
+#else
+	usleep(static_cast<useconds_t>(timeInUs));
+#endif
+}
+
+//
+// OpenNIFrameSource
+//
+
+bool OpenNIFrameSource::open()
+{
+	cout << "Opening device...";
+	m_capture.open(CV_CAP_OPENNI_ASUS);
+	if (!m_capture.isOpened())
+	{
+		cout << "failed" << endl;
+		return false;
+	}
+	cout << "ok" << endl;
+
+	cout << "Setting capture mode...";
+	if(!m_capture.set( CV_CAP_OPENNI_IMAGE_GENERATOR_OUTPUT_MODE, CV_CAP_OPENNI_VGA_30HZ ))
+	{
+		cout << "failed" << endl;
+		return false;
+	}
+	cout << "ok" << endl;
+
+	return true;
+}
+
+bool OpenNIFrameSource::grab()
+{
+	return m_capture.grab();
+}
+
+bool OpenNIFrameSource::retrieve(cv::Mat &image, int channel)
+{
+	return m_capture.retrieve(image, channel);
+}
+
+double OpenNIFrameSource::get(int propId)
+{
+	return m_capture.get(propId);
+}
+
+//
+// SoftwareFrameSource
+//
+
+SoftwareFrameSource::SoftwareFrameSource(bool realtime)
+	: m_realtime(realtime)
+	, m_startTicks(cv::getTickCount())
+{
+}
+
+bool SoftwareFrameSource::retrieve(cv::Mat &image, int channel)
+{
+	switch (channel)
+	{
+	case CV_CAP_OPENNI_DEPTH_MAP:
+		if (m_depth.data == NULL)
+			return false;
+
+		m_depth.copyTo(image);
+		return true;
+
+	case CV_CAP_OPENNI_VALID_DEPTH_MASK:
+		if (m_depth.data == NULL)
+			return false;
+
+		image = m_depth > 0;
+		return true;
+
+	case CV_CAP_OPENNI_BGR_IMAGE:
+		if (m_bgr.data == NULL)
+			return false;
+
+		m_bgr.copyTo(image);
+		return true;
+
+	case CV_CAP_OPENNI_GRAY_IMAGE:
+		if (m_bgr.data == NULL)
+			return false;
+
+		cvtColor(m_bgr, image, CV_BGR2GRAY);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+double SoftwareFrameSource::get(int propId)
+{
+	switch (propId)
+	{
+	case CV_CAP_PROP_FRAME_WIDTH:
+		return m_depth.cols;
+	case CV_CAP_PROP_FRAME_HEIGHT:
+		return m_depth.rows;
+	case CV_CAP_PROP_FPS:
+		return m_realtime ? 1000000. / SENSOR_FRAME_INTERVAL_IN_US : 0.;
+	case CV_CAP_PROP_OPENNI_FRAME_MAX_DEPTH:
+		return std::numeric_limits<uint16_t>::max();
+	default:
+		return 0.;
+	}
+}
+
+void SoftwareFrameSource::restartClock()
+{
+	m_startTicks = cv::getTickCount();
+}
+
+void SoftwareFrameSource::waitUntil(uint64_t timeInUs)
+{
+	if (!m_realtime)
+		return;
+
+	const double elapsed = static_cast<double>(cv::getTickCount() - m_startTicks) / cv::getTickFrequency();
+	const uint64_t elapsedInUs = static_cast<uint64_t>(elapsed * 1000000.);
+
+	if (timeInUs > elapsedInUs)
+		sleepFor(timeInUs - elapsedInUs);
+}
+
+//
+// SyntheticFrameSource
+//
+
+SyntheticFrameSource::SyntheticFrameSource(const cv::Size &size, uint16_t sandPlaneDistanceInMM, bool realtime)
+	: SoftwareFrameSource(realtime)
+	, m_size(size)
+	, m_sandPlaneDistanceInMM(sandPlaneDistanceInMM)
+	, m_frame(0)
+{
+}
+
+bool SyntheticFrameSource::open()
+{
+	cout << "Generating synthetic terrain " << m_size.width << "x" << m_size.height
+		 << " with sand level at " << m_sandPlaneDistanceInMM << "mm" << endl;
+
+	m_depth.create(m_size, CV_16UC1);
+	m_bgr.create(m_size, CV_8UC3);
+
+	m_frame = 0;
+	restartClock();
+
+	return true;
+}
+
+bool SyntheticFrameSource::grab()
+{
+	waitUntil(m_frame * SENSOR_FRAME_INTERVAL_IN_US);
+
+	const int rows = m_size.height;
+	const int cols = m_size.width;
+	const double t = static_cast<double>(m_frame) / 30.;
+
+	// Terrain is a sum of separable waves so each pixel only costs a multiply-add
+	vector<double> colWave(cols), colRidge(cols);
+	for (int col = 0; col < cols; ++col)
+	{
+		const double x = static_cast<double>(col) / cols;
+		colWave[col] = sin(x * 9.0 + t * 0.7);
+		colRidge[col] = 25.0 * sin(x * 3.0 - t * 0.3);
+	}
+
+	vector<double> rowWave(rows), rowRidge(rows);
+	for (int row = 0; row < rows; ++row)
+	{
+		const double y = static_cast<double>(row) / rows;
+		rowWave[row] = 60.0 * cos(y * 7.0 - t * 0.5);
+		rowRidge[row] = 20.0 * cos(y * 4.0 + t * 0.2);
+	}
+
+	const uint32_t frameSeed = static_cast<uint32_t>(m_frame) * 83492791u;
+	for (int row = 0; row < rows; ++row)
+	{
+		uint16_t *depth = m_depth.ptr<uint16_t>(row);
+		uint8_t *bgr = m_bgr.ptr<uint8_t>(row);
+
+		for (int col = 0; col < cols; ++col)
+		{
+			const double height = rowWave[row] * colWave[col] + rowRidge[row] + colRidge[col];
+
+			// Sensor noise of a few mm and sparse dropouts reported as 0mm like OpenNI does
+			const uint32_t hash = (static_cast<uint32_t>(col) * 73856093u) ^ (static_cast<uint32_t>(row) * 19349663u) ^ frameSeed;
+			const int noise = static_cast<int>(hash % 5) - 2;
+
+			if ((hash >> 8) % 1024 == 0)
+			{
+				depth[col] = 0;
+			}
+			else
+			{
+				depth[col] = saturate_cast<uint16_t>(m_sandPlaneDistanceInMM - height + noise);
+			}
+
+			const uint8_t shade = saturate_cast<uint8_t>(128.0 + height);
+			bgr[0] = shade;
+			bgr[1] = shade;
+			bgr[2] = shade;
+			bgr += 3;
+		}
+	}
+
+	++m_frame;
+	return true;
+}
+
+//
+// ReplayFrameSource
+//
+
+ReplayFrameSource::ReplayFrameSource(const std::string &file, bool realtime)
+	: SoftwareFrameSource(realtime)
+	, m_filename(file)
+	, m_frame(0)
+	, m_firstTimestampInUs(0)
+{
+}
+
+bool ReplayFrameSource::open()
+{
+	cout << "Opening session " << m_filename << "...";
+	if (!m_session.open(m_filename))
+	{
+		cout << "failed" << endl;
+		return false;
+	}
+	cout << "ok (" << m_session.frameCount() << " frames)" << endl;
+
+	// Decode first frame so sizes are known before the first grab
+	if (!m_session.readFrame(0, m_depth, m_bgr, m_firstTimestampInUs))
+	{
+		cerr << "Failed to read first frame of session" << endl;
+		return false;
+	}
+
+	m_frame = 0;
+	return true;
+}
+
+bool ReplayFrameSource::grab()
+{
+	if (m_frame >= m_session.frameCount())
+	{
+		// Loop
+		m_frame = 0;
+	}
+
+	uint64_t timestampInUs;
+	if (!m_session.readFrame(m_frame, m_depth, m_bgr, timestampInUs))
+	{
+		cerr << "Failed to read frame " << m_frame << " of session" << endl;
+		return false;
+	}
+
+	if (m_frame == 0)
+	{
+		m_firstTimestampInUs = timestampInUs;
+		restartClock();
+	}
+	else
+	{
+		waitUntil(timestampInUs - m_firstTimestampInUs);
+	}
+
+	++m_frame;
+	return true;
+}
+
+//
+// Factory
+//
+
+cv::Ptr<FrameSource> createFrameSource(const std::string &source, bool realtime)
+{
+	if (source == "openni")
+		return new OpenNIFrameSource();
+
+	if (source == "synthetic")
+	{
+		const uint16_t sandPlaneDistanceInMM = (settings.sandPlaneDistanceInMM >= 0) ? static_cast<uint16_t>(settings.sandPlaneDistanceInMM) : 1000;
+		return new SyntheticFrameSource(Size(640, 480), sandPlaneDistanceInMM, realtime);
+	}
+
+	return new ReplayFrameSource(source, realtime);
+}
@@ -0,0 +1,129 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <string>
+
+#include "SessionFile.h"
+
+/**
+ * @brief Source of depth and BGR frames.
+ * Follows the grab/retrieve interface of cv::VideoCapture with the
+ * CV_CAP_OPENNI_* output and property constants so the main loop and
+ * calibration work the same on the live sensor, generated terrain
+ * and recorded sessions.
+ */
+class FrameSource {
+public:
+	virtual ~FrameSource() {}
+
+	virtual bool open() = 0;
+
+	virtual bool grab() = 0;
+	virtual bool retrieve(cv::Mat &image, int channel) = 0;
+
+	virtual double get(int propId) = 0;
+
+	virtual std::string name() const = 0;
+};
+
+/**
+ * @brief Live frames from an OpenNI sensor (ASUS Xtion).
+ */
+class OpenNIFrameSource : public FrameSource {
+public:
+	virtual bool open();
+
+	virtual bool grab();
+	virtual bool retrieve(cv::Mat &image, int channel);
+
+	virtual double get(int propId);
+
+	virtual std::string name() const { return "OpenNI"; }
+
+private:
+	cv::VideoCapture m_capture;
+};
+
+/**
+ * @brief Base for sources producing frames themselves.
+ * Derives the gray image and valid depth mask from the depth map and
+ * BGR image provided by the implementation and optionally throttles
+ * grabbing to the sensor rate.
+ */
+class SoftwareFrameSource : public FrameSource {
+public:
+	SoftwareFrameSource(bool realtime);
+
+	virtual bool retrieve(cv::Mat &image, int channel);
+
+	virtual double get(int propId);
+
+protected:
+	/**
+	 * @brief Blocks until the given time since the start of playback is reached.
+	 * Does nothing if not running in realtime.
+	 */
+	void waitUntil(uint64_t timeInUs);
+	void restartClock();
+
+	const bool m_realtime;
+
+	cv::Mat m_depth;
+	cv::Mat m_bgr;
+
+private:
+	int64 m_startTicks;
+};
+
+/**
+ * @brief Generated sand terrain with a few hills and pits moving over time.
+ * Frames are a pure function of the frame number so unthrottled runs are reproducible.
+ */
+class SyntheticFrameSource : public SoftwareFrameSource {
+public:
+	SyntheticFrameSource(const cv::Size &size, uint16_t sandPlaneDistanceInMM, bool realtime);
+
+	virtual bool open();
+
+	virtual bool grab();
+
+	virtual std::string name() const { return "Synthetic"; }
+
+private:
+	const cv::Size m_size;
+	const uint16_t m_sandPlaneDistanceInMM;
+	uint64_t m_frame;
+};
+
+/**
+ * @brief Replays a recorded session (see SessionFile.h), looping at the end.
+ */
+class ReplayFrameSource : public SoftwareFrameSource {
+public:
+	ReplayFrameSource(const std::string &file, bool realtime);
+
+	virtual bool open();
+
+	virtual bool grab();
+
+	virtual std::string name() const { return "Replay " + m_filename; }
+
+private:
+	const std::string m_filename;
+	SessionReader m_session;
+	size_t m_frame;
+	uint64_t m_firstTimestampInUs;
+};
+
+/**
+ * @brief Creates the frame source described by the given specification.
+ * @param source "openni" for the sensor, "synthetic" for generated terrain, otherwise a session file to replay
+ * @param realtime If false synthetic and replayed frames are delivered as fast as possible
+ * @return Unopened frame source
+ */
+cv::Ptr<FrameSource> createFrameSource(const std::string &source, bool realtime);
+
+#endif // FRAME_SOURCE_H
@@ -3,20 +3,202 @@
 using namespace cv;
 using namespace std;
 
+#include <algorithm>
+
 #include "Fullscreen.h"
 #include "Settings.h"
 
-bool getAutoCalibrationRectangleCornersHarris(VideoCapture &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints){
+namespace {
+
+// Responses above this fraction of the strongest one belong to a corner
+const float RESPONSE_THRESHOLD = 70.f / 255.f;
+
+// Corners closer than this are suppressed in favour of the stronger one
+const int CORNER_DISTANCE = 10;
+
+/**
+ * @brief Strongest pixel of a connected area of the thresholded response.
+ */
+struct Peak {
+	float response;
+	Point location;
+};
+
+bool strongerPeak(const Peak &a, const Peak &b)
+{
+	return a.response > b.response;
+}
+
+int findRoot(vector<int> &parents, int label)
+{
+	while (parents[label] != label)
+	{
+		parents[label] = parents[parents[label]];
+		label = parents[label];
+	}
+	return label;
+}
+
+/**
+ * @brief Merges two areas, the merged one keeps the stronger peak.
+ * @return Root label of the merged area
+ */
+int unite(vector<int> &parents, vector<Peak> &peaks, int a, int b)
+{
+	a = findRoot(parents, a);
+	b = findRoot(parents, b);
+	if (a == b)
+		return a;
+
+	if (b < a)
+		std::swap(a, b);
+
+	parents[b] = a;
+	if (peaks[b].response > peaks[a].response)
+		peaks[a] = peaks[b];
+
+	return a;
+}
+
+/**
+ * @brief Extracts one peak per 8-connected area of the response above the threshold.
+ * Labels the areas with a union find over the previous and the current row, so the
+ * response image is only traversed once.
+ * @param response CV_32FC1 Harris response
+ */
+vector<Peak> findPeaks(const Mat &response, float threshold)
+{
+	vector<int> parents;
+	vector<Peak> peaks;
+
+	// Labels of the previous and the current row, -1 below the threshold
+	vector<int> previous(response.cols + 2, -1);
+	vector<int> current(response.cols + 2, -1);
+
+	for (int y = 0; y < response.rows; ++y)
+	{
+		const float *row = response.ptr<float>(y);
+		for (int x = 0; x < response.cols; ++x)
+		{
+			const float value = row[x];
+			if (value <= threshold)
+			{
+				current[x + 1] = -1;
+				continue;
+			}
+
+			// Neighbours left, top left, top and top right
+			int label = current[x];
+			const int above[3] = { previous[x], previous[x + 1], previous[x + 2] };
+			for (int i = 0; i < 3; ++i)
+			{
+				if (above[i] < 0)
+					continue;
+
+				label = (label < 0) ? findRoot(parents, above[i]) : unite(parents, peaks, label, above[i]);
+			}
+
+			if (label < 0)
+			{
+				label = static_cast<int>(parents.size());
+				parents.push_back(label);
+
+				Peak peak;
+				peak.response = value;
+				peak.location = Point(x, y);
+				peaks.push_back(peak);
+			}
+			else
+			{
+				label = findRoot(parents, label);
+				if (value > peaks[label].response)
+				{
+					peaks[label].response = value;
+					peaks[label].location = Point(x, y);
+				}
+			}
+
+			current[x + 1] = label;
+		}
+
+		std::swap(previous, current);
+	}
+
+	vector<Peak> result;
+	for (size_t label = 0; label < parents.size(); ++label)
+	{
+		if (parents[label] == static_cast<int>(label))
+			result.push_back(peaks[label]);
+	}
+
+	// Non maximum suppression between areas that are close but not connected
+	std::sort(result.begin(), result.end(), strongerPeak);
+
+	vector<Peak> suppressed;
+	for (size_t i = 0; i < result.size(); ++i)
+	{
+		bool isMaximum = true;
+		for (size_t j = 0; j < suppressed.size() && isMaximum; ++j)
+		{
+			const Point offset = result[i].location - suppressed[j].location;
+			isMaximum = std::abs(offset.x) > CORNER_DISTANCE || std::abs(offset.y) > CORNER_DISTANCE;
+		}
+
+		if (isMaximum)
+			suppressed.push_back(result[i]);
+	}
+
+	return suppressed;
+}
+
+/**
+ * @brief Picks the strongest peak in every quadrant of the image.
+ * Assumes the projected rectangle is roughly centered in the sensor image.
+ * @param corners Receives top left, top right, bottom right and bottom left
+ * @return True if every quadrant contains a peak
+ */
+bool selectCorners(const vector<Peak> &peaks, const Size &size, vector<Point2f> &corners)
+{
+	const Point center(size.width / 2, size.height / 2);
+
+	// Peaks are sorted by response, the first one found in a quadrant is the strongest
+	int found[4] = { -1, -1, -1, -1 };
+	for (size_t i = 0; i < peaks.size(); ++i)
+	{
+		const Point &location = peaks[i].location;
+		const bool right = location.x >= center.x;
+		const bool bottom = location.y >= center.y;
+		const int quadrant = bottom ? (right ? 2 : 3) : (right ? 1 : 0);
+
+		if (found[quadrant] < 0)
+			found[quadrant] = static_cast<int>(i);
+	}
+
+	corners.clear();
+	for (int quadrant = 0; quadrant < 4; ++quadrant)
+	{
+		if (found[quadrant] < 0)
+			return false;
+
+		corners.push_back(Point2f(peaks[found[quadrant]].location));
+	}
+
+	return true;
+}
+
+}
+
+bool getAutoCalibrationRectangleCornersHarris(FrameSource &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints){
 	calibPoints.clear();
 	const std::string CALIB_BGR_WND_2 = "Harris Calibration";
 	const std::string CALIB_BGR_WND_3 = "Harris Extra";
 	namedWindow(CALIB_BGR_WND_2);
 
-
-	realPoints.push_back(Point2f(0,0)); // Top left
-	realPoints.push_back(Point2f(1024,0)); // Top right
-	realPoints.push_back(Point2f(1024, 768)); // Bottom right
-	realPoints.push_back(Point2f(0, 768)); // Bottom left
+	// The white rectangle covers the whole beamer area
+	realPoints.push_back(Point2f(0, 0)); // Top left
+	realPoints.push_back(Point2f(static_cast<float>(settings.beamerXres), 0)); // Top right
+	realPoints.push_back(Point2f(static_cast<float>(settings.beamerXres), static_cast<float>(settings.beamerYres))); // Bottom right
+	realPoints.push_back(Point2f(0, static_cast<float>(settings.beamerYres))); // Bottom left
 
 	if (settings.fullscreen)
 	{
@@ -35,14 +217,12 @@ bool getAutoCalibrationRectangleCornersHarris(VideoCapture &capture, vector<Poin
 
 	imshow(CALIB_BGR_WND_2, m);
 
+	// Give the beamer time to show the rectangle
+	waitKey(100);
 
+	Mat mat, src_gray, chImg;
 	for(;;)
 	{
-		calibPoints.clear();
-		
-
-		waitKey(100);
-
 		if(!capture.grab())
 		{
 			cerr << "Failed to grab" << endl;
@@ -50,59 +230,47 @@ bool getAutoCalibrationRectangleCornersHarris(VideoCapture &capture, vector<Poin
 			return false;
 		}
 
-		Mat mat, mat2;
 		if(!capture.retrieve(mat, CV_CAP_OPENNI_BGR_IMAGE))
 		{
 			cerr << "Failed to retrieve" << endl;
 			cv::destroyWindow(CALIB_BGR_WND_2);
 			return false;
 		}
-	
-	
+
 		/// Convert it to gray
-		Mat src_gray;
 		cvtColor( mat, src_gray, CV_BGR2GRAY );
-	
+
 		int blockSize = 4;
 		int apertureSize = 3;
 		double k = 0.01;
 
-		Mat chImg, chImgNorm, chImgNormScaled;
 		cornerHarris(src_gray, chImg, blockSize, apertureSize, k, BORDER_DEFAULT);
-		normalize( chImg, chImgNorm, 0, 255, NORM_MINMAX, CV_32FC1, Mat() );
-		convertScaleAbs( chImgNorm, chImgNormScaled );
-
-		/// erkannte Ecken in tempPoints abspeichern	
-		int thresh = 70;
-		vector<Point> points;
-		for( int j = 0; j < chImgNorm.rows ; j++ ){
-			for( int i = 0; i < chImgNorm.cols; i++ ){
-				if( (int) chImgNorm.at<float>(j,i) > thresh ){
-					points.push_back(Point(i, j));
-				}
-			}
+
+		double minResponse, maxResponse;
+		minMaxLoc(chImg, &minResponse, &maxResponse);
+		const float threshold = static_cast<float>(minResponse + (maxResponse - minResponse) * RESPONSE_THRESHOLD);
+
+		const vector<Peak> peaks = findPeaks(chImg, threshold);
+		for (size_t i = 0; i < peaks.size(); ++i)
+		{
+			circle( mat, peaks[i].location, 5, Scalar(0,0,255), 2, 8, 0 );
 		}
-		/// nahliegende Eckpunkte als ein punkt betrachten  
-		int dist = 10;
-		for(int i = 0; i < points.size(); i++){
-			//cout << points[i].x << "," << points[i].y << endl;
-			calibPoints.push_back(points[i]);
-			//realPoints.push_back(points[i]);
-			circle( chImgNormScaled, points[i], 5,  Scalar(0), 2, 8, 0 );
-			for(int j = i + 1; j < points.size(); j++){
-				if( (points[j].x > (points[i].x - dist) & points[j].x < (points[i].x + dist)) 
-					&& (points[j].y > (points[i].y - dist) & points[j].y < (points[i].y + dist)) ){
-						i++;
-				} else {
-					break;
-				}
+
+		const bool found = selectCorners(peaks, chImg.size(), calibPoints);
+		if (found)
+		{
+			cornerSubPix(src_gray, calibPoints, Size(5, 5), Size(-1, -1), TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 20, 0.01));
+
+			for (size_t i = 0; i < calibPoints.size(); ++i)
+			{
+				circle( mat, Point(cvRound(calibPoints[i].x), cvRound(calibPoints[i].y)), 8, Scalar(0,255,0), 2, 8, 0 );
 			}
 		}
-		imshow(CALIB_BGR_WND_3, chImgNormScaled);
 
-		if (calibPoints.size() == 4) {
+		imshow(CALIB_BGR_WND_3, mat);
+
+		if (found) {
 			cerr << "Harris calibration done" << endl;
-			waitKey(1000);
 			break;
 		}
 
@@ -115,10 +283,9 @@ bool getAutoCalibrationRectangleCornersHarris(VideoCapture &capture, vector<Poin
 		}
 	}
 
-	waitKey(2000);
 	cv::destroyWindow(CALIB_BGR_WND_3);
 
 	cv::destroyWindow(CALIB_BGR_WND_2);
 	return true;
 
-}
\ No newline at end of file
+}
@@ -4,6 +4,8 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 
-bool getAutoCalibrationRectangleCornersHarris(cv::VideoCapture &capture, std::vector<cv::Point2f> &calibPoints, cv::vector<cv::Point2f> &realPoints);
+#include "FrameSource.h"
+
+bool getAutoCalibrationRectangleCornersHarris(FrameSource &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
 
 #endif // HARRISCORNERDETECTION_H
\ No newline at end of file
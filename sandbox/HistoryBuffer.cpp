@@ -1,31 +1,162 @@
 #include "HistoryBuffer.h"
+#include "ParallelRows.h"
+
+#include <stdint.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define HISTORY_BUFFER_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace cv;
 using namespace std;
 
+namespace {
+
+/**
+ * @brief Copies a frame into its slot and updates the valid sample counts on the way.
+ */
+class CountingCopy : public RowBody {
+public:
+	CountingCopy(const cv::Mat &incoming, cv::Mat &slot, cv::Mat &counts, bool replacing)
+		: m_incoming(incoming)
+		, m_slot(slot)
+		, m_counts(counts)
+		, m_replacing(replacing) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const int COLS = m_incoming.cols;
+
+		for (int row = begin; row < end; ++row)
+		{
+			const uint16_t *in = m_incoming.ptr<uint16_t>(row);
+			uint16_t *slot = m_slot.ptr<uint16_t>(row);
+			uint16_t *count = m_counts.ptr<uint16_t>(row);
+
+			int col = 0;
+
+#ifdef HISTORY_BUFFER_SSE2
+			// Comparing with 0 gives -1 for dropouts, the count changes by the difference
+			// of incoming and outgoing. An empty slot counts as a dropout.
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i empty = _mm_set1_epi16(-1);
+			for (; col + 8 <= COLS; col += 8)
+			{
+				__m128i *samples = reinterpret_cast<__m128i*>(slot + col);
+				__m128i *counts = reinterpret_cast<__m128i*>(count + col);
+
+				const __m128i incoming = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + col));
+				const __m128i outgoing = m_replacing ? _mm_cmpeq_epi16(_mm_loadu_si128(samples), zero) : empty;
+
+				_mm_storeu_si128(counts, _mm_add_epi16(_mm_loadu_si128(counts), _mm_sub_epi16(_mm_cmpeq_epi16(incoming, zero), outgoing)));
+				_mm_storeu_si128(samples, incoming);
+			}
+#endif
+
+			for (; col < COLS; ++col)
+			{
+				if (m_replacing && slot[col] != 0)
+					--count[col];
+
+				if (in[col] != 0)
+					++count[col];
+
+				slot[col] = in[col];
+			}
+		}
+	}
+
+private:
+	const cv::Mat &m_incoming;
+	cv::Mat &m_slot;
+	cv::Mat &m_counts;
+	const bool m_replacing;
+};
+
+}
+
 HistoryBuffer::HistoryBuffer(const size_t depth)
 	: m_depth(depth)
 	, m_insertionPoint(0)
+	, m_countStepsize(0)
+{
+}
+
+void HistoryBuffer::enableValidCounts(size_t stepsize)
 {
+	assert(stepsize > 0);
+
+	m_countStepsize = stepsize;
+	m_validCounts.release();
+
+	if (m_state.empty() || m_state[0].type() != CV_16UC1)
+		return;
+
+	// Catch up with frames already in the history
+	m_validCounts = Mat::zeros(m_state[0].size(), CV_16UC1);
+	for (size_t pos = 0; pos < m_state.size(); pos += m_countStepsize)
+	{
+		for (int row = 0; row < m_validCounts.rows; ++row)
+		{
+			const uint16_t *sample = m_state[pos].ptr<uint16_t>(row);
+			uint16_t *count = m_validCounts.ptr<uint16_t>(row);
+
+			for (int col = 0; col < m_validCounts.cols; ++col)
+			{
+				count[col] += (sample[col] != 0);
+			}
+		}
+	}
 }
 
-void HistoryBuffer::addFrame(cv::Mat &frame, bool clone)
+void HistoryBuffer::addFrame(const cv::Mat &frame)
 {
 	assert(frame.data != NULL);
+	assert(frame.dims == 2);
+
+	if (m_slab.data == NULL)
+	{
+		// Single contiguous allocation for the whole history
+		m_slab.create(static_cast<int>(m_depth) * frame.rows, frame.cols, frame.type());
+		m_state.reserve(m_depth);
+	}
 
-	Mat cp = clone ? frame.clone() : frame;
+	assert(frame.type() == m_slab.type());
+	assert(frame.cols == m_slab.cols);
+	assert(frame.rows * static_cast<int>(m_depth) == m_slab.rows);
 
-	assert(cp.type() == frame.type());
-	assert(cp.rows == frame.rows);
-	assert(cp.cols == frame.cols);
+	const bool counting = (m_countStepsize > 0 && m_insertionPoint % m_countStepsize == 0 && frame.type() == CV_16UC1);
+	if (counting && m_validCounts.data == NULL)
+	{
+		m_validCounts = Mat::zeros(frame.rows, frame.cols, CV_16UC1);
+	}
+
+	const bool replacing = (m_state.size() >= m_depth);
+	if (!replacing)
+	{
+		onFrameAdded(m_insertionPoint, frame, Mat());
+
+		m_state.push_back(m_slab.rowRange(m_insertionPoint * frame.rows, (m_insertionPoint + 1) * frame.rows));
+
+		const int sizes[] = { static_cast<int>(m_state.size()), frame.rows, frame.cols };
+		const size_t steps[] = { m_slab.step[0] * frame.rows, m_slab.step[0] };
+		m_volume = Mat(3, sizes, m_slab.type(), m_slab.data, steps);
+	}
+	else
+	{
+		onFrameAdded(m_insertionPoint, frame, m_state[m_insertionPoint]);
+	}
 
-	if (m_state.size() < m_depth)
+	if (counting)
 	{
-		m_state.push_back(cp);
+		// Same single pass over the frame as the copy
+		parallelForRows(frame.rows, frame.cols * 3 * sizeof(uint16_t), CountingCopy(frame, m_state[m_insertionPoint], m_validCounts, replacing));
 	}
 	else
 	{
-		m_state[m_insertionPoint] = cp;
+		// Slot has the frame's size and type so this copies in place
+		frame.copyTo(m_state[m_insertionPoint]);
 	}
 
 	++m_insertionPoint;
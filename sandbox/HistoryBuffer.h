@@ -6,16 +6,63 @@
 class HistoryBuffer {
 public:
 	HistoryBuffer(const size_t depth);
+	virtual ~HistoryBuffer() {}
 
-	void addFrame(cv::Mat &frame, bool clone = true);
+	/**
+	 * @brief Copies the frame into the next slot of the history.
+	 * All slots live in one slab allocated with the first frame so adding
+	 * frames doesn't allocate. Every frame must have the size and type of the first.
+	 */
+	void addFrame(const cv::Mat &frame);
 
 protected:
+	/**
+	 * @return Headers of the filled slots. They point into the slab and are in slot, not chronological, order.
+	 */
 	std::vector<cv::Mat>& getHistory();
 
+	/**
+	 * @brief 3D view (slot x row x col) of the filled slots.
+	 * The samples of a pixel are a constant stride apart so filters can walk the time axis
+	 * with ptr(slot, row) instead of going through the slot headers.
+	 */
+	const cv::Mat& getVolume() const { return m_volume; }
+
+	size_t getDepth() const { return m_depth; }
+
+	/**
+	 * @brief Maintains per pixel counts of valid samples over every stepsize-th slot.
+	 * Depth maps report dropouts as 0, every other value is valid. The counts are
+	 * updated while frames are copied into the history. Other types than CV_16UC1
+	 * aren't counted.
+	 */
+	void enableValidCounts(size_t stepsize);
+
+	/**
+	 * @return Number of valid samples per pixel (CV_16UC1). Doesn't include the
+	 *         incoming frame yet while onFrameAdded runs.
+	 */
+	const cv::Mat& getValidCounts() const { return m_validCounts; }
+
+	/**
+	 * @brief Called by addFrame right before a frame is copied into its slot.
+	 * Lets filters maintain incremental state instead of revisiting the whole history.
+	 *
+	 * @param slot Position in the history the frame is stored at
+	 * @param incoming Frame entering the history
+	 * @param outgoing Frame leaving the history, empty while the history is filling up.
+	 *                 Still valid during the call, it is overwritten afterwards.
+	 */
+	virtual void onFrameAdded(size_t slot, const cv::Mat &incoming, const cv::Mat &outgoing) {}
+
 private:
+	cv::Mat m_slab;                 // Slots stacked vertically, depth * rows x cols
+	cv::Mat m_volume;
 	std::vector<cv::Mat> m_state;
 	unsigned int m_insertionPoint;
 	const size_t m_depth;
+	size_t m_countStepsize;         // 0 if valid samples aren't counted
+	cv::Mat m_validCounts;
 };
 
 #endif // HISTORY_BUFFER
\ No newline at end of file
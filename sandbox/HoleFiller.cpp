@@ -0,0 +1,297 @@
+#include "HoleFiller.h"
+#include "ParallelRows.h"
+#include "Threading.h"
+
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define HOLE_FILLER_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+/**
+ * @brief Rounded average of the valid samples, 0 if there are none.
+ */
+inline uint16_t average(uint32_t sum, uint32_t weight)
+{
+	return weight ? static_cast<uint16_t>((2 * sum + weight) / (2 * weight)) : 0;
+}
+
+#ifdef HOLE_FILLER_SSE2
+/**
+ * @brief Averages the valid samples of 4 2x2 blocks.
+ * @param a 8 samples of the upper row
+ * @param b 8 samples of the lower row
+ * @return 4 averages as 32 bit, rounded like average()
+ */
+inline __m128i pushQuad(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi32(0xFFFF);
+	const __m128i one = _mm_set1_epi16(1);
+
+	// Depth is unsigned, split pairs into 32 bit lanes instead of using the signed madd
+	const __m128i sum = _mm_add_epi32(
+		_mm_add_epi32(_mm_and_si128(a, low), _mm_srli_epi32(a, 16)),
+		_mm_add_epi32(_mm_and_si128(b, low), _mm_srli_epi32(b, 16)));
+
+	const __m128i valid = _mm_add_epi16(_mm_andnot_si128(_mm_cmpeq_epi16(a, zero), one), _mm_andnot_si128(_mm_cmpeq_epi16(b, zero), one));
+	const __m128i count = _mm_madd_epi16(valid, one);
+
+	// (2 * sum + count) / (2 * count) is exact in float, empty blocks divide 0 by 1
+	const __m128i numerator = _mm_add_epi32(_mm_slli_epi32(sum, 1), count);
+	__m128i denominator = _mm_slli_epi32(count, 1);
+	denominator = _mm_or_si128(denominator, _mm_and_si128(_mm_cmpeq_epi32(denominator, zero), _mm_set1_epi32(1)));
+
+	return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(numerator), _mm_cvtepi32_ps(denominator)));
+}
+#endif
+
+/**
+ * @brief Averages 2x2 blocks of valid samples into the next coarser level.
+ * The last block of odd sized levels repeats the border samples.
+ * @return True if a block had no valid sample
+ */
+bool pushRow(const uint16_t *upper, const uint16_t *lower, uint16_t *dst, int srcCols, int dstCols, bool optimized)
+{
+	int col = 0;
+	bool holes = false;
+
+#ifdef HOLE_FILLER_SSE2
+	if (optimized)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bias32 = _mm_set1_epi32(0x8000);
+		const __m128i bias16 = _mm_set1_epi16(static_cast<short>(0x8000));
+
+		int emptyMask = 0;
+		for (; col + 8 <= dstCols && 2 * col + 16 <= srcCols; col += 8)
+		{
+			const __m128i *a = reinterpret_cast<const __m128i*>(upper + 2 * col);
+			const __m128i *b = reinterpret_cast<const __m128i*>(lower + 2 * col);
+
+			const __m128i first = pushQuad(_mm_loadu_si128(a), _mm_loadu_si128(b));
+			const __m128i second = pushQuad(_mm_loadu_si128(a + 1), _mm_loadu_si128(b + 1));
+
+			// Unsigned saturation isn't available before SSE4.1, pack biased values
+			const __m128i result = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(first, bias32), _mm_sub_epi32(second, bias32)), bias16);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + col), result);
+
+			emptyMask |= _mm_movemask_epi8(_mm_cmpeq_epi16(result, zero));
+		}
+
+		holes = emptyMask != 0;
+	}
+#endif
+
+	for (; col < dstCols; ++col)
+	{
+		const int left = 2 * col;
+		const int right = std::min(left + 1, srcCols - 1);
+		const uint16_t samples[4] = { upper[left], upper[right], lower[left], lower[right] };
+
+		uint32_t sum = 0;
+		uint32_t count = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (samples[i] != 0)
+			{
+				sum += samples[i];
+				++count;
+			}
+		}
+
+		dst[col] = average(sum, count);
+		holes |= (count == 0);
+	}
+
+	return holes;
+}
+
+/**
+ * @brief Bilinear interpolation of the coarser level at a pixel, skipping its holes.
+ */
+inline uint16_t pullPixel(const Mat &coarse, int col, int row)
+{
+	const int x = col >> 1;
+	const int y = row >> 1;
+
+	// The pixel lies a quarter coarse pixel from the center of its parent
+	const int nx = (col & 1) ? std::min(x + 1, coarse.cols - 1) : std::max(x - 1, 0);
+	const int ny = (row & 1) ? std::min(y + 1, coarse.rows - 1) : std::max(y - 1, 0);
+
+	const uint16_t *near = coarse.ptr<uint16_t>(y);
+	const uint16_t *far = coarse.ptr<uint16_t>(ny);
+	const uint16_t samples[4] = { near[x], near[nx], far[x], far[nx] };
+	const uint32_t weights[4] = { 9, 3, 3, 1 };
+
+	uint32_t sum = 0;
+	uint32_t weight = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (samples[i] != 0)
+		{
+			sum += weights[i] * samples[i];
+			weight += weights[i];
+		}
+	}
+
+	return average(sum, weight);
+}
+
+/**
+ * @brief Fills the holes of a row from the coarser level, valid pixels are kept.
+ */
+void pullRow(const Mat &coarse, uint16_t *dst, int row, int cols, bool optimized)
+{
+	int col = 0;
+
+#ifdef HOLE_FILLER_SSE2
+	if (optimized)
+	{
+		// Holes are sparse, skip blocks without any
+		const __m128i zero = _mm_setzero_si128();
+		for (; col + 8 <= cols; col += 8)
+		{
+			const __m128i depth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + col));
+			int holes = _mm_movemask_epi8(_mm_cmpeq_epi16(depth, zero));
+
+			for (int i = 0; holes != 0; ++i, holes >>= 2)
+			{
+				if (holes & 1)
+					dst[col + i] = pullPixel(coarse, col + i, row);
+			}
+		}
+	}
+#endif
+
+	for (; col < cols; ++col)
+	{
+		if (dst[col] == 0)
+			dst[col] = pullPixel(coarse, col, row);
+	}
+}
+
+/**
+ * @brief Builds the next coarser level.
+ */
+class PushRows : public RowBody {
+public:
+	PushRows(const cv::Mat &src, cv::Mat &dst, bool optimized, volatile long &holes)
+		: m_src(src)
+		, m_dst(dst)
+		, m_optimized(optimized)
+		, m_holes(holes) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		bool holes = false;
+		for (int row = begin; row < end; ++row)
+		{
+			const uint16_t *upper = m_src.ptr<uint16_t>(2 * row);
+			const uint16_t *lower = m_src.ptr<uint16_t>(std::min(2 * row + 1, m_src.rows - 1));
+
+			holes |= pushRow(upper, lower, m_dst.ptr<uint16_t>(row), m_src.cols, m_dst.cols, m_optimized);
+		}
+
+		if (holes)
+			atomicStore(&m_holes, 1);
+	}
+
+private:
+	const cv::Mat &m_src;
+	cv::Mat &m_dst;
+	const bool m_optimized;
+	volatile long &m_holes;
+};
+
+/**
+ * @brief Fills the holes of a level from the next coarser one.
+ */
+class PullRows : public RowBody {
+public:
+	PullRows(const cv::Mat &coarse, cv::Mat &dst, bool optimized)
+		: m_coarse(coarse)
+		, m_dst(dst)
+		, m_optimized(optimized) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int row = begin; row < end; ++row)
+		{
+			pullRow(m_coarse, m_dst.ptr<uint16_t>(row), row, m_dst.cols, m_optimized);
+		}
+	}
+
+private:
+	const cv::Mat &m_coarse;
+	cv::Mat &m_dst;
+	const bool m_optimized;
+};
+
+}
+
+void HoleFiller::fill(const cv::Mat &depth, cv::Mat &filled)
+{
+	fill(depth, filled, true);
+}
+
+void HoleFiller::fillReference(const cv::Mat &depth, cv::Mat &filled)
+{
+	fill(depth, filled, false);
+}
+
+void HoleFiller::fill(const cv::Mat &depth, cv::Mat &filled, bool optimized)
+{
+	CV_Assert(depth.type() == CV_16UC1);
+
+	if (filled.data != depth.data)
+	{
+		depth.copyTo(filled);
+	}
+
+	// Push until a level has no holes, usually a few levels suffice
+	size_t levels = 0;
+	for (;;)
+	{
+		if (m_levels.size() <= levels)
+			m_levels.push_back(Mat());
+
+		// Taken after growing the vector which moves the levels
+		const Mat &below = (levels == 0) ? filled : m_levels[levels - 1];
+		if (below.cols <= 1 && below.rows <= 1)
+			break;
+
+		Mat &level = m_levels[levels];
+		level.create((below.rows + 1) / 2, (below.cols + 1) / 2, CV_16UC1);
+
+		volatile long holes = 0;
+		const PushRows push(below, level, optimized, holes);
+		if (optimized)
+			parallelForRows(level.rows, level.cols * 5 * sizeof(uint16_t), push);
+		else
+			push(0, level.rows);
+
+		++levels;
+
+		if (atomicLoad(&holes) == 0)
+			break;
+	}
+
+	// Pull back down, every level is filled from the completed one above
+	for (size_t level = levels; level > 0; --level)
+	{
+		Mat &dst = (level == 1) ? filled : m_levels[level - 2];
+
+		const PullRows pull(m_levels[level - 1], dst, optimized);
+		if (optimized)
+			parallelForRows(dst.rows, dst.cols * 2 * sizeof(uint16_t), pull);
+		else
+			pull(0, dst.rows);
+	}
+}
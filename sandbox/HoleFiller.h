@@ -0,0 +1,36 @@
+#ifndef HOLE_FILLER_H
+#define HOLE_FILLER_H
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+/**
+ * @brief Fills sensor dropouts (0mm) of a depth map from their valid neighbours.
+ * Push-pull over an image pyramid: every coarser level averages the valid pixels
+ * of 2x2 blocks until a level has no holes left. Going back down every hole is
+ * interpolated bilinearly from the filled level above, valid pixels are kept.
+ * Small holes are filled from close by, large ones from coarse levels.
+ */
+class HoleFiller {
+public:
+	/**
+	 * @brief Fills holes, vectorized and parallel.
+	 * @param depth Depth map (CV_16UC1), 0 for invalid
+	 * @param filled Receives the filled map, may be depth itself
+	 */
+	void fill(const cv::Mat &depth, cv::Mat &filled);
+
+	/**
+	 * @brief Same result as fill without SIMD and threads. Reference for the optimized version.
+	 */
+	void fillReference(const cv::Mat &depth, cv::Mat &filled);
+
+private:
+	void fill(const cv::Mat &depth, cv::Mat &filled, bool optimized);
+
+	// Coarser levels, each half the size of the one below
+	std::vector<cv::Mat> m_levels;
+};
+
+#endif // HOLE_FILLER_H
@@ -6,7 +6,99 @@ using namespace std;
 #include "Settings.h"
 #include "Fullscreen.h"
 
-bool getAutoCalibrationRectangleCornersHough(VideoCapture &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints)
+namespace {
+
+const int CALIB_CIRCLE_RADIUS = 150;
+const int CALIB_CIRCLE_DISTANCE_BORDER = 25;
+
+// Width the coarse detection in the fast calibration scales the quadrant down to
+const int COARSE_WIDTH = 160;
+
+// Detections closer than this fraction of the image width count as the same position
+const double STABLE_DISTANCE = 0.01;
+
+/**
+ * @brief Centers of the calibration circles on the beamer, top left, top right, bottom right, bottom left.
+ */
+vector<Point> getCircleCenters()
+{
+	const int inset = CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER;
+
+	vector<Point> centers;
+	centers.push_back(Point(inset, inset));
+	centers.push_back(Point(settings.beamerXres - inset, inset));
+	centers.push_back(Point(settings.beamerXres - inset, settings.beamerYres - inset));
+	centers.push_back(Point(inset, settings.beamerYres - inset));
+	return centers;
+}
+
+/**
+ * @brief Part of the camera image the circle in the given corner is searched in.
+ * Quadrants overlap in the middle in case the projection isn't centered.
+ * @param corner Index like in getCircleCenters
+ */
+Rect getQuadrant(size_t corner, const Size &size)
+{
+	const int width = size.width / 2 + size.width / 8;
+	const int height = size.height / 2 + size.height / 8;
+
+	const int left = (corner == 1 || corner == 2) ? size.width - width : 0;
+	const int top = (corner == 2 || corner == 3) ? size.height - height : 0;
+	return Rect(left, top, width, height);
+}
+
+/**
+ * @brief Finds a single circle in a region of a grey image.
+ * Detects on a downscaled pyramid level and refines at full resolution around the result.
+ * @param grey Full resolution grey image
+ * @param roi Region to search in
+ * @param center Receives the center in coordinates of the full image
+ * @param radius Receives the radius
+ * @return True if exactly one circle was found
+ */
+bool findCircle(const Mat &grey, const Rect &roi, Point2f &center, float &radius)
+{
+	Mat level = grey(roi);
+	int scale = 1;
+	while (level.cols >= 2 * COARSE_WIDTH)
+	{
+		Mat down;
+		pyrDown(level, down);
+		level = down;
+		scale *= 2;
+	}
+
+	Mat coarse;
+	GaussianBlur(level, coarse, Size(5, 5), 1, 1);
+
+	// Votes grow with the circumference, lower the threshold with the size
+	vector<Vec3f> circles;
+	HoughCircles(coarse, circles, CV_HOUGH_GRADIENT, 1, coarse.rows, 200, std::max(20, 100 / scale), 0, 0);
+	if (circles.size() != 1)
+		return false;
+
+	const float coarseRadius = circles[0][2] * scale;
+	const Point coarseCenter(roi.x + cvRound(circles[0][0] * scale), roi.y + cvRound(circles[0][1] * scale));
+
+	// Full resolution only around the coarse circle, the pyramid is off by up to a pixel per level
+	const int reach = cvCeil(coarseRadius) + 2 * scale + 8;
+	const Rect window = Rect(coarseCenter.x - reach, coarseCenter.y - reach, 2 * reach + 1, 2 * reach + 1) & Rect(0, 0, grey.cols, grey.rows);
+
+	Mat fine;
+	GaussianBlur(grey(window), fine, Size(9, 9), 2, 2);
+
+	HoughCircles(fine, circles, CV_HOUGH_GRADIENT, 1, fine.rows, 200, 100, std::max(1, cvFloor(coarseRadius) - 2 * scale), cvCeil(coarseRadius) + 2 * scale);
+	if (circles.size() != 1)
+		return false;
+
+	center = Point2f(window.x + circles[0][0], window.y + circles[0][1]);
+	radius = circles[0][2];
+	return true;
+}
+
+}
+
+bool getAutoCalibrationRectangleCornersHough(FrameSource &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints)
 {
 	calibPoints.clear();
 	const std::string CALIB_BGR_WND = "Auto Calibration";
@@ -15,13 +107,12 @@ bool getAutoCalibrationRectangleCornersHough(VideoCapture &capture, vector<Point
 	namedWindow(CALIB_BGR_WND);
 	namedWindow(CALIB_BGR_WND_MONITOR);
 
-	const int CALIB_CIRCLE_RADIUS = 150;
-	const int CALIB_CIRCLE_DISTANCE_BORDER = 25;
+	const vector<Point> centers = getCircleCenters();
 
-	cv::Point circle_top_left = cv::Point(CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER, CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER); // top left
-	cv::Point circle_top_right = cv::Point(settings.beamerXres - (CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER), CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER); // top right
-	cv::Point circle_bottom_left = cv::Point(CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER, settings.beamerYres - (CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER)); // bottom left
-	cv::Point circle_bottom_right = cv::Point(settings.beamerXres - (CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER), settings.beamerYres -(CALIB_CIRCLE_RADIUS + CALIB_CIRCLE_DISTANCE_BORDER)); // bottom right
+	cv::Point circle_top_left = centers[0]; // top left
+	cv::Point circle_top_right = centers[1]; // top right
+	cv::Point circle_bottom_left = centers[3]; // bottom left
+	cv::Point circle_bottom_right = centers[2]; // bottom right
 
 	realPoints.push_back(Point2f(circle_top_left)); // Top left
 	realPoints.push_back(Point2f(circle_top_right)); // Top right
@@ -158,4 +249,108 @@ bool getAutoCalibrationRectangleCornersHough(VideoCapture &capture, vector<Point
 	cv::destroyWindow(CALIB_BGR_WND);
 	cv::destroyWindow(CALIB_BGR_WND_MONITOR);
 	return true;
-}
\ No newline at end of file
+}
+
+bool getAutoCalibrationRectangleCornersHoughFast(FrameSource &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints)
+{
+	calibPoints.clear();
+	const std::string CALIB_BGR_WND = "Auto Calibration";
+	const std::string CALIB_BGR_WND_MONITOR = "Auto Calibration Monitor";
+
+	namedWindow(CALIB_BGR_WND);
+	namedWindow(CALIB_BGR_WND_MONITOR);
+
+	const vector<Point> centers = getCircleCenters();
+	for (size_t i = 0; i < centers.size(); ++i)
+	{
+		realPoints.push_back(Point2f(centers[i]));
+	}
+
+	if (settings.fullscreen)
+	{
+		if(!fullScreen(settings.monitorRect, CALIB_BGR_WND))
+		{
+			cerr << "Failed to fullscreen output window on monitor " << settings.monitor << endl;
+		}
+		else
+		{
+			cout << "Entered fullscreen on monitor " << settings.monitor << endl;
+		}
+	}
+
+	const int64 startTicks = getTickCount();
+
+	Mat pattern(settings.beamerYres, settings.beamerXres, CV_8UC1);
+	Mat mat, grey;
+
+	for (size_t corner = 0; corner < centers.size(); ++corner)
+	{
+		memset(pattern.data, 0xFF, pattern.dataend - pattern.data);
+		cv::circle(pattern, centers[corner], CALIB_CIRCLE_RADIUS, cv::Scalar(0), CV_FILLED);
+		imshow(CALIB_BGR_WND, pattern);
+
+		// Frames still showing the last circle don't have one in this quadrant
+		size_t stable = 0;
+		Point2f last, sum;
+		while (stable < settings.calibrationStableFrames)
+		{
+			if(!capture.grab() || !capture.retrieve(mat, CV_CAP_OPENNI_BGR_IMAGE))
+			{
+				cerr << "Failed to capture" << endl;
+				cv::destroyWindow(CALIB_BGR_WND);
+				cv::destroyWindow(CALIB_BGR_WND_MONITOR);
+				return false;
+			}
+
+			cvtColor(mat, grey, CV_BGR2GRAY);
+
+			const Rect quadrant = getQuadrant(corner, grey.size());
+			rectangle(mat, quadrant, Scalar(255,0,0), 1);
+
+			Point2f center;
+			float radius;
+			if (findCircle(grey, quadrant, center, radius))
+			{
+				if (stable > 0 && norm(center - last) <= STABLE_DISTANCE * grey.cols)
+				{
+					++stable;
+					sum += center;
+				}
+				else
+				{
+					stable = 1;
+					sum = center;
+				}
+				last = center;
+
+				circle(mat, Point(cvRound(center.x), cvRound(center.y)), 3, Scalar(0,255,0), -1, 8, 0);
+				circle(mat, Point(cvRound(center.x), cvRound(center.y)), cvRound(radius), Scalar(0,0,255), 3, 8, 0);
+			}
+			else
+			{
+				stable = 0;
+			}
+
+			putText(mat, "Please make sure that the sand surface is level", Point(5,15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,0,255,0));
+			imshow(CALIB_BGR_WND_MONITOR, mat);
+
+			if( waitKey( 1 ) >= 0 )
+			{
+				cerr << "Automatic calibration aborted" << endl;
+				cv::destroyWindow(CALIB_BGR_WND);
+				cv::destroyWindow(CALIB_BGR_WND_MONITOR);
+				return false;
+			}
+		}
+
+		// Average of the stable detections
+		calibPoints.push_back(sum * (1.f / stable));
+		cerr << "Circle detected!" << endl;
+	}
+
+	cerr << "Automatic calibration done in " << (getTickCount() - startTicks) / getTickFrequency() << "s" << endl;
+
+	cv::destroyWindow(CALIB_BGR_WND);
+	cv::destroyWindow(CALIB_BGR_WND_MONITOR);
+	return true;
+}
@@ -4,6 +4,18 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 
-bool getAutoCalibrationRectangleCornersHough(cv::VideoCapture &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
+#include "FrameSource.h"
+
+bool getAutoCalibrationRectangleCornersHough(FrameSource &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
+
+/**
+ * @brief Faster variant of the hough circle calibration.
+ * Each circle is only searched for in the quadrant of the camera image it is projected into,
+ * which assumes sensor and beamer aren't rotated against each other. Circles are detected on a
+ * downscaled pyramid level and refined at full resolution around the coarse result. The next
+ * circle is shown as soon as one was found at the same position in settings.calibrationStableFrames
+ * consecutive frames.
+ */
+bool getAutoCalibrationRectangleCornersHoughFast(FrameSource &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
 
 #endif // HOUGHCORNERDETECTION_H
\ No newline at end of file
@@ -0,0 +1,120 @@
+#define NOMINMAX
+
+#include "IdleGovernor.h"
+#include "Threading.h"
+
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+// Distance between samples in both directions, 80x60 samples on a 640x480 depth map
+const int SAMPLE_STEP = 8;
+
+// Samples that have to move for a frame to count as motion, ignores single noisy pixels
+const double MOTION_FRACTION = 0.002;
+
+IdleGovernor::IdleGovernor(uint16_t thresholdInMM, double idleDelayInSeconds)
+	: m_threshold(thresholdInMM)
+	, m_idleDelayInTicks(static_cast<int64>(idleDelayInSeconds * cv::getTickFrequency()))
+	, m_idle(false)
+	, m_lastMotionTicks(cv::getTickCount())
+	, m_lastUpdateTicks(m_lastMotionTicks)
+	, m_idleInMs(0)
+{
+}
+
+bool IdleGovernor::update(const cv::Mat &depth, bool keepAwake)
+{
+	const int64 now = cv::getTickCount();
+
+	if (m_idle)
+	{
+		atomicAdd(&m_idleInMs, static_cast<long>((now - m_lastUpdateTicks) * 1000 / static_cast<int64>(cv::getTickFrequency())));
+	}
+
+	m_lastUpdateTicks = now;
+
+	if (detectMotion(depth) || keepAwake)
+	{
+		m_lastMotionTicks = now;
+
+		if (m_idle)
+		{
+			cout << "Motion detected, resuming" << endl;
+			m_idle = false;
+		}
+
+		return true;
+	}
+
+	if (!m_idle && now - m_lastMotionTicks > m_idleDelayInTicks)
+	{
+		cout << "No motion, going idle" << endl;
+		m_idle = true;
+	}
+
+	return !m_idle;
+}
+
+double IdleGovernor::getIdleTime() const
+{
+	return atomicLoad(&m_idleInMs) / 1000.;
+}
+
+bool IdleGovernor::detectMotion(const cv::Mat &depth)
+{
+	assert(depth.type() == CV_16UC1);
+
+	const int sampleCols = (depth.cols + SAMPLE_STEP - 1) / SAMPLE_STEP;
+	const int sampleRows = (depth.rows + SAMPLE_STEP - 1) / SAMPLE_STEP;
+
+	if (depth.size() != m_size)
+	{
+		// Nothing to compare with
+		takeReference(depth);
+		return true;
+	}
+
+	const int noiseSamples = static_cast<int>(MOTION_FRACTION * m_reference.size());
+
+	int moved = 0;
+	for (int row = 0; row < sampleRows; ++row)
+	{
+		const uint16_t *values = depth.ptr<uint16_t>(row * SAMPLE_STEP);
+		const uint16_t *reference = &m_reference[row * sampleCols];
+
+		for (int col = 0; col < sampleCols; ++col)
+		{
+			const int value = values[col * SAMPLE_STEP];
+			if (value == 0 || reference[col] == 0)
+				continue;
+
+			if (std::abs(value - reference[col]) > m_threshold)
+				++moved;
+		}
+	}
+
+	if (moved <= noiseSamples)
+		return false;
+
+	// New resting state to compare with
+	takeReference(depth);
+	return true;
+}
+
+void IdleGovernor::takeReference(const cv::Mat &depth)
+{
+	const int sampleCols = (depth.cols + SAMPLE_STEP - 1) / SAMPLE_STEP;
+	const int sampleRows = (depth.rows + SAMPLE_STEP - 1) / SAMPLE_STEP;
+
+	m_size = depth.size();
+	m_reference.resize(sampleCols * sampleRows);
+
+	for (int row = 0; row < sampleRows; ++row)
+	{
+		const uint16_t *values = depth.ptr<uint16_t>(row * SAMPLE_STEP);
+		for (int col = 0; col < sampleCols; ++col)
+			m_reference[row * sampleCols + col] = values[col * SAMPLE_STEP];
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef IDLE_GOVERNOR_H
+#define IDLE_GOVERNOR_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Suspends processing while nothing in the sandbox moves.
+ * Every frame a sparse grid of the raw depth map is compared with the grid at the
+ * last detected motion. Once nothing moved for the idle delay the governor reports
+ * frames as skippable until the first frame with motion, which is processed again.
+ * Dropouts (0mm) are ignored so sensor holes don't keep the sandbox awake.
+ */
+class IdleGovernor {
+public:
+	/**
+	 * @param thresholdInMM Depth change of a sample to count as moved
+	 * @param idleDelayInSeconds Time without motion before going idle
+	 */
+	IdleGovernor(uint16_t thresholdInMM, double idleDelayInSeconds);
+
+	/**
+	 * @param depth Raw depth map (CV_16UC1)
+	 * @param keepAwake If true the frame counts as motion, e.g. for pending user input
+	 * @return True if the frame has to be processed, false while idle
+	 */
+	bool update(const cv::Mat &depth, bool keepAwake = false);
+
+	bool isIdle() const { return m_idle; }
+
+	/**
+	 * @return Total time spent idle in seconds, can be read from other threads
+	 */
+	double getIdleTime() const;
+
+private:
+	bool detectMotion(const cv::Mat &depth);
+	void takeReference(const cv::Mat &depth);
+
+	const int m_threshold;
+	const int64 m_idleDelayInTicks;
+
+	std::vector<uint16_t> m_reference; // Samples at the last detected motion
+	cv::Size m_size;
+
+	bool m_idle;
+	int64 m_lastMotionTicks;
+	int64 m_lastUpdateTicks;
+
+	volatile long m_idleInMs;
+};
+
+#endif // IDLE_GOVERNOR_H
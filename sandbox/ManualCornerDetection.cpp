@@ -18,7 +18,7 @@ void calibrationMouseClickHandler(int event, int x, int y, int flags, void* ptr)
 }
 
 
-bool getManualCalibrationRectangleCorners(VideoCapture &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints)
+bool getManualCalibrationRectangleCorners(FrameSource &capture, vector<Point2f> &calibPoints, vector<Point2f> &realPoints)
 {
 	realPoints.push_back(Point(0,0)); // Top left
 	realPoints.push_back(Point(settings.beamerXres,0)); // Top right
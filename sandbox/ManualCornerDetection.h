@@ -4,6 +4,8 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 
-bool getManualCalibrationRectangleCorners(cv::VideoCapture &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
+#include "FrameSource.h"
+
+bool getManualCalibrationRectangleCorners(FrameSource &capture, std::vector<cv::Point2f> &calibPoints, std::vector<cv::Point2f> &realPoints);
 
 #endif // MANUALCORNERDETECTION_H
\ No newline at end of file
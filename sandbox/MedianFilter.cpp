@@ -1,8 +1,398 @@
 #include "MedianFilter.h"
+#include "SortingNetworks.h"
+#include "ParallelRows.h"
+
+#include <iostream>
 
 using namespace cv;
 using namespace std;
 
-//
-// EMPTY
-//
\ No newline at end of file
+// Windows up to this many samples are handled by sorting networks
+const size_t INCREMENTAL_MIN_SAMPLES = 15;
+// Histogram bins count with 8 bit
+const size_t INCREMENTAL_MAX_SAMPLES = 255;
+// Number of histogram bins summarized in a coarse bin for skipping empty ranges
+const int COARSE_BINS = 16;
+
+/**
+ * @brief Median of the valid samples of N rows using a sorting network per column.
+ * Processes as many columns at once as the widest available SIMD registers hold.
+ *
+ * Dropouts (0) are replaced by 0 and 0xFFFF in turns, the first one by 0xFFFF.
+ * Equally many go below and above the valid samples, so the network's median
+ * is the median of the valid samples, with an even count the upper one like
+ * getFilteredReference picks. Columns without any valid sample become 0.
+ *
+ * @param src N sample rows
+ * @param dst Destination row
+ * @param cols Number of columns
+ */
+template <int N>
+static void medianRow(const uint16_t * const *src, uint16_t *dst, const size_t cols)
+{
+	size_t col = 0;
+
+#ifdef SORTING_NETWORKS_AVX2
+	for (; col + 16 <= cols; col += 16)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i nextHigh = _mm256_set1_epi16(-1);
+		__m256i noneValid = nextHigh;
+
+		__m256i v[N];
+		for (int k = 0; k < N; ++k)
+		{
+			const __m256i sample = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src[k] + col));
+			const __m256i dropout = _mm256_cmpeq_epi16(sample, zero);
+
+			v[k] = _mm256_or_si256(sample, _mm256_and_si256(dropout, nextHigh));
+			nextHigh = _mm256_xor_si256(nextHigh, dropout);
+			noneValid = _mm256_and_si256(noneValid, dropout);
+		}
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + col), _mm256_andnot_si256(noneValid, MedianNetwork<N>::select(v)));
+	}
+#endif
+
+#ifdef SORTING_NETWORKS_SSE2
+	for (; col + 8 <= cols; col += 8)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i nextHigh = _mm_set1_epi16(-1);
+		__m128i noneValid = nextHigh;
+
+		__m128i v[N];
+		for (int k = 0; k < N; ++k)
+		{
+			const __m128i sample = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[k] + col));
+			const __m128i dropout = _mm_cmpeq_epi16(sample, zero);
+
+			v[k] = biasEpu16(_mm_or_si128(sample, _mm_and_si128(dropout, nextHigh)));
+			nextHigh = _mm_xor_si128(nextHigh, dropout);
+			noneValid = _mm_and_si128(noneValid, dropout);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + col), _mm_andnot_si128(noneValid, biasEpu16(MedianNetwork<N>::select(v))));
+	}
+#endif
+
+	for (; col < cols; ++col)
+	{
+		bool nextHigh = true;
+		bool noneValid = true;
+
+		uint16_t v[N];
+		for (int k = 0; k < N; ++k)
+		{
+			v[k] = src[k][col];
+			if (v[k] == 0)
+			{
+				v[k] = nextHigh ? 0xFFFF : 0;
+				nextHigh = !nextHigh;
+			}
+			else
+			{
+				noneValid = false;
+			}
+		}
+
+		dst[col] = noneValid ? 0 : MedianNetwork<N>::select(v);
+	}
+}
+
+/**
+ * @brief Runs medianRow over bands of rows.
+ * Sample n of a row is read from slot n * stepsize of the history volume.
+ */
+template <int N>
+class NetworkRows : public RowBody {
+public:
+	NetworkRows(const cv::Mat &volume, size_t stepsize, cv::Mat &result)
+		: m_volume(volume)
+		, m_stepsize(stepsize)
+		, m_result(result) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const size_t COLS = m_result.cols;
+
+		const uint16_t *src[N];
+		for (int row = begin; row < end; ++row)
+		{
+			for (size_t n = 0; n < N; ++n)
+			{
+				src[n] = m_volume.ptr<uint16_t>(static_cast<int>(n * m_stepsize), row);
+			}
+
+			medianRow<N>(src, m_result.ptr<uint16_t>(row), COLS);
+		}
+	}
+
+private:
+	const cv::Mat &m_volume;
+	const size_t m_stepsize;
+	cv::Mat &m_result;
+};
+
+template <int N>
+void MedianFilter::getFilteredNetwork(cv::Mat &result)
+{
+	const cv::Mat &volume = getVolume();
+
+	assert(getSampleCount() == N);
+	assert(volume.type() == CV_16UC1);
+
+	result.create(getHistory()[0].size(), CV_16UC1);
+
+	parallelForRows(result.rows, result.cols * sizeof(uint16_t) * (N + 1), NetworkRows<N>(volume, m_stepsize, result));
+}
+
+bool MedianFilter::enableIncremental(uint16_t minValue, uint16_t maxValue)
+{
+	const size_t window = (getDepth() + m_stepsize - 1) / m_stepsize;
+	if (window <= INCREMENTAL_MIN_SAMPLES || window > INCREMENTAL_MAX_SAMPLES || maxValue < minValue)
+		return false;
+
+	m_incremental = true;
+	m_minValue = minValue;
+	m_maxValue = maxValue;
+	m_size = Size();
+
+	// The median of a pixel is taken over as many samples as it has valid ones
+	enableValidCounts(m_stepsize);
+
+	// Catch up with frames already in the history
+	std::vector<cv::Mat>& history = getHistory();
+	Mat counts;
+	for (size_t pos = 0; pos < history.size(); pos += m_stepsize)
+	{
+		if (counts.data == NULL)
+		{
+			counts = Mat::zeros(history[pos].size(), CV_16UC1);
+		}
+
+		updateHistograms(history[pos], Mat(), counts);
+
+		for (int row = 0; row < counts.rows; ++row)
+		{
+			const uint16_t *sample = history[pos].ptr<uint16_t>(row);
+			uint16_t *count = counts.ptr<uint16_t>(row);
+
+			for (int col = 0; col < counts.cols; ++col)
+			{
+				count[col] += (sample[col] != 0);
+			}
+		}
+	}
+
+	return true;
+}
+
+void MedianFilter::onFrameAdded(size_t slot, const cv::Mat &incoming, const cv::Mat &outgoing)
+{
+	if (!m_incremental || slot % m_stepsize != 0)
+		return;
+
+	// Counts are updated after this call
+	updateHistograms(incoming, outgoing, getValidCounts());
+}
+
+static inline int toBin(uint16_t value, uint16_t minValue, uint16_t maxValue)
+{
+	return std::min(maxValue, std::max(minValue, value)) - minValue;
+}
+
+class MedianFilter::HistogramUpdate : public RowBody {
+public:
+	HistogramUpdate(MedianFilter &filter, const cv::Mat &incoming, const cv::Mat &outgoing, const cv::Mat &counts)
+		: m_filter(filter)
+		, m_incoming(incoming)
+		, m_outgoing(outgoing)
+		, m_counts(counts) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		m_filter.updateHistogramRows(begin, end, m_incoming, m_outgoing, m_counts);
+	}
+
+private:
+	MedianFilter &m_filter;
+	const cv::Mat &m_incoming;
+	const cv::Mat &m_outgoing;
+	const cv::Mat &m_counts;
+};
+
+void MedianFilter::updateHistograms(const cv::Mat &incoming, const cv::Mat &outgoing, const cv::Mat &counts)
+{
+	assert(incoming.type() == CV_16UC1);
+
+	const int BINS = m_maxValue - m_minValue + 1;
+	const int COARSE = (BINS + COARSE_BINS - 1) / COARSE_BINS;
+
+	if (m_size != incoming.size())
+	{
+		m_size = incoming.size();
+
+		const size_t pixels = m_size.area();
+		m_histograms.assign(pixels * BINS, 0);
+		m_coarse.assign(pixels * COARSE, 0);
+		m_median.assign(pixels, 0);
+		m_below.assign(pixels, 0);
+
+		cout << "Incremental median uses " << (m_histograms.size() + m_coarse.size()) / (1024 * 1024) << " MB of histograms" << endl;
+	}
+
+	// Histogram bins touched per pixel are scattered, assume a cache line each
+	const size_t rowBytes = m_size.width * (3 * sizeof(uint16_t) + 3 * 64);
+	parallelForRows(m_size.height, rowBytes, HistogramUpdate(*this, incoming, outgoing, counts));
+}
+
+void MedianFilter::updateHistogramRows(int begin, int end, const cv::Mat &incoming, const cv::Mat &outgoing, const cv::Mat &counts)
+{
+	const int BINS = m_maxValue - m_minValue + 1;
+	const int COARSE = (BINS + COARSE_BINS - 1) / COARSE_BINS;
+
+	const bool replacing = (outgoing.data != NULL);
+
+	for (int row = begin; row < end; ++row)
+	{
+		const uint16_t *in = incoming.ptr<uint16_t>(row);
+		const uint16_t *out = replacing ? outgoing.ptr<uint16_t>(row) : NULL;
+		const uint16_t *count = counts.ptr<uint16_t>(row);
+
+		size_t pixel = static_cast<size_t>(row) * m_size.width;
+		for (int col = 0; col < m_size.width; ++col, ++pixel)
+		{
+			uint8_t *hist = &m_histograms[pixel * BINS];
+			uint8_t *coarse = &m_coarse[pixel * COARSE];
+
+			int median = m_median[pixel];
+			int below = m_below[pixel];
+
+			// Dropouts aren't in the histograms
+			int samples = count[col];
+			if (in[col] != 0)
+			{
+				const int inBin = toBin(in[col], m_minValue, m_maxValue);
+				++hist[inBin];
+				++coarse[inBin / COARSE_BINS];
+				if (inBin < median) ++below;
+				++samples;
+			}
+
+			if (replacing && out[col] != 0)
+			{
+				const int outBin = toBin(out[col], m_minValue, m_maxValue);
+				--hist[outBin];
+				--coarse[outBin / COARSE_BINS];
+				if (outBin < median) --below;
+				--samples;
+			}
+
+			if (samples == 0)
+			{
+				// Nothing to take the median of, the bin is kept for the next sample
+				m_median[pixel] = static_cast<uint16_t>(median);
+				m_below[pixel] = 0;
+				continue;
+			}
+
+			// Sorted position of the median, same as in getFilteredReference
+			const int k = samples / 2;
+
+			// Move the median to the bin holding sorted position k. Usually it
+			// doesn't move at all or only to a neighbouring non-empty bin.
+			while (below > k)
+			{
+				--median;
+				while (hist[median] == 0)
+				{
+					if (median % COARSE_BINS == COARSE_BINS - 1 && coarse[median / COARSE_BINS] == 0) median -= COARSE_BINS;
+					else --median;
+				}
+				below -= hist[median];
+			}
+
+			while (below + hist[median] <= k)
+			{
+				below += hist[median];
+				++median;
+				while (hist[median] == 0)
+				{
+					if (median % COARSE_BINS == 0 && coarse[median / COARSE_BINS] == 0) median += COARSE_BINS;
+					else ++median;
+				}
+			}
+
+			m_median[pixel] = static_cast<uint16_t>(median);
+			m_below[pixel] = static_cast<uint8_t>(below);
+		}
+	}
+}
+
+/**
+ * @brief Converts the median bins to values.
+ */
+class MedianFromBins : public RowBody {
+public:
+	MedianFromBins(const std::vector<uint16_t> &median, const cv::Mat &counts, uint16_t minValue, cv::Mat &result)
+		: m_median(median)
+		, m_counts(counts)
+		, m_minValue(minValue)
+		, m_result(result) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		const int COLS = m_result.cols;
+
+		for (int row = begin; row < end; ++row)
+		{
+			uint16_t *dst = m_result.ptr<uint16_t>(row);
+			const uint16_t *median = &m_median[static_cast<size_t>(row) * COLS];
+			const uint16_t *count = m_counts.ptr<uint16_t>(row);
+
+			for (int col = 0; col < COLS; ++col)
+			{
+				dst[col] = count[col] ? median[col] + m_minValue : 0;
+			}
+		}
+	}
+
+private:
+	const std::vector<uint16_t> &m_median;
+	const cv::Mat &m_counts;
+	const uint16_t m_minValue;
+	cv::Mat &m_result;
+};
+
+void MedianFilter::getFilteredIncremental(cv::Mat &result)
+{
+	result.create(m_size, CV_16UC1);
+
+	parallelForRows(m_size.height, m_size.width * 3 * sizeof(uint16_t), MedianFromBins(m_median, getValidCounts(), m_minValue, result));
+}
+
+template <>
+void MedianFilter::getFiltered<uint16_t>(cv::Mat &result)
+{
+	assert(getHistory().size() > 0);
+
+	if (m_incremental)
+	{
+		getFilteredIncremental(result);
+		return;
+	}
+
+	switch (getSampleCount())
+	{
+	case 3: getFilteredNetwork<3>(result); break;
+	case 5: getFilteredNetwork<5>(result); break;
+	case 7: getFilteredNetwork<7>(result); break;
+	case 9: getFilteredNetwork<9>(result); break;
+	case 15: getFilteredNetwork<15>(result); break;
+	default:
+		// Uncommon window size, e.g. while the history is filling up
+		getFilteredReference<uint16_t>(result);
+		break;
+	}
+}
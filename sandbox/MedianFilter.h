@@ -3,16 +3,51 @@
 
 #include "HistoryBuffer.h"
 
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
 class MedianFilter : public HistoryBuffer {
 public:
 	MedianFilter(const size_t depth, const size_t stepsize)
 		: HistoryBuffer(depth)
 		, m_stepsize(stepsize) 
+		, m_incremental(false)
+		, m_minValue(0)
+		, m_maxValue(0)
 	{
 	}
 
+	/**
+	 * @brief Switches deep windows to an incremental histogram median.
+	 * Every pixel keeps a counting histogram over [minValue, maxValue] which is updated as
+	 * frames enter and leave the history so the per frame cost doesn't depend on the depth.
+	 * Valid samples are clamped to the range, dropouts aren't added. As clamping commutes
+	 * with the median the result equals the clamped result of getFilteredReference.
+	 *
+	 * Only used for CV_16UC1 windows of more than 15 and at most 255 samples, smaller
+	 * windows are faster with sorting networks.
+	 *
+	 * @return True if incremental mode is used
+	 */
+	bool enableIncremental(uint16_t minValue, uint16_t maxValue);
+
+	/**
+	 * @brief Per pixel median over the valid (non zero) samples of the history.
+	 * Pixels without any valid sample are 0.
+	 * CV_16UC1 depth maps have a specialized implementation (see MedianFilter.cpp).
+	 */
 	template <typename T>
 	void getFiltered(cv::Mat &result)
+	{
+		getFilteredReference<T>(result);
+	}
+
+	/**
+	 * @brief Sorts the samples of every pixel. Works for every type, reference for optimized versions.
+	 */
+	template <typename T>
+	void getFilteredReference(cv::Mat &result)
 	{
 		std::vector<cv::Mat>& history = getHistory();
 
@@ -21,16 +56,15 @@ public:
 		if(result.data == NULL)
 		{
 			// Reserve storage if not available
-			result = Mat(history[0].rows, history[0].cols, history[0].type());
+			result = cv::Mat(history[0].rows, history[0].cols, history[0].type());
 		}
 
 		const size_t ROWS = result.rows;
 		const size_t COLS = result.cols;
 
 		std::vector<T> buffer;
-		buffer.resize(static_cast<size_t>(ceil((static_cast<double>(history.size()) / m_stepsize))));
+		buffer.resize(getSampleCount());
 		size_t n = 0;
-		const size_t MIDDLEIDX = buffer.size() / 2;
 		for (size_t row = 0; row < ROWS; ++row)
 		{
 			for (size_t col = 0; col < COLS; ++col)
@@ -38,21 +72,68 @@ public:
 				n = 0;
 				for (size_t pos = 0; pos < history.size(); pos += m_stepsize)
 				{
-					buffer[n] = history[pos].at<T>(Point(col, row));
-					++n;
+					// Dropouts are 0 and skipped
+					const T value = history[pos].at<T>(cv::Point(col, row));
+					if (value != T())
+					{
+						buffer[n] = value;
+						++n;
+					}
 				}
 
-				std::sort(buffer.begin(), buffer.end());
+				std::sort(buffer.begin(), buffer.begin() + n);
 
-				result.at<T>(Point(col, row)) = buffer[MIDDLEIDX];
+				result.at<T>(cv::Point(col, row)) = (n > 0) ? buffer[n / 2] : T();
 			}
 		}
 	}
 
+private:
+	// Number of history frames the median is taken over
+	size_t getSampleCount()
+	{
+		return static_cast<size_t>(ceil((static_cast<double>(getHistory().size()) / m_stepsize)));
+	}
+
+	template <int N>
+	void getFilteredNetwork(cv::Mat &result);
+
+	void getFilteredIncremental(cv::Mat &result);
+
+	/**
+	 * @param counts Valid samples per pixel before the update
+	 */
+	void updateHistograms(const cv::Mat &incoming, const cv::Mat &outgoing, const cv::Mat &counts);
+	void updateHistogramRows(int begin, int end, const cv::Mat &incoming, const cv::Mat &outgoing, const cv::Mat &counts);
+
+	class HistogramUpdate;
+	friend class HistogramUpdate;
+
+protected:
+	virtual void onFrameAdded(size_t slot, const cv::Mat &incoming, const cv::Mat &outgoing);
+
 private:
 	const size_t m_stepsize;
 
+	// Incremental histogram median state
+	bool m_incremental;
+	uint16_t m_minValue;
+	uint16_t m_maxValue;
+	cv::Size m_size;
+	std::vector<uint8_t> m_histograms; // (maxValue - minValue + 1) bins per pixel
+	std::vector<uint8_t> m_coarse;     // Sums of 16 neighbouring bins per pixel
+	std::vector<uint16_t> m_median;    // Current median bin per pixel
+	std::vector<uint8_t> m_below;      // Number of samples in bins below the median per pixel
+
 };
 
+/**
+ * @brief Median of depth maps over their valid samples.
+ * Uses the incremental histogram if enabled, otherwise SIMD sorting networks for 3, 5, 7, 9
+ * and 15 samples which are bit-exact with getFilteredReference. Falls back to it for other
+ * sample counts.
+ */
+template <>
+void MedianFilter::getFiltered<uint16_t>(cv::Mat &result);
 
-#endif // MEDIAN_FILTER_H
+#endif // MEDIAN_FILTER_H
\ No newline at end of file
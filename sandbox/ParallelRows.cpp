@@ -0,0 +1,160 @@
+#include "ParallelRows.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// Memory a band should touch so it stays in the per core L2 cache
+const size_t BAND_BYTES = 128 * 1024;
+// Minimum number of bands per thread so uneven bands balance out
+const int BANDS_PER_THREAD = 4;
+
+namespace {
+
+/**
+ * @brief Fixed set of threads processing the bands of one loop at a time.
+ */
+class WorkerPool {
+public:
+	WorkerPool(size_t threads)
+		: m_threads(threads > 1 ? threads - 1 : 0)
+		, m_quit(false)
+		, m_body(NULL)
+		, m_rows(0)
+		, m_bandRows(1)
+		, m_bands(0)
+		, m_nextBand(0)
+		, m_pending(0)
+	{
+		for (size_t i = 0; i < m_threads.size(); ++i)
+		{
+			m_threads[i] = new Thread();
+			m_threads[i]->start(workerMain, this);
+		}
+	}
+
+	~WorkerPool()
+	{
+		m_quit = true;
+		m_start.post(static_cast<long>(m_threads.size()));
+
+		for (size_t i = 0; i < m_threads.size(); ++i)
+		{
+			m_threads[i]->join();
+			delete m_threads[i];
+		}
+	}
+
+	size_t threadCount() const
+	{
+		return m_threads.size() + 1;
+	}
+
+	void run(int rows, int bandRows, const RowBody &body)
+	{
+		// Loops from different threads take turns
+		ScopedLock lock(m_running);
+
+		m_body = &body;
+		m_rows = rows;
+		m_bandRows = bandRows;
+		m_bands = (rows + bandRows - 1) / bandRows;
+		atomicStore(&m_nextBand, 0);
+		atomicStore(&m_pending, static_cast<long>(m_threads.size()));
+
+		m_start.post(static_cast<long>(m_threads.size()));
+
+		processBands();
+
+		m_done.wait();
+	}
+
+private:
+	static void workerMain(void *arg)
+	{
+		WorkerPool *pool = static_cast<WorkerPool*>(arg);
+
+		for (;;)
+		{
+			pool->m_start.wait();
+			if (pool->m_quit)
+				return;
+
+			pool->processBands();
+
+			if (atomicDecrement(&pool->m_pending) == 0)
+				pool->m_done.post();
+		}
+	}
+
+	void processBands()
+	{
+		for (;;)
+		{
+			const long band = atomicIncrement(&m_nextBand) - 1;
+			if (band >= m_bands)
+				return;
+
+			const int begin = band * m_bandRows;
+			(*m_body)(begin, std::min(m_rows, begin + m_bandRows));
+		}
+	}
+
+	std::vector<Thread*> m_threads;
+	volatile bool m_quit;
+
+	Mutex m_running;
+
+	Semaphore m_start;
+	Semaphore m_done;
+
+	// Current loop
+	const RowBody *m_body;
+	int m_rows;
+	int m_bandRows;
+	long m_bands;
+	volatile long m_nextBand;
+	volatile long m_pending; // Workers still busy with the loop
+};
+
+WorkerPool *pool = NULL;
+
+}
+
+void setWorkerThreads(size_t threads)
+{
+	if (threads == 0)
+		threads = getCoreCount();
+
+	if (pool != NULL && pool->threadCount() == threads)
+		return;
+
+	delete pool;
+	pool = (threads > 1) ? new WorkerPool(threads) : NULL;
+}
+
+size_t getWorkerThreads()
+{
+	return (pool != NULL) ? pool->threadCount() : 1;
+}
+
+void parallelForRows(int rows, size_t rowBytes, const RowBody &body)
+{
+	if (rows <= 0)
+		return;
+
+	const int threads = static_cast<int>(getWorkerThreads());
+
+	int bandRows = static_cast<int>(std::max<size_t>(1, BAND_BYTES / std::max<size_t>(1, rowBytes)));
+	bandRows = std::min(bandRows, std::max(1, rows / (threads * BANDS_PER_THREAD)));
+
+	if (pool == NULL || bandRows >= rows)
+	{
+		body(0, rows);
+		return;
+	}
+
+	pool->run(rows, bandRows, body);
+}
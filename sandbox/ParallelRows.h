@@ -0,0 +1,37 @@
+#ifndef PARALLEL_ROWS_H
+#define PARALLEL_ROWS_H
+
+#include <stddef.h>
+
+/**
+ * @brief Work done by parallelForRows. Called concurrently with disjoint row ranges.
+ */
+class RowBody {
+public:
+	virtual ~RowBody() {}
+
+	/**
+	 * @param begin First row of the band
+	 * @param end One past the last row of the band
+	 */
+	virtual void operator()(int begin, int end) const = 0;
+};
+
+/**
+ * @brief Sets the number of threads parallelForRows uses, including the calling thread.
+ * @param threads Number of threads, 0 for one per core, 1 to run everything on the calling thread
+ */
+void setWorkerThreads(size_t threads);
+size_t getWorkerThreads();
+
+/**
+ * @brief Splits rows into cache sized bands and processes them on the worker pool.
+ * The calling thread takes part and the function returns once all bands are done.
+ *
+ * @param rows Number of rows to process
+ * @param rowBytes Memory touched per row over all inputs and outputs, used to size the bands
+ * @param body Work per band
+ */
+void parallelForRows(int rows, size_t rowBytes, const RowBody &body);
+
+#endif // PARALLEL_ROWS_H
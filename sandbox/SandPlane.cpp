@@ -0,0 +1,253 @@
+#include "SandPlane.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+// Samples taken over the beamer image
+const int GRID_COLS = 32;
+const int GRID_ROWS = 24;
+
+const int RANSAC_ITERATIONS = 200;
+
+// Samples closer to a plane than this belong to it
+const double INLIER_DISTANCE_IN_MM = 8.;
+
+// Fraction of the samples that have to lie on the plane
+const double MIN_INLIER_FRACTION = 0.5;
+
+/**
+ * @brief Solves a 3x3 linear system with Cramer's rule.
+ * @return False if the system is singular
+ */
+bool solve3(const double A[9], const double b[3], double x[3])
+{
+	const double det = A[0] * (A[4] * A[8] - A[5] * A[7])
+		- A[1] * (A[3] * A[8] - A[5] * A[6])
+		+ A[2] * (A[3] * A[7] - A[4] * A[6]);
+
+	if (std::fabs(det) < 1e-12)
+		return false;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		double M[9];
+		for (int k = 0; k < 9; ++k)
+		{
+			M[k] = (k % 3 == i) ? b[k / 3] : A[k];
+		}
+
+		x[i] = (M[0] * (M[4] * M[8] - M[5] * M[7])
+			- M[1] * (M[3] * M[8] - M[5] * M[6])
+			+ M[2] * (M[3] * M[7] - M[4] * M[6])) / det;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Sensor position under a beamer pixel.
+ * @param M Inverse homography
+ * @return False if the pixel doesn't map to a finite position
+ */
+bool toSensor(const double *M, double x, double y, Point2d &sensor)
+{
+	const double W = M[6] * x + M[7] * y + M[8];
+	if (W == 0.)
+		return false;
+
+	sensor = Point2d((M[0] * x + M[1] * y + M[2]) / W, (M[3] * x + M[4] * y + M[5]) / W);
+	return true;
+}
+
+Mat invertHomography(const Mat &homography)
+{
+	Mat inverse;
+	homography.convertTo(inverse, CV_64F);
+	return inverse.inv();
+}
+
+/**
+ * @brief Inverse depth of a plane at a sensor position, 0 where the plane is behind the sensor.
+ */
+inline double inverseDepth(const double *plane, double x, double y)
+{
+	return std::max(0., plane[0] * x + plane[1] * y + plane[2]);
+}
+
+size_t countInliers(const vector<Point3d> &samples, const double *plane)
+{
+	size_t inliers = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		const double w = inverseDepth(plane, samples[i].x, samples[i].y);
+		if (w > 0. && std::fabs(samples[i].z - 1. / w) <= INLIER_DISTANCE_IN_MM)
+			++inliers;
+	}
+
+	return inliers;
+}
+
+}
+
+SandPlane::SandPlane()
+{
+}
+
+SandPlane::SandPlane(const Mat &coefficients)
+{
+	if (coefficients.rows == 1 && coefficients.cols == 3 && coefficients.type() == CV_64FC1)
+	{
+		m_coefficients = coefficients.clone();
+	}
+}
+
+bool SandPlane::fit(const Mat &depthInMM, const Mat &homography, const Size &outputSize)
+{
+	CV_Assert(depthInMM.type() == CV_16UC1);
+
+	m_coefficients = Mat();
+
+	const Mat inverse = invertHomography(homography);
+	const double *M = inverse.ptr<double>(0);
+
+	vector<Point3d> samples;
+	for (int gy = 0; gy < GRID_ROWS; ++gy)
+	{
+		for (int gx = 0; gx < GRID_COLS; ++gx)
+		{
+			Point2d sensor;
+			if (!toSensor(M, (gx + .5) * outputSize.width / GRID_COLS, (gy + .5) * outputSize.height / GRID_ROWS, sensor))
+				continue;
+
+			const int x = cvRound(sensor.x);
+			const int y = cvRound(sensor.y);
+			if (x < 0 || y < 0 || x >= depthInMM.cols || y >= depthInMM.rows)
+				continue;
+
+			const uint16_t depth = depthInMM.at<uint16_t>(y, x);
+			if (depth == 0)
+				continue; // Sensor dropout
+
+			samples.push_back(Point3d(x, y, depth));
+		}
+	}
+
+	const size_t minInliers = static_cast<size_t>(GRID_COLS * GRID_ROWS * MIN_INLIER_FRACTION);
+	if (samples.size() < minInliers)
+	{
+		cerr << "Too little valid depth to fit the sand plane" << endl;
+		return false;
+	}
+
+	// Fixed seed so calibration is reproducible
+	RNG random(0x5A4D);
+
+	double best[3] = { 0., 0., 0. };
+	size_t bestInliers = 0;
+
+	for (int iteration = 0; iteration < RANSAC_ITERATIONS; ++iteration)
+	{
+		const Point3d &p0 = samples[random.uniform(0, static_cast<int>(samples.size()))];
+		const Point3d &p1 = samples[random.uniform(0, static_cast<int>(samples.size()))];
+		const Point3d &p2 = samples[random.uniform(0, static_cast<int>(samples.size()))];
+
+		const double A[9] = { p0.x, p0.y, 1., p1.x, p1.y, 1., p2.x, p2.y, 1. };
+		const double b[3] = { 1. / p0.z, 1. / p1.z, 1. / p2.z };
+
+		double plane[3];
+		if (!solve3(A, b, plane))
+			continue; // Repeated or collinear samples
+
+		const size_t inliers = countInliers(samples, plane);
+		if (inliers > bestInliers)
+		{
+			bestInliers = inliers;
+			std::copy(plane, plane + 3, best);
+		}
+	}
+
+	if (bestInliers < minInliers)
+	{
+		cerr << "Sand isn't level, only " << bestInliers << " of " << samples.size() << " samples on a plane" << endl;
+		return false;
+	}
+
+	// Least squares over the inliers of the best candidate
+	double AtA[9] = { 0., 0., 0., 0., 0., 0., 0., 0., 0. };
+	double Atb[3] = { 0., 0., 0. };
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		const Point3d &p = samples[i];
+		const double w = inverseDepth(best, p.x, p.y);
+		if (w <= 0. || std::fabs(p.z - 1. / w) > INLIER_DISTANCE_IN_MM)
+			continue;
+
+		const double row[3] = { p.x, p.y, 1. };
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				AtA[r * 3 + c] += row[r] * row[c];
+			}
+			Atb[r] += row[r] / p.z;
+		}
+	}
+
+	double refined[3];
+	if (solve3(AtA, Atb, refined) && countInliers(samples, refined) >= bestInliers)
+	{
+		std::copy(refined, refined + 3, best);
+	}
+
+	m_coefficients = Mat(1, 3, CV_64FC1);
+	std::copy(best, best + 3, m_coefficients.ptr<double>(0));
+
+	return true;
+}
+
+double SandPlane::depthAt(double x, double y) const
+{
+	assert(valid());
+
+	const double w = inverseDepth(m_coefficients.ptr<double>(0), x, y);
+	return w > 0. ? 1. / w : 0.;
+}
+
+double SandPlane::depthAtOutput(const Mat &homography, double x, double y) const
+{
+	const Mat inverse = invertHomography(homography);
+
+	Point2d sensor;
+	if (!toSensor(inverse.ptr<double>(0), x, y, sensor))
+		return 0.;
+
+	return depthAt(sensor.x, sensor.y);
+}
+
+void SandPlane::getCorrection(const Mat &homography, const Size &outputSize, uint16_t sandLevelInMM, Mat &offsets) const
+{
+	assert(valid());
+
+	const Mat inverse = invertHomography(homography);
+	const double *M = inverse.ptr<double>(0);
+
+	offsets.create(outputSize, CV_16SC1);
+
+	for (int row = 0; row < outputSize.height; ++row)
+	{
+		int16_t *offset = offsets.ptr<int16_t>(row);
+		for (int col = 0; col < outputSize.width; ++col)
+		{
+			Point2d sensor;
+			const double depth = toSensor(M, col, row, sensor) ? depthAt(sensor.x, sensor.y) : 0.;
+
+			offset[col] = depth > 0. ? saturate_cast<int16_t>(sandLevelInMM - depth) : 0;
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef SAND_PLANE_H
+#define SAND_PLANE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+
+/**
+ * @brief Level sand surface fitted to a depth map, corrects a tilted sensor.
+ * For a pinhole camera the inverse depth of a plane is linear in pixel coordinates,
+ * so the plane is kept as 1/depth = a * x + b * y + c over sensor pixels. This needs
+ * no sensor intrinsics.
+ */
+class SandPlane {
+public:
+	SandPlane();
+
+	/**
+	 * @param coefficients 1x3 CV_64F (a, b, c) as returned by coefficients(), empty for no plane
+	 */
+	explicit SandPlane(const cv::Mat &coefficients);
+
+	/**
+	 * @brief Fits the plane with RANSAC to the depth within the calibrated area.
+	 * Samples a grid over the beamer image mapped into the sensor, so walls and floor
+	 * around the box are ignored. Hands in the picture end up as outliers.
+	 * @param depthInMM Raw depth map (CV_16UC1) of level sand
+	 * @param homography Sensor to beamer homography
+	 * @param outputSize Beamer resolution
+	 * @return True if most samples lie on a common plane
+	 */
+	bool fit(const cv::Mat &depthInMM, const cv::Mat &homography, const cv::Size &outputSize);
+
+	bool valid() const { return !m_coefficients.empty(); }
+	const cv::Mat &coefficients() const { return m_coefficients; }
+
+	/**
+	 * @return Depth of the plane in mm at a sensor position
+	 */
+	double depthAt(double x, double y) const;
+
+	/**
+	 * @return Depth of the plane in mm under a beamer pixel
+	 */
+	double depthAtOutput(const cv::Mat &homography, double x, double y) const;
+
+	/**
+	 * @brief Per beamer pixel offsets that move the plane to a constant depth.
+	 * Added to the warped depth every pixel's height is measured from the plane.
+	 * @param homography Sensor to beamer homography
+	 * @param outputSize Beamer resolution
+	 * @param sandLevelInMM Depth the plane is moved to
+	 * @param offsets Receives the offsets in mm (CV_16SC1)
+	 */
+	void getCorrection(const cv::Mat &homography, const cv::Size &outputSize, uint16_t sandLevelInMM, cv::Mat &offsets) const;
+
+private:
+	cv::Mat m_coefficients;
+};
+
+#endif // SAND_PLANE_H
@@ -0,0 +1,531 @@
+#define NOMINMAX
+
+#include "SessionFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+// Size of the part of a session mapped at once
+const uint64_t MAPPED_VIEW_SIZE = 64 * 1024 * 1024;
+
+// Buffer of the session file, frames are written in few large blocks
+const size_t WRITE_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// Delta RLE codes, see SessionFile.h
+const uint8_t RLE_MAX_LITERAL = 0x7F;
+const uint8_t RLE_RUN = 0x80;
+const int RLE_MIN_RUN = 2;
+const int RLE_MAX_RUN = 0xFE - RLE_RUN + RLE_MIN_RUN;
+const uint8_t RLE_ESCAPE = 0xFF;
+
+namespace {
+
+inline uint16_t zigzag(uint16_t delta)
+{
+	return static_cast<uint16_t>((delta << 1) ^ -static_cast<int16_t>(delta >> 15));
+}
+
+inline uint16_t unzigzag(uint16_t code)
+{
+	return static_cast<uint16_t>((code >> 1) ^ -static_cast<int16_t>(code & 1));
+}
+
+/**
+ * @brief Writes a pending run of zero differences.
+ */
+inline uint8_t *flushRun(uint8_t *out, int &run)
+{
+	if (run == 1)
+		*out++ = 0; // Zigzag coded zero
+	else if (run > 1)
+		*out++ = static_cast<uint8_t>(RLE_RUN + run - RLE_MIN_RUN);
+
+	run = 0;
+	return out;
+}
+
+}
+
+size_t encodeDepth(const cv::Mat &depth, std::vector<uint8_t> &encoded)
+{
+	assert(depth.type() == CV_16UC1);
+
+	// Worst case every difference needs an escape. Never shrunk, resizing up again would clear it.
+	if (encoded.size() < depth.total() * 3)
+		encoded.resize(depth.total() * 3);
+
+	uint8_t *out = &encoded[0];
+
+	int run = 0;
+	for (int row = 0; row < depth.rows; ++row)
+	{
+		const uint16_t *value = depth.ptr<uint16_t>(row);
+		uint16_t predicted = (row > 0) ? depth.ptr<uint16_t>(row - 1)[0] : 0;
+
+		for (int col = 0; col < depth.cols; ++col)
+		{
+			const uint16_t delta = static_cast<uint16_t>(value[col] - predicted);
+			predicted = value[col];
+
+			if (delta == 0)
+			{
+				if (++run == RLE_MAX_RUN)
+					out = flushRun(out, run);
+
+				continue;
+			}
+
+			out = flushRun(out, run);
+
+			const uint16_t code = zigzag(delta);
+			if (code <= RLE_MAX_LITERAL)
+			{
+				*out++ = static_cast<uint8_t>(code);
+			}
+			else
+			{
+				*out++ = RLE_ESCAPE;
+				*out++ = static_cast<uint8_t>(delta & 0xFF);
+				*out++ = static_cast<uint8_t>(delta >> 8);
+			}
+		}
+	}
+
+	out = flushRun(out, run);
+
+	return out - &encoded[0];
+}
+
+bool decodeDepth(const uint8_t *data, size_t length, cv::Mat &depth)
+{
+	assert(depth.type() == CV_16UC1);
+
+	const uint8_t *end = data + length;
+
+	int run = 0;
+	for (int row = 0; row < depth.rows; ++row)
+	{
+		uint16_t *value = depth.ptr<uint16_t>(row);
+		uint16_t predicted = (row > 0) ? depth.ptr<uint16_t>(row - 1)[0] : 0;
+
+		for (int col = 0; col < depth.cols; ++col)
+		{
+			if (run == 0)
+			{
+				if (data == end)
+					return false;
+
+				const uint8_t code = *data++;
+				if (code <= RLE_MAX_LITERAL)
+				{
+					predicted = static_cast<uint16_t>(predicted + unzigzag(code));
+				}
+				else if (code != RLE_ESCAPE)
+				{
+					run = code - RLE_RUN + RLE_MIN_RUN - 1;
+				}
+				else
+				{
+					if (end - data < 2)
+						return false;
+
+					predicted = static_cast<uint16_t>(predicted + (data[0] | (data[1] << 8)));
+					data += 2;
+				}
+			}
+			else
+			{
+				--run;
+			}
+
+			value[col] = predicted;
+		}
+	}
+
+	return run == 0 && data == end;
+}
+
+MappedFile::MappedFile()
+#ifdef _WIN32
+	: m_file(INVALID_HANDLE_VALUE)
+	, m_mapping(NULL)
+#else
+	: m_file(-1)
+#endif
+	, m_size(0)
+	, m_granularity(1)
+	, m_view(NULL)
+	, m_viewOffset(0)
+	, m_viewLength(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &file)
+{
+	close();
+
+	m_file = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	m_size = static_cast<uint64_t>(size.QuadPart);
+
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == NULL)
+	{
+		close();
+		return false;
+	}
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	m_granularity = info.dwAllocationGranularity;
+
+	return true;
+}
+
+void MappedFile::unmapView()
+{
+	if (m_view != NULL)
+		UnmapViewOfFile(m_view);
+
+	m_view = NULL;
+	m_viewLength = 0;
+}
+
+void MappedFile::close()
+{
+	unmapView();
+
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+	m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string &file)
+{
+	close();
+
+	m_file = ::open(file.c_str(), O_RDONLY);
+	if (m_file < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(m_file, &st) != 0 || st.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	m_size = static_cast<uint64_t>(st.st_size);
+	m_granularity = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+	return true;
+}
+
+void MappedFile::unmapView()
+{
+	if (m_view != NULL)
+		munmap(m_view, m_viewLength);
+
+	m_view = NULL;
+	m_viewLength = 0;
+}
+
+void MappedFile::close()
+{
+	unmapView();
+
+	if (m_file >= 0)
+		::close(m_file);
+
+	m_file = -1;
+	m_size = 0;
+}
+
+#endif
+
+const uint8_t *MappedFile::map(uint64_t offset, size_t length)
+{
+	if (offset + length > m_size)
+		return NULL;
+
+	if (m_view != NULL && offset >= m_viewOffset && offset + length <= m_viewOffset + m_viewLength)
+	{
+		// Already in view
+		return m_view + (offset - m_viewOffset);
+	}
+
+	unmapView();
+
+	const uint64_t start = offset - (offset % m_granularity);
+	const uint64_t end = std::min(m_size, std::max(offset + length, start + MAPPED_VIEW_SIZE));
+	const size_t viewLength = static_cast<size_t>(end - start);
+
+#ifdef _WIN32
+	void *view = MapViewOfFile(m_mapping, FILE_MAP_READ, static_cast<DWORD>(start >> 32), static_cast<DWORD>(start & 0xFFFFFFFF), viewLength);
+	if (view == NULL)
+		return NULL;
+#else
+	void *view = mmap(NULL, viewLength, PROT_READ, MAP_SHARED, m_file, static_cast<off_t>(start));
+	if (view == MAP_FAILED)
+		return NULL;
+#endif
+
+	m_view = static_cast<uint8_t*>(view);
+	m_viewOffset = start;
+	m_viewLength = viewLength;
+
+	return m_view + (offset - m_viewOffset);
+}
+
+bool SessionReader::open(const std::string &file)
+{
+	m_frames.clear();
+
+	if (!m_file.open(file))
+	{
+		cerr << "Failed to open session " << file << endl;
+		return false;
+	}
+
+	const uint8_t *data = m_file.map(0, sizeof(SessionHeader));
+	if (data == NULL)
+	{
+		cerr << "Session " << file << " is truncated" << endl;
+		return false;
+	}
+
+	memcpy(&m_header, data, sizeof(SessionHeader));
+	if (memcmp(m_header.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC)) != 0 || m_header.version < SESSION_MIN_VERSION || m_header.version > SESSION_VERSION)
+	{
+		cerr << "File " << file << " is not a supported session recording" << endl;
+		return false;
+	}
+
+	// Index frames
+	uint64_t offset = sizeof(SessionHeader);
+	while (offset + sizeof(FrameHeader) <= m_file.size())
+	{
+		FrameHeader frame;
+		data = m_file.map(offset, sizeof(FrameHeader));
+		if (data == NULL)
+			break;
+
+		memcpy(&frame, data, sizeof(FrameHeader));
+
+		const uint64_t next = offset + sizeof(FrameHeader) + frame.depthBytes + frame.bgrBytes;
+		if (next > m_file.size())
+			break; // Incomplete last frame, recording was interrupted
+
+		m_frames.push_back(offset);
+		offset = next;
+	}
+
+	if (m_frames.empty())
+	{
+		cerr << "Session " << file << " contains no frames" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+cv::Size SessionReader::depthSize() const
+{
+	return Size(m_header.depthCols, m_header.depthRows);
+}
+
+cv::Size SessionReader::bgrSize() const
+{
+	return Size(m_header.bgrCols, m_header.bgrRows);
+}
+
+bool SessionReader::readFrame(size_t index, cv::Mat &depth, cv::Mat &bgr, uint64_t &timestampInUs)
+{
+	if (index >= m_frames.size())
+		return false;
+
+	const uint8_t *data = m_file.map(m_frames[index], sizeof(FrameHeader));
+	if (data == NULL)
+		return false;
+
+	FrameHeader frame;
+	memcpy(&frame, data, sizeof(FrameHeader));
+
+	if (frame.encoding != FRAME_ENCODING_RAW && frame.encoding != FRAME_ENCODING_DELTA_RLE)
+		return false;
+
+	data = m_file.map(m_frames[index] + sizeof(FrameHeader), frame.depthBytes + frame.bgrBytes);
+	if (data == NULL)
+		return false;
+
+	depth.create(m_header.depthRows, m_header.depthCols, CV_16UC1);
+
+	if (frame.encoding == FRAME_ENCODING_DELTA_RLE)
+	{
+		if (!decodeDepth(data, frame.depthBytes, depth))
+			return false;
+	}
+	else
+	{
+		const size_t depthSize = m_header.depthCols * m_header.depthRows * sizeof(uint16_t);
+		if (frame.depthBytes != depthSize)
+			return false;
+
+		memcpy(depth.data, data, depthSize);
+	}
+
+	if (frame.bgrBytes > 0)
+	{
+		const size_t bgrSize = m_header.bgrCols * m_header.bgrRows * 3;
+		if (frame.bgrBytes != bgrSize)
+			return false;
+
+		bgr.create(m_header.bgrRows, m_header.bgrCols, CV_8UC3);
+		memcpy(bgr.data, data + frame.depthBytes, bgrSize);
+	}
+	else
+	{
+		bgr = Mat();
+	}
+
+	timestampInUs = frame.timestampInUs;
+	return true;
+}
+
+SessionWriter::SessionWriter()
+	: m_file(NULL)
+	, m_headerWritten(false)
+{
+}
+
+SessionWriter::~SessionWriter()
+{
+	close();
+}
+
+bool SessionWriter::open(const std::string &file)
+{
+	close();
+
+	m_file = fopen(file.c_str(), "wb");
+	if (m_file == NULL)
+		return false;
+
+	setvbuf(m_file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+	m_headerWritten = false;
+	return true;
+}
+
+void SessionWriter::close()
+{
+	if (m_file != NULL)
+		fclose(m_file);
+
+	m_file = NULL;
+}
+
+bool SessionWriter::writeRows(const cv::Mat &mat)
+{
+	const size_t rowBytes = mat.cols * mat.elemSize();
+	for (int row = 0; row < mat.rows; ++row)
+	{
+		if (fwrite(mat.ptr(row), 1, rowBytes, m_file) != rowBytes)
+			return false;
+	}
+
+	return true;
+}
+
+bool SessionWriter::writeFrame(const cv::Mat &depth, const cv::Mat &bgr, uint64_t timestampInUs)
+{
+	assert(depth.type() == CV_16UC1);
+	assert(bgr.data == NULL || bgr.type() == CV_8UC3);
+
+	if (m_file == NULL)
+		return false;
+
+	if (!m_headerWritten)
+	{
+		memset(&m_header, 0, sizeof(SessionHeader));
+		memcpy(m_header.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+		m_header.version = SESSION_VERSION;
+		m_header.depthCols = depth.cols;
+		m_header.depthRows = depth.rows;
+		m_header.bgrCols = bgr.cols;
+		m_header.bgrRows = bgr.rows;
+
+		if (fwrite(&m_header, sizeof(SessionHeader), 1, m_file) != 1)
+			return false;
+
+		m_headerWritten = true;
+	}
+
+	if (static_cast<uint32_t>(depth.cols) != m_header.depthCols || static_cast<uint32_t>(depth.rows) != m_header.depthRows)
+		return false;
+
+	const bool withBgr = (bgr.data != NULL && static_cast<uint32_t>(bgr.cols) == m_header.bgrCols && static_cast<uint32_t>(bgr.rows) == m_header.bgrRows);
+
+	const size_t encodedBytes = encodeDepth(depth, m_encoded);
+
+	// Noise can make the coded frame larger, those frames are stored raw
+	const size_t rawBytes = depth.total() * depth.elemSize();
+	const bool coded = (encodedBytes < rawBytes);
+
+	FrameHeader frame;
+	memset(&frame, 0, sizeof(FrameHeader));
+	frame.timestampInUs = timestampInUs;
+	frame.encoding = coded ? FRAME_ENCODING_DELTA_RLE : FRAME_ENCODING_RAW;
+	frame.depthBytes = static_cast<uint32_t>(coded ? encodedBytes : rawBytes);
+	frame.bgrBytes = withBgr ? static_cast<uint32_t>(bgr.total() * bgr.elemSize()) : 0;
+
+	if (fwrite(&frame, sizeof(FrameHeader), 1, m_file) != 1)
+		return false;
+
+	if (coded)
+	{
+		if (fwrite(&m_encoded[0], 1, encodedBytes, m_file) != encodedBytes)
+			return false;
+	}
+	else if (!writeRows(depth))
+	{
+		return false;
+	}
+
+	if (withBgr && !writeRows(bgr))
+		return false;
+
+	return true;
+}
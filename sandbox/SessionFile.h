@@ -0,0 +1,185 @@
+#ifndef SESSION_FILE_H
+#define SESSION_FILE_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//
+// Recorded session layout (little endian, all structures naturally aligned):
+//
+//   SessionHeader
+//   { FrameHeader, depth payload (depthBytes), bgr payload (bgrBytes) } *
+//
+// Depth payload holds CV_16UC1 rows in mm encoded as given by the frame's
+// encoding, bgr payload raw CV_8UC3 rows. A frame without bgr image has
+// bgrBytes == 0.
+//
+// FRAME_ENCODING_DELTA_RLE stores every depth value as the difference to its
+// left neighbour (to the one above for the first column, to 0 for the very first
+// value), scanned row by row. Frames stay independent so sessions can be seeked.
+// The differences are coded bytewise:
+//
+//   0x00 - 0x7F  One difference, zigzag coded (0, -1, 1, -2, ...)
+//   0x80 - 0xFE  Run of (byte - 0x80 + 2) zero differences, flat sand and dropouts
+//   0xFF         Followed by the difference as 16 bit little endian
+//
+// Version 2 added FRAME_ENCODING_DELTA_RLE, version 1 sessions only hold raw
+// frames and are still read.
+//
+
+const char SESSION_MAGIC[8] = { 'S', 'B', 'X', 'S', 'E', 'S', 'S', '\0' };
+const uint32_t SESSION_VERSION = 2;
+const uint32_t SESSION_MIN_VERSION = 1;
+
+enum FrameEncoding {
+	FRAME_ENCODING_RAW = 0,
+	FRAME_ENCODING_DELTA_RLE = 1
+};
+
+struct SessionHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t depthCols;
+	uint32_t depthRows;
+	uint32_t bgrCols;
+	uint32_t bgrRows;
+	uint32_t reserved;
+};
+
+struct FrameHeader {
+	uint64_t timestampInUs;
+	uint32_t encoding;
+	uint32_t depthBytes;
+	uint32_t bgrBytes;
+	uint32_t reserved;
+};
+
+/**
+ * @brief Encodes a depth map as FRAME_ENCODING_DELTA_RLE.
+ * @param depth CV_16UC1 depth map
+ * @param encoded Receives the encoded bytes at its start. Only grows, so
+ *        reusing it for frames of the same size doesn't touch the allocation.
+ * @return Number of encoded bytes
+ */
+size_t encodeDepth(const cv::Mat &depth, std::vector<uint8_t> &encoded);
+
+/**
+ * @brief Decodes a FRAME_ENCODING_DELTA_RLE depth map.
+ * @param depth CV_16UC1 destination, already of the encoded size
+ * @return False if the data doesn't decode to exactly one depth map
+ */
+bool decodeDepth(const uint8_t *data, size_t length, cv::Mat &depth);
+
+/**
+ * @brief Read only memory mapping of a file through a sliding view.
+ * Sessions easily exceed the address space of a 32bit process so only
+ * a window of the file is mapped at any time.
+ */
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string &file);
+	void close();
+
+	uint64_t size() const { return m_size; }
+
+	/**
+	 * @brief Maps the given range of the file.
+	 * @return Pointer to the first byte of the range. Stays valid until the next call. NULL on failure.
+	 */
+	const uint8_t *map(uint64_t offset, size_t length);
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	void unmapView();
+
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_file;
+#endif
+	uint64_t m_size;
+	uint64_t m_granularity;
+
+	uint8_t *m_view;
+	uint64_t m_viewOffset;
+	size_t m_viewLength;
+};
+
+/**
+ * @brief Reads frames from a recorded session.
+ */
+class SessionReader {
+public:
+	bool open(const std::string &file);
+
+	size_t frameCount() const { return m_frames.size(); }
+	cv::Size depthSize() const;
+	cv::Size bgrSize() const;
+
+	/**
+	 * @brief Decodes the given frame.
+	 * @param index Frame number
+	 * @param depth Destination for the CV_16UC1 depth map
+	 * @param bgr Destination for the CV_8UC3 image. Empty if the frame has none.
+	 * @param timestampInUs Capture time of the frame
+	 * @return True if successfull
+	 */
+	bool readFrame(size_t index, cv::Mat &depth, cv::Mat &bgr, uint64_t &timestampInUs);
+
+private:
+	MappedFile m_file;
+	SessionHeader m_header;
+	std::vector<uint64_t> m_frames; // File offsets of the frame headers
+};
+
+/**
+ * @brief Writes frames to a session file.
+ * The session header is written with the first frame as it defines the frame sizes.
+ * Depth is stored as FRAME_ENCODING_DELTA_RLE, or raw where that would be larger.
+ */
+class SessionWriter {
+public:
+	SessionWriter();
+	~SessionWriter();
+
+	bool open(const std::string &file);
+	void close();
+
+	bool isOpen() const { return m_file != NULL; }
+
+	/**
+	 * @brief Appends a frame to the session.
+	 * @param depth CV_16UC1 depth map
+	 * @param bgr CV_8UC3 image, may be empty
+	 * @param timestampInUs Capture time of the frame
+	 * @return True if successfull
+	 */
+	bool writeFrame(const cv::Mat &depth, const cv::Mat &bgr, uint64_t timestampInUs);
+
+private:
+	SessionWriter(const SessionWriter&);
+	SessionWriter& operator=(const SessionWriter&);
+
+	bool writeRows(const cv::Mat &mat);
+
+	FILE *m_file;
+	bool m_headerWritten;
+	SessionHeader m_header;
+	std::vector<uint8_t> m_encoded; // Coded depth, keeps its size between frames
+};
+
+#endif // SESSION_FILE_H
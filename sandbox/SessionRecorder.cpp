@@ -0,0 +1,101 @@
+#include "SessionRecorder.h"
+
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+// Time the writer waits for frames before checking whether recording stopped
+const unsigned int WRITER_WAIT_IN_MS = 100;
+
+SessionRecorder::SessionRecorder(size_t queueSize)
+	: m_queue(queueSize, QUEUE_BLOCK)
+	, m_recording(false)
+	, m_written(0)
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+	stop();
+}
+
+bool SessionRecorder::start(const std::string &file)
+{
+	assert(!m_recording);
+
+	if (!m_writer.open(file))
+		return false;
+
+	if (!m_thread.start(writerThread, this))
+	{
+		m_writer.close();
+		return false;
+	}
+
+	m_recording = true;
+	return true;
+}
+
+void SessionRecorder::stop()
+{
+	if (!m_recording)
+		return;
+
+	// The writer drains the queue before it exits
+	m_queue.close();
+	m_thread.join();
+	m_recording = false;
+
+	cout << "Recorded " << written() << " frames" << endl;
+}
+
+bool SessionRecorder::record(const cv::Mat &depth, const cv::Mat &bgr, uint64_t timestampInUs)
+{
+	if (!isRecording())
+		return false;
+
+	// Buffers of written frames come back through the queue, so this doesn't allocate after warm up
+	depth.copyTo(m_next.depth);
+	if (bgr.data != NULL)
+		bgr.copyTo(m_next.bgr);
+	else
+		m_next.bgr = Mat();
+
+	m_next.timestampInUs = timestampInUs;
+
+	return m_queue.push(m_next);
+}
+
+void SessionRecorder::writerThread(void *arg)
+{
+	static_cast<SessionRecorder*>(arg)->write();
+}
+
+void SessionRecorder::write()
+{
+	RecordedFrame frame;
+	for (;;)
+	{
+		if (!m_queue.pop(frame, WRITER_WAIT_IN_MS))
+		{
+			if (!m_queue.isClosed())
+				continue;
+
+			// Frames queued right before stopping are still written
+			if (!m_queue.pop(frame, 0))
+				break;
+		}
+
+		if (!m_writer.writeFrame(frame.depth, frame.bgr, frame.timestampInUs))
+		{
+			cerr << "Failed to record frame, recording stopped" << endl;
+			m_queue.close();
+			break;
+		}
+
+		atomicIncrement(&m_written);
+	}
+
+	m_writer.close();
+}
@@ -0,0 +1,80 @@
+#ifndef SESSION_RECORDER_H
+#define SESSION_RECORDER_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <string>
+
+#include "FrameQueue.h"
+#include "SessionFile.h"
+#include "Threading.h"
+
+/**
+ * @brief Records a session on a writer thread.
+ * The capture thread only copies the frames into a bounded queue, encoding and
+ * writing happen on the writer thread. The queue blocks instead of dropping so
+ * the recording is complete; it only waits if the disk falls behind for longer
+ * than the queue covers.
+ */
+class SessionRecorder {
+public:
+	/**
+	 * @param queueSize Number of frames buffered for the writer
+	 */
+	explicit SessionRecorder(size_t queueSize);
+	~SessionRecorder();
+
+	/**
+	 * @brief Opens the session file and starts the writer thread.
+	 */
+	bool start(const std::string &file);
+
+	/**
+	 * @brief Writes the frames still queued and closes the session.
+	 */
+	void stop();
+
+	/**
+	 * @return False once the recording stopped, e.g. after a write failed
+	 */
+	bool isRecording() const { return m_recording && !m_queue.isClosed(); }
+
+	/**
+	 * @brief Queues a copy of a frame. Call from one thread only.
+	 * @param depth CV_16UC1 depth map
+	 * @param bgr CV_8UC3 image, may be empty
+	 * @param timestampInUs Capture time of the frame
+	 * @return False if the recording stopped
+	 */
+	bool record(const cv::Mat &depth, const cv::Mat &bgr, uint64_t timestampInUs);
+
+	/**
+	 * @return Number of frames written so far
+	 */
+	long written() const { return atomicLoad(&m_written); }
+
+private:
+	SessionRecorder(const SessionRecorder&);
+	SessionRecorder& operator=(const SessionRecorder&);
+
+	struct RecordedFrame {
+		RecordedFrame() : timestampInUs(0) {}
+
+		cv::Mat depth;
+		cv::Mat bgr;
+		uint64_t timestampInUs;
+	};
+
+	static void writerThread(void *arg);
+	void write();
+
+	SessionWriter m_writer;
+	FrameQueue<RecordedFrame> m_queue;
+	RecordedFrame m_next;           // Filled by record, swapped with a written frame's buffers
+	Thread m_thread;
+	bool m_recording;
+	volatile long m_written;
+};
+
+#endif // SESSION_RECORDER_H
@@ -12,6 +12,8 @@ enum CalibrationModes {
 	MANUAL,
 	AUTO_HOUGH,
 	AUTO_HARRIS,
+	FULL_FRAME,
+	AUTO_HOUGH_FAST,
 	CALIBRATION_MODE_MAX
 };
 //
@@ -26,19 +28,65 @@ extern struct Settings {
 	int sandPlaneDistanceInMM;
 	std::string colorFile;
 
+	// Frame source settings
+	std::string frameSource;
+	bool realtime;
+	std::string recordFile;
+	size_t recordQueueSize;
+
 	std::string treasureFile;
 	std::string treasureSound;
+	size_t treasureCount;
 
 	CalibrationModes calibrationMode;
+	// Consecutive frames a circle has to be found at the same position in by the fast hough calibration
+	size_t calibrationStableFrames;
+	// Calibration reused between runs while the depth still matches, empty to always calibrate
+	std::string calibrationFile;
+	int calibrationToleranceInMM;
+	// Calibrate even though the calibration file matches, the result replaces it
+	bool recalibrate;
+
+	// Measure heights from a plane fitted to the sand instead of a constant depth
+	bool planeCorrection;
 
 	// Averaging filter settings
 	size_t averagingDepth;
 	size_t averagingStepsize;
+	bool averagingIncremental;
 
 	// Median filter settings
 	size_t medianDepth;
 	size_t medianStepsize;
 
+	// Fill sensor dropouts from valid neighbours after filtering
+	bool holeFilling;
+
+	// Number of threads for row parallel kernels, 0 for one per core
+	size_t threads;
+
+	// Warp and colorize in a single tiled pass
+	bool fusedRendering;
+
+	// Frames a color profile switch fades over, 0 to switch instantly
+	size_t colorFadeFrames;
+
+	// Depth change in mm for a tile to be rendered again, -1 to render every frame fully
+	int dirtyThresholdInMM;
+
+	// Capture, processing and display on separate threads
+	bool pipeline;
+	size_t queueSize;
+	bool queueDropOldest;
+
+	// Suspend processing while nothing moves, threshold -1 to always process
+	int idleThresholdInMM;
+	double idleDelayInSeconds;
+
+	// Per stage frame time histograms
+	bool stageTiming;
+	std::string stageTimingFile;
+
 	// Derived from settings
 	RECT monitorRect;
 
@@ -0,0 +1,123 @@
+#ifndef SORTING_NETWORKS_H
+#define SORTING_NETWORKS_H
+
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define SORTING_NETWORKS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#define SORTING_NETWORKS_AVX2
+#include <immintrin.h>
+#endif
+
+//
+// Branchless median selection networks for small odd sample counts.
+//
+// Each sort2(a, b) leaves the smaller value in a and the larger one in b. After
+// running a network element N/2 holds the same value std::sort would put there.
+// The networks are Batcher's odd-even merge sort reduced to the comparators the
+// middle element depends on and were verified exhaustively with the 0-1 principle.
+//
+// The same network runs on scalars or whole SIMD registers, each lane being an
+// independent pixel.
+//
+
+inline void sort2(uint16_t &a, uint16_t &b)
+{
+	const uint16_t lo = std::min(a, b);
+	b = std::max(a, b);
+	a = lo;
+}
+
+#ifdef SORTING_NETWORKS_SSE2
+// SSE2 lacks unsigned 16bit min/max. Values have to be biased by 0x8000
+// (see biasEpu16) so the signed comparison orders them correctly.
+inline void sort2(__m128i &a, __m128i &b)
+{
+	const __m128i lo = _mm_min_epi16(a, b);
+	b = _mm_max_epi16(a, b);
+	a = lo;
+}
+
+inline __m128i biasEpu16(const __m128i &v)
+{
+	return _mm_xor_si128(v, _mm_set1_epi16(static_cast<short>(0x8000)));
+}
+#endif
+
+#ifdef SORTING_NETWORKS_AVX2
+inline void sort2(__m256i &a, __m256i &b)
+{
+	const __m256i lo = _mm256_min_epu16(a, b);
+	b = _mm256_max_epu16(a, b);
+	a = lo;
+}
+#endif
+
+template <int N> struct MedianNetwork;
+
+template <> struct MedianNetwork<3> {
+	template <typename V> static V select(V *v)
+	{
+		sort2(v[0], v[1]); sort2(v[0], v[2]); sort2(v[1], v[2]);
+		return v[1];
+	}
+};
+
+template <> struct MedianNetwork<5> {
+	template <typename V> static V select(V *v)
+	{
+		sort2(v[0], v[1]); sort2(v[2], v[3]); sort2(v[0], v[2]); sort2(v[1], v[3]);
+		sort2(v[1], v[2]); sort2(v[2], v[4]); sort2(v[1], v[2]);
+		return v[2];
+	}
+};
+
+template <> struct MedianNetwork<7> {
+	template <typename V> static V select(V *v)
+	{
+		sort2(v[0], v[5]); sort2(v[0], v[3]); sort2(v[1], v[6]); sort2(v[2], v[4]);
+		sort2(v[0], v[1]); sort2(v[3], v[5]); sort2(v[2], v[6]); sort2(v[2], v[3]);
+		sort2(v[3], v[6]); sort2(v[4], v[5]); sort2(v[1], v[4]); sort2(v[1], v[3]);
+		sort2(v[3], v[4]);
+		return v[3];
+	}
+};
+
+template <> struct MedianNetwork<9> {
+	template <typename V> static V select(V *v)
+	{
+		sort2(v[0], v[1]); sort2(v[2], v[3]); sort2(v[0], v[2]); sort2(v[1], v[3]);
+		sort2(v[1], v[2]); sort2(v[4], v[5]); sort2(v[6], v[7]); sort2(v[4], v[6]);
+		sort2(v[5], v[7]); sort2(v[5], v[6]); sort2(v[0], v[4]); sort2(v[2], v[6]);
+		sort2(v[2], v[4]); sort2(v[1], v[5]); sort2(v[3], v[7]); sort2(v[3], v[5]);
+		sort2(v[3], v[4]); sort2(v[4], v[8]); sort2(v[3], v[4]);
+		return v[4];
+	}
+};
+
+template <> struct MedianNetwork<15> {
+	template <typename V> static V select(V *v)
+	{
+		sort2(v[0], v[1]); sort2(v[2], v[3]); sort2(v[0], v[2]); sort2(v[1], v[3]);
+		sort2(v[1], v[2]); sort2(v[4], v[5]); sort2(v[6], v[7]); sort2(v[4], v[6]);
+		sort2(v[5], v[7]); sort2(v[5], v[6]); sort2(v[0], v[4]); sort2(v[2], v[6]);
+		sort2(v[2], v[4]); sort2(v[1], v[5]); sort2(v[3], v[7]); sort2(v[3], v[5]);
+		sort2(v[1], v[2]); sort2(v[3], v[4]); sort2(v[5], v[6]); sort2(v[8], v[9]);
+		sort2(v[10], v[11]); sort2(v[8], v[10]); sort2(v[9], v[11]); sort2(v[9], v[10]);
+		sort2(v[12], v[13]); sort2(v[12], v[14]); sort2(v[13], v[14]); sort2(v[8], v[12]);
+		sort2(v[10], v[14]); sort2(v[10], v[12]); sort2(v[9], v[13]); sort2(v[11], v[13]);
+		sort2(v[9], v[10]); sort2(v[11], v[12]); sort2(v[13], v[14]); sort2(v[0], v[8]);
+		sort2(v[4], v[12]); sort2(v[4], v[8]); sort2(v[2], v[10]); sort2(v[6], v[14]);
+		sort2(v[6], v[10]); sort2(v[6], v[8]); sort2(v[1], v[9]); sort2(v[5], v[13]);
+		sort2(v[5], v[9]); sort2(v[3], v[11]); sort2(v[7], v[11]); sort2(v[7], v[9]);
+		sort2(v[7], v[8]);
+		return v[7];
+	}
+};
+
+#endif // SORTING_NETWORKS_H
\ No newline at end of file
@@ -0,0 +1,194 @@
+#define NOMINMAX
+
+#include "StageTimers.h"
+#include "Threading.h"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace cv;
+using namespace std;
+
+//
+// Log-linear bins over microseconds: values below 2 * SUB_BINS get a bin each,
+// above that every power of two is split into SUB_BINS bins.
+//
+const int SUB_BIN_BITS = 4;
+const int SUB_BINS = 1 << SUB_BIN_BITS;
+const int MAX_BITS = 27; // ~2 minutes
+const int BIN_COUNT = (MAX_BITS - SUB_BIN_BITS + 1) * SUB_BINS;
+
+namespace {
+
+const char *STAGE_NAMES[STAGE_COUNT] = {
+	"grab",
+	"retrieve",
+	"record",
+	"filter",
+	"fill",
+	"warp",
+	"colorize",
+	"render",
+	"treasure",
+	"bgr",
+	"display",
+	"waitkey",
+	"latency"
+};
+
+volatile long g_enabled = 1;
+
+volatile long g_bins[STAGE_COUNT][BIN_COUNT];
+volatile long g_maxInUs[STAGE_COUNT];
+
+int binIndex(long us)
+{
+	if (us < 2 * SUB_BINS)
+		return static_cast<int>(us);
+
+	int msb = 0;
+	while ((us >> (msb + 1)) != 0)
+		++msb;
+
+	const int shift = msb - SUB_BIN_BITS;
+	const int index = (shift + 1) * SUB_BINS + static_cast<int>((us >> shift) - SUB_BINS);
+	return std::min(index, BIN_COUNT - 1);
+}
+
+/**
+ * @return Middle of the values falling into the bin in us
+ */
+double binValue(int index)
+{
+	if (index < 2 * SUB_BINS)
+		return index;
+
+	const int shift = index / SUB_BINS - 1;
+	const long lower = static_cast<long>(index % SUB_BINS + SUB_BINS) << shift;
+	return lower + ((1L << shift) - 1) / 2.;
+}
+
+double percentile(const std::vector<long> &bins, long count, double fraction)
+{
+	const long rank = std::max(1L, static_cast<long>(ceil(count * fraction)));
+
+	long seen = 0;
+	for (size_t i = 0; i < bins.size(); ++i)
+	{
+		seen += bins[i];
+		if (seen >= rank)
+			return binValue(static_cast<int>(i)) / 1000.;
+	}
+
+	return 0.;
+}
+
+}
+
+const char *getStageName(TimedStage stage)
+{
+	return STAGE_NAMES[stage];
+}
+
+void setStageTimingEnabled(bool enabled)
+{
+	atomicStore(&g_enabled, enabled ? 1 : 0);
+}
+
+bool isStageTimingEnabled()
+{
+	return g_enabled != 0;
+}
+
+void addStageTime(TimedStage stage, int64 ticks)
+{
+	const long us = static_cast<long>(std::max<int64>(0, ticks) * 1000000 / static_cast<int64>(cv::getTickFrequency()));
+
+	atomicIncrement(&g_bins[stage][binIndex(us)]);
+
+	long max = atomicLoad(&g_maxInUs[stage]);
+	while (us > max)
+	{
+		const long previous = atomicCompareExchange(&g_maxInUs[stage], us, max);
+		if (previous == max)
+			break;
+
+		max = previous;
+	}
+}
+
+void takeStageSnapshot(StageSnapshot &snapshot)
+{
+	for (int stage = 0; stage < STAGE_COUNT; ++stage)
+	{
+		snapshot.bins[stage].resize(BIN_COUNT);
+		for (int i = 0; i < BIN_COUNT; ++i)
+		{
+			snapshot.bins[stage][i] = atomicLoad(&g_bins[stage][i]);
+		}
+	}
+}
+
+StageStatistics getStageStatistics(TimedStage stage, const StageSnapshot &now, const StageSnapshot *before)
+{
+	std::vector<long> bins(now.bins[stage]);
+	if (before != NULL && before->bins[stage].size() == bins.size())
+	{
+		for (size_t i = 0; i < bins.size(); ++i)
+			bins[i] -= before->bins[stage][i];
+	}
+
+	StageStatistics statistics;
+	statistics.count = 0;
+	for (size_t i = 0; i < bins.size(); ++i)
+		statistics.count += bins[i];
+
+	if (statistics.count == 0)
+	{
+		statistics.p50InMs = statistics.p95InMs = statistics.p99InMs = statistics.maxInMs = 0.;
+		return statistics;
+	}
+
+	statistics.p50InMs = percentile(bins, statistics.count, 0.50);
+	statistics.p95InMs = percentile(bins, statistics.count, 0.95);
+	statistics.p99InMs = percentile(bins, statistics.count, 0.99);
+
+	if (before == NULL)
+	{
+		// Exact over the whole run, bin middles may lie above it
+		statistics.maxInMs = atomicLoad(&g_maxInUs[stage]) / 1000.;
+		statistics.p50InMs = std::min(statistics.p50InMs, statistics.maxInMs);
+		statistics.p95InMs = std::min(statistics.p95InMs, statistics.maxInMs);
+		statistics.p99InMs = std::min(statistics.p99InMs, statistics.maxInMs);
+	}
+	else
+	{
+		statistics.maxInMs = percentile(bins, statistics.count, 1.);
+	}
+
+	return statistics;
+}
+
+bool writeStageStatistics(const std::string &file)
+{
+	ofstream out(file.c_str());
+	if (!out)
+		return false;
+
+	StageSnapshot now;
+	takeStageSnapshot(now);
+
+	out << "stage,count,p50_ms,p95_ms,p99_ms,max_ms" << endl;
+	for (int stage = 0; stage < STAGE_COUNT; ++stage)
+	{
+		const StageStatistics statistics = getStageStatistics(static_cast<TimedStage>(stage), now);
+		out << STAGE_NAMES[stage] << ","
+			<< statistics.count << ","
+			<< statistics.p50InMs << ","
+			<< statistics.p95InMs << ","
+			<< statistics.p99InMs << ","
+			<< statistics.maxInMs << endl;
+	}
+
+	return out.good();
+}
@@ -0,0 +1,94 @@
+#ifndef STAGE_TIMERS_H
+#define STAGE_TIMERS_H
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+#include <vector>
+
+//
+// Per stage frame time histograms. Recording is lock-free (one atomic increment
+// per sample) so stages on different threads can be timed while the display
+// thread reads the statistics.
+//
+
+enum TimedStage {
+	STAGE_GRAB,
+	STAGE_RETRIEVE,
+	STAGE_RECORD,
+	STAGE_FILTER,
+	STAGE_FILL,     // Hole filling
+	STAGE_WARP,
+	STAGE_COLORIZE,
+	STAGE_RENDER,   // Fused warp and colorize
+	STAGE_TREASURE,
+	STAGE_BGR,      // Warping the BGR view
+	STAGE_DISPLAY,  // imshow
+	STAGE_WAITKEY,
+	STAGE_LATENCY,  // Grab to display
+	STAGE_COUNT
+};
+
+const char *getStageName(TimedStage stage);
+
+void setStageTimingEnabled(bool enabled);
+bool isStageTimingEnabled();
+
+/**
+ * @brief Adds a sample to the histogram of a stage.
+ * @param ticks Duration in cv::getTickCount ticks
+ */
+void addStageTime(TimedStage stage, int64 ticks);
+
+/**
+ * @brief Times the enclosing scope as the given stage. Does nothing if timing is disabled.
+ */
+class ScopedStageTimer {
+public:
+	ScopedStageTimer(TimedStage stage)
+		: m_stage(stage)
+		, m_start(isStageTimingEnabled() ? cv::getTickCount() : 0) {}
+
+	~ScopedStageTimer()
+	{
+		if (m_start != 0)
+			addStageTime(m_stage, cv::getTickCount() - m_start);
+	}
+
+private:
+	const TimedStage m_stage;
+	const int64 m_start;
+};
+
+/**
+ * @brief Copy of the bin counts of all stages at one point in time.
+ * Statistics over an interval are taken from the difference of two snapshots.
+ */
+struct StageSnapshot {
+	std::vector<long> bins[STAGE_COUNT];
+};
+
+void takeStageSnapshot(StageSnapshot &snapshot);
+
+struct StageStatistics {
+	long count;
+	double p50InMs;
+	double p95InMs;
+	double p99InMs;
+	double maxInMs;
+};
+
+/**
+ * @brief Percentiles of a stage, accurate to the bin width (about 3%).
+ * @param now Current snapshot
+ * @param before Earlier snapshot to only cover the time since, NULL for everything
+ */
+StageStatistics getStageStatistics(TimedStage stage, const StageSnapshot &now, const StageSnapshot *before = NULL);
+
+/**
+ * @brief Writes count and percentiles of every stage since startup as CSV.
+ * @return True if successfull
+ */
+bool writeStageStatistics(const std::string &file);
+
+#endif // STAGE_TIMERS_H
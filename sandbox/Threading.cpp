@@ -0,0 +1,304 @@
+#include "Threading.h"
+
+#ifdef _WIN32
+#include <process.h>
+#include <climits>
+#else
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	struct ThreadStart {
+		ThreadFunction function;
+		void *arg;
+	};
+}
+
+#ifdef _WIN32
+
+static unsigned __stdcall threadProc(void *param)
+{
+	ThreadStart start = *static_cast<ThreadStart*>(param);
+	delete static_cast<ThreadStart*>(param);
+
+	start.function(start.arg);
+	return 0;
+}
+
+Thread::Thread()
+	: m_handle(NULL)
+	, m_running(false)
+{
+}
+
+bool Thread::start(ThreadFunction function, void *arg)
+{
+	if (m_running)
+		return false;
+
+	ThreadStart *start = new ThreadStart;
+	start->function = function;
+	start->arg = arg;
+
+	m_handle = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, threadProc, start, 0, NULL));
+	if (m_handle == NULL)
+	{
+		delete start;
+		return false;
+	}
+
+	m_running = true;
+	return true;
+}
+
+void Thread::join()
+{
+	if (!m_running)
+		return;
+
+	WaitForSingleObject(m_handle, INFINITE);
+	CloseHandle(m_handle);
+
+	m_handle = NULL;
+	m_running = false;
+}
+
+Semaphore::Semaphore(long initial)
+	: m_handle(CreateSemaphore(NULL, initial, LONG_MAX, NULL))
+{
+}
+
+Semaphore::~Semaphore()
+{
+	CloseHandle(m_handle);
+}
+
+void Semaphore::post(long count)
+{
+	ReleaseSemaphore(m_handle, count, NULL);
+}
+
+void Semaphore::wait()
+{
+	WaitForSingleObject(m_handle, INFINITE);
+}
+
+bool Semaphore::wait(unsigned int timeoutInMs)
+{
+	return WaitForSingleObject(m_handle, timeoutInMs) == WAIT_OBJECT_0;
+}
+
+Mutex::Mutex()
+{
+	InitializeCriticalSection(&m_section);
+}
+
+Mutex::~Mutex()
+{
+	DeleteCriticalSection(&m_section);
+}
+
+void Mutex::lock()
+{
+	EnterCriticalSection(&m_section);
+}
+
+void Mutex::unlock()
+{
+	LeaveCriticalSection(&m_section);
+}
+
+long atomicIncrement(volatile long *value)
+{
+	return InterlockedIncrement(value);
+}
+
+long atomicDecrement(volatile long *value)
+{
+	return InterlockedDecrement(value);
+}
+
+long atomicAdd(volatile long *value, long delta)
+{
+	return InterlockedExchangeAdd(value, delta) + delta;
+}
+
+long atomicCompareExchange(volatile long *value, long newValue, long expected)
+{
+	return InterlockedCompareExchange(value, newValue, expected);
+}
+
+long atomicLoad(const volatile long *value)
+{
+	return InterlockedCompareExchange(const_cast<volatile long*>(value), 0, 0);
+}
+
+void atomicStore(volatile long *value, long newValue)
+{
+	InterlockedExchange(value, newValue);
+}
+
+size_t getCoreCount()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+void sleepMs(unsigned int timeInMs)
+{
+	Sleep(timeInMs);
+}
+
+#else
+
+static void *threadProc(void *param)
+{
+	ThreadStart start = *static_cast<ThreadStart*>(param);
+	delete static_cast<ThreadStart*>(param);
+
+	start.function(start.arg);
+	return NULL;
+}
+
+Thread::Thread()
+	: m_handle()
+	, m_running(false)
+{
+}
+
+bool Thread::start(ThreadFunction function, void *arg)
+{
+	if (m_running)
+		return false;
+
+	ThreadStart *start = new ThreadStart;
+	start->function = function;
+	start->arg = arg;
+
+	if (pthread_create(&m_handle, NULL, threadProc, start) != 0)
+	{
+		delete start;
+		return false;
+	}
+
+	m_running = true;
+	return true;
+}
+
+void Thread::join()
+{
+	if (!m_running)
+		return;
+
+	pthread_join(m_handle, NULL);
+	m_running = false;
+}
+
+Semaphore::Semaphore(long initial)
+{
+	sem_init(&m_handle, 0, static_cast<unsigned int>(initial));
+}
+
+Semaphore::~Semaphore()
+{
+	sem_destroy(&m_handle);
+}
+
+void Semaphore::post(long count)
+{
+	for (long i = 0; i < count; ++i)
+		sem_post(&m_handle);
+}
+
+void Semaphore::wait()
+{
+	while (sem_wait(&m_handle) != 0 && errno == EINTR) {}
+}
+
+bool Semaphore::wait(unsigned int timeoutInMs)
+{
+	timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeoutInMs / 1000;
+	deadline.tv_nsec += (timeoutInMs % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	int result;
+	while ((result = sem_timedwait(&m_handle, &deadline)) != 0 && errno == EINTR) {}
+	return result == 0;
+}
+
+Mutex::Mutex()
+{
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+Mutex::~Mutex()
+{
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void Mutex::lock()
+{
+	pthread_mutex_lock(&m_mutex);
+}
+
+void Mutex::unlock()
+{
+	pthread_mutex_unlock(&m_mutex);
+}
+
+long atomicIncrement(volatile long *value)
+{
+	return __sync_add_and_fetch(value, 1);
+}
+
+long atomicDecrement(volatile long *value)
+{
+	return __sync_sub_and_fetch(value, 1);
+}
+
+long atomicAdd(volatile long *value, long delta)
+{
+	return __sync_add_and_fetch(value, delta);
+}
+
+long atomicCompareExchange(volatile long *value, long newValue, long expected)
+{
+	return __sync_val_compare_and_swap(value, expected, newValue);
+}
+
+long atomicLoad(const volatile long *value)
+{
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+void atomicStore(volatile long *value, long newValue)
+{
+	__atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+}
+
+size_t getCoreCount()
+{
+	const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? static_cast<size_t>(cores) : 1;
+}
+
+void sleepMs(unsigned int timeInMs)
+{
+	usleep(timeInMs * 1000);
+}
+
+#endif
+
+Thread::~Thread()
+{
+	join();
+}
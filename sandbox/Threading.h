@@ -0,0 +1,113 @@
+#ifndef THREADING_H
+#define THREADING_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+#include <stddef.h>
+
+//
+// Minimal threading primitives. Visual Studio 2010 has no std::thread so
+// these wrap the Win32 API (pthreads elsewhere).
+//
+
+typedef void (*ThreadFunction)(void *arg);
+
+class Thread {
+public:
+	Thread();
+	~Thread();
+
+	bool start(ThreadFunction function, void *arg);
+	void join();
+
+	bool isRunning() const { return m_running; }
+
+private:
+	Thread(const Thread&);
+	Thread& operator=(const Thread&);
+
+#ifdef _WIN32
+	HANDLE m_handle;
+#else
+	pthread_t m_handle;
+#endif
+	bool m_running;
+};
+
+class Semaphore {
+public:
+	Semaphore(long initial = 0);
+	~Semaphore();
+
+	void post(long count = 1);
+	void wait();
+
+	/**
+	 * @return False if the semaphore wasn't signaled within the timeout
+	 */
+	bool wait(unsigned int timeoutInMs);
+
+private:
+	Semaphore(const Semaphore&);
+	Semaphore& operator=(const Semaphore&);
+
+#ifdef _WIN32
+	HANDLE m_handle;
+#else
+	sem_t m_handle;
+#endif
+};
+
+class Mutex {
+public:
+	Mutex();
+	~Mutex();
+
+	void lock();
+	void unlock();
+
+private:
+	Mutex(const Mutex&);
+	Mutex& operator=(const Mutex&);
+
+#ifdef _WIN32
+	CRITICAL_SECTION m_section;
+#else
+	pthread_mutex_t m_mutex;
+#endif
+};
+
+class ScopedLock {
+public:
+	ScopedLock(Mutex &mutex) : m_mutex(mutex) { m_mutex.lock(); }
+	~ScopedLock() { m_mutex.unlock(); }
+
+private:
+	ScopedLock(const ScopedLock&);
+	ScopedLock& operator=(const ScopedLock&);
+
+	Mutex &m_mutex;
+};
+
+// Atomic operations with full barriers, return the new value
+long atomicIncrement(volatile long *value);
+long atomicDecrement(volatile long *value);
+long atomicAdd(volatile long *value, long delta);
+
+// Sets value to newValue if it equals expected, returns the previous value
+long atomicCompareExchange(volatile long *value, long newValue, long expected);
+
+// Loads with acquire and stores with release semantics
+long atomicLoad(const volatile long *value);
+void atomicStore(volatile long *value, long newValue);
+
+size_t getCoreCount();
+
+void sleepMs(unsigned int timeInMs);
+
+#endif // THREADING_H
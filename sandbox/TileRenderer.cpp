@@ -0,0 +1,508 @@
+#define NOMINMAX
+
+#include "TileRenderer.h"
+#include "ParallelRows.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace cv;
+using namespace std;
+
+// Output tile size. A tile's source footprint stays in L1 for any sane homography.
+const int TILE_WIDTH = 64;
+const int TILE_HEIGHT = 16;
+
+// Sensor block size for change detection in incremental rendering
+const int BLOCK_SIZE = 16;
+
+// Sub pixel resolution of source positions, same as warpPerspective and cv::remap
+const int SUBPIXEL_BITS = INTER_BITS;
+const int SUBPIXEL_STEPS = 1 << SUBPIXEL_BITS;
+
+// Bilinear weights in fixed point, the four weights of a sub pixel offset sum up to 1 << WEIGHT_BITS
+const int WEIGHT_BITS = 2 * SUBPIXEL_BITS;
+
+namespace {
+
+/**
+ * @brief Bilinear weights for every sub pixel offset, indexed like the CV_16UC1 remap table.
+ */
+struct BilinearWeights {
+	uint16_t w[SUBPIXEL_STEPS * SUBPIXEL_STEPS][4];
+
+	BilinearWeights()
+	{
+		for (int ay = 0; ay < SUBPIXEL_STEPS; ++ay)
+		{
+			for (int ax = 0; ax < SUBPIXEL_STEPS; ++ax)
+			{
+				uint16_t *weights = w[ay * SUBPIXEL_STEPS + ax];
+				weights[0] = static_cast<uint16_t>((SUBPIXEL_STEPS - ax) * (SUBPIXEL_STEPS - ay));
+				weights[1] = static_cast<uint16_t>(ax * (SUBPIXEL_STEPS - ay));
+				weights[2] = static_cast<uint16_t>((SUBPIXEL_STEPS - ax) * ay);
+				weights[3] = static_cast<uint16_t>(ax * ay);
+			}
+		}
+	}
+};
+
+const BilinearWeights WEIGHTS;
+
+/**
+ * @brief Renders bands of output rows tile by tile.
+ */
+class TileRows : public RowBody {
+public:
+	TileRows(const cv::Mat &positions, const cv::Mat &fractions, const cv::Mat &offsets, const cv::Mat &depth, cv::Mat &output, const ColorTable &colors, cv::Mat *depthWarped, const Compositor *effects)
+		: m_positions(positions)
+		, m_fractions(fractions)
+		, m_offsets(offsets)
+		, m_depth(depth)
+		, m_output(output)
+		, m_colors(colors)
+		, m_depthWarped(depthWarped)
+		, m_effects(effects) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int top = begin; top < end; top += TILE_HEIGHT)
+		{
+			const int bottom = std::min(end, top + TILE_HEIGHT);
+			for (int left = 0; left < m_output.cols; left += TILE_WIDTH)
+			{
+				renderTile(left, std::min(m_output.cols, left + TILE_WIDTH), top, bottom);
+			}
+		}
+	}
+
+	/**
+	 * @brief Renders the output pixels [left, right) x [top, bottom).
+	 */
+	void renderTile(int left, int right, int top, int bottom) const
+	{
+		const int width = right - left;
+		const size_t pixelBytes = m_output.elemSize();
+
+		uint16_t samples[TILE_WIDTH];
+
+		for (int row = top; row < bottom; ++row)
+		{
+			const int16_t *position = m_positions.ptr<int16_t>(row) + left * 2;
+			const uint16_t *fraction = m_fractions.ptr<uint16_t>(row) + left;
+
+			if (m_offsets.empty())
+			{
+				for (int n = 0; n < width; ++n)
+				{
+					samples[n] = sample(position[0], position[1], *fraction);
+					position += 2;
+					++fraction;
+				}
+			}
+			else
+			{
+				// Height above the sand plane, dropouts stay 0
+				const int16_t *offset = m_offsets.ptr<int16_t>(row) + left;
+				for (int n = 0; n < width; ++n)
+				{
+					const int value = sample(position[0], position[1], *fraction);
+					samples[n] = value ? saturate_cast<uint16_t>(value + offset[n]) : 0;
+					position += 2;
+					++fraction;
+				}
+			}
+
+			if (m_depthWarped)
+			{
+				memcpy(m_depthWarped->ptr<uint16_t>(row) + left, samples, width * sizeof(uint16_t));
+			}
+
+			uint8_t *target = m_output.ptr<uint8_t>(row) + left * pixelBytes;
+			m_colors.applyRow(samples, target, width);
+
+			if (m_effects)
+			{
+				m_effects->applyRow(row, left, width, samples, target, pixelBytes);
+			}
+		}
+	}
+
+private:
+	/**
+	 * @brief Bilinear depth sample at an integer source position and sub pixel offset, 0 outside of the depth map.
+	 */
+	inline uint16_t sample(int sx, int sy, uint16_t fraction) const
+	{
+		const int cols = m_depth.cols;
+		const int rows = m_depth.rows;
+
+		uint32_t v00, v01, v10, v11;
+		if (static_cast<unsigned>(sx) < static_cast<unsigned>(cols - 1) && static_cast<unsigned>(sy) < static_cast<unsigned>(rows - 1))
+		{
+			const uint16_t *src = m_depth.ptr<uint16_t>(sy) + sx;
+			const uint16_t *below = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(src) + m_depth.step);
+			v00 = src[0];
+			v01 = src[1];
+			v10 = below[0];
+			v11 = below[1];
+		}
+		else if (sx >= cols || sx + 1 < 0 || sy >= rows || sy + 1 < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			// Border, neighbours outside count as 0
+			const bool left = sx >= 0, right = sx + 1 < cols;
+			const bool top = sy >= 0, bottom = sy + 1 < rows;
+			v00 = (top && left) ? m_depth.at<uint16_t>(sy, sx) : 0;
+			v01 = (top && right) ? m_depth.at<uint16_t>(sy, sx + 1) : 0;
+			v10 = (bottom && left) ? m_depth.at<uint16_t>(sy + 1, sx) : 0;
+			v11 = (bottom && right) ? m_depth.at<uint16_t>(sy + 1, sx + 1) : 0;
+		}
+
+		const uint16_t *w = WEIGHTS.w[fraction];
+		const uint32_t sum = v00 * w[0] + v01 * w[1] + v10 * w[2] + v11 * w[3];
+
+		// Ties round to even like cvRound in OpenCV's bilinear remap
+		return static_cast<uint16_t>((sum + (1 << (WEIGHT_BITS - 1)) - 1 + ((sum >> WEIGHT_BITS) & 1)) >> WEIGHT_BITS);
+	}
+
+	const cv::Mat &m_positions;
+	const cv::Mat &m_fractions;
+	const cv::Mat &m_offsets;
+	const cv::Mat &m_depth;
+	cv::Mat &m_output;
+	const ColorTable &m_colors;
+	cv::Mat *m_depthWarped;
+	const Compositor *m_effects;
+};
+
+/**
+ * @brief Renders the listed output tiles.
+ */
+class ListedTiles : public RowBody {
+public:
+	ListedTiles(const TileRows &tiles, const std::vector<int> &indices, const cv::Size &outputSize)
+		: m_tiles(tiles)
+		, m_indices(indices)
+		, m_outputSize(outputSize)
+		, m_tilesPerRow((outputSize.width + TILE_WIDTH - 1) / TILE_WIDTH) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			const int left = (m_indices[i] % m_tilesPerRow) * TILE_WIDTH;
+			const int top = (m_indices[i] / m_tilesPerRow) * TILE_HEIGHT;
+			m_tiles.renderTile(left, std::min(m_outputSize.width, left + TILE_WIDTH), top, std::min(m_outputSize.height, top + TILE_HEIGHT));
+		}
+	}
+
+private:
+	const TileRows &m_tiles;
+	const std::vector<int> &m_indices;
+	const cv::Size m_outputSize;
+	const int m_tilesPerRow;
+};
+
+/**
+ * @brief Takes over sensor blocks that moved away from the reference depth.
+ * Works on rows of blocks.
+ */
+class BlockUpdate : public RowBody {
+public:
+	BlockUpdate(const cv::Mat &depth, cv::Mat &reference, uint16_t thresholdInMM, std::vector<uint8_t> &changed)
+		: m_depth(depth)
+		, m_reference(reference)
+		, m_threshold(thresholdInMM)
+		, m_changed(changed)
+		, m_blocksPerRow((depth.cols + BLOCK_SIZE - 1) / BLOCK_SIZE) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int blockRow = begin; blockRow < end; ++blockRow)
+		{
+			const int top = blockRow * BLOCK_SIZE;
+			const int bottom = std::min(m_depth.rows, top + BLOCK_SIZE);
+
+			for (int blockCol = 0; blockCol < m_blocksPerRow; ++blockCol)
+			{
+				const int left = blockCol * BLOCK_SIZE;
+				const int right = std::min(m_depth.cols, left + BLOCK_SIZE);
+
+				if (!changed(left, right, top, bottom))
+					continue;
+
+				for (int row = top; row < bottom; ++row)
+				{
+					memcpy(m_reference.ptr<uint16_t>(row) + left, m_depth.ptr<uint16_t>(row) + left, (right - left) * sizeof(uint16_t));
+				}
+
+				m_changed[blockRow * m_blocksPerRow + blockCol] = 1;
+			}
+		}
+	}
+
+private:
+	bool changed(int left, int right, int top, int bottom) const
+	{
+		for (int row = top; row < bottom; ++row)
+		{
+			const uint16_t *depth = m_depth.ptr<uint16_t>(row);
+			const uint16_t *reference = m_reference.ptr<uint16_t>(row);
+
+			// No early exit within a row so it vectorizes
+			int changed = 0;
+			for (int col = left; col < right; ++col)
+			{
+				const int difference = static_cast<int>(depth[col]) - reference[col];
+				changed |= (difference > m_threshold) | (difference < -m_threshold);
+			}
+
+			if (changed)
+				return true;
+		}
+
+		return false;
+	}
+
+	const cv::Mat &m_depth;
+	cv::Mat &m_reference;
+	const int m_threshold;
+	std::vector<uint8_t> &m_changed;
+	const int m_blocksPerRow;
+};
+
+/**
+ * @brief Adds the depth offsets to a warped depth map in place.
+ */
+class OffsetRows : public RowBody {
+public:
+	OffsetRows(const cv::Mat &offsets, cv::Mat &depthWarped)
+		: m_offsets(offsets)
+		, m_depthWarped(depthWarped) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		for (int row = begin; row < end; ++row)
+		{
+			const int16_t *offset = m_offsets.ptr<int16_t>(row);
+			uint16_t *depth = m_depthWarped.ptr<uint16_t>(row);
+
+			for (int col = 0; col < m_depthWarped.cols; ++col)
+			{
+				depth[col] = depth[col] ? saturate_cast<uint16_t>(depth[col] + offset[col]) : 0;
+			}
+		}
+	}
+
+private:
+	const cv::Mat &m_offsets;
+	cv::Mat &m_depthWarped;
+};
+
+}
+
+TileRenderer::TileRenderer(const cv::Mat &homography, const cv::Size &outputSize)
+	: m_outputSize(outputSize)
+	, m_lastOutput(NULL)
+	, m_lastDepthWarped(NULL)
+{
+	setHomography(homography);
+}
+
+void TileRenderer::setHomography(const cv::Mat &homography)
+{
+	assert(homography.rows == 3 && homography.cols == 3);
+
+	// warpPerspective maps every output pixel back with the inverse
+	Mat inverse;
+	homography.convertTo(inverse, CV_64F);
+	inverse = inverse.inv();
+	const double *M = inverse.ptr<double>(0);
+
+	m_positions.create(m_outputSize, CV_16SC2);
+	m_fractions.create(m_outputSize, CV_16UC1);
+
+	for (int row = 0; row < m_outputSize.height; ++row)
+	{
+		const double X0 = M[1] * row + M[2];
+		const double Y0 = M[4] * row + M[5];
+		const double W0 = M[7] * row + M[8];
+
+		int16_t *position = m_positions.ptr<int16_t>(row);
+		uint16_t *fraction = m_fractions.ptr<uint16_t>(row);
+
+		for (int col = 0; col < m_outputSize.width; ++col)
+		{
+			// Fixed point source position, computed like warpPerspective does
+			double W = W0 + M[6] * col;
+			W = W ? SUBPIXEL_STEPS / W : 0.;
+			const double fx = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (X0 + M[0] * col) * W));
+			const double fy = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (Y0 + M[3] * col) * W));
+			const int x = saturate_cast<int>(fx);
+			const int y = saturate_cast<int>(fy);
+
+			position[col * 2] = saturate_cast<int16_t>(x >> SUBPIXEL_BITS);
+			position[col * 2 + 1] = saturate_cast<int16_t>(y >> SUBPIXEL_BITS);
+			fraction[col] = static_cast<uint16_t>((y & (SUBPIXEL_STEPS - 1)) * SUBPIXEL_STEPS + (x & (SUBPIXEL_STEPS - 1)));
+		}
+	}
+
+	// Source pixels every output tile samples, including the bilinear neighbours
+	m_tileSources.clear();
+	for (int top = 0; top < m_outputSize.height; top += TILE_HEIGHT)
+	{
+		for (int left = 0; left < m_outputSize.width; left += TILE_WIDTH)
+		{
+			int minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+			for (int row = top; row < std::min(m_outputSize.height, top + TILE_HEIGHT); ++row)
+			{
+				const int16_t *position = m_positions.ptr<int16_t>(row);
+				for (int col = left; col < std::min(m_outputSize.width, left + TILE_WIDTH); ++col)
+				{
+					minX = std::min<int>(minX, position[col * 2]);
+					maxX = std::max<int>(maxX, position[col * 2]);
+					minY = std::min<int>(minY, position[col * 2 + 1]);
+					maxY = std::max<int>(maxY, position[col * 2 + 1]);
+				}
+			}
+
+			m_tileSources.push_back(Rect(minX, minY, maxX - minX + 2, maxY - minY + 2));
+		}
+	}
+
+	// Next incremental render starts over
+	m_reference.release();
+}
+
+void TileRenderer::setDepthOffsets(const cv::Mat &offsets)
+{
+	assert(offsets.empty() || (offsets.size() == m_outputSize && offsets.type() == CV_16SC1));
+
+	m_offsets = offsets.clone();
+
+	// Next incremental render starts over
+	m_reference.release();
+}
+
+void TileRenderer::offsetDepth(cv::Mat &depthWarped) const
+{
+	assert(depthWarped.size() == m_outputSize && depthWarped.type() == CV_16UC1);
+
+	if (m_offsets.empty())
+		return;
+
+	parallelForRows(m_outputSize.height, m_outputSize.width * (m_offsets.elemSize() + depthWarped.elemSize()), OffsetRows(m_offsets, depthWarped));
+}
+
+void TileRenderer::updateTileBlocks(const cv::Size &depthSize)
+{
+	const int blocksPerRow = (depthSize.width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const int blockRows = (depthSize.height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	m_changedBlocks.assign(blocksPerRow * blockRows, 0);
+
+	m_tileBlocks.resize(m_tileSources.size());
+	for (size_t tile = 0; tile < m_tileSources.size(); ++tile)
+	{
+		// Samples outside the depth map are constant
+		const Rect source = m_tileSources[tile] & Rect(0, 0, depthSize.width, depthSize.height);
+		if (source.area() == 0)
+		{
+			m_tileBlocks[tile] = Rect();
+			continue;
+		}
+
+		const int left = source.x / BLOCK_SIZE;
+		const int top = source.y / BLOCK_SIZE;
+		const int right = (source.x + source.width - 1) / BLOCK_SIZE;
+		const int bottom = (source.y + source.height - 1) / BLOCK_SIZE;
+		m_tileBlocks[tile] = Rect(left, top, right - left + 1, bottom - top + 1);
+	}
+}
+
+void TileRenderer::warp(const cv::Mat &image, cv::Mat &warped) const
+{
+	remap(image, warped, m_positions, m_fractions, INTER_LINEAR, BORDER_CONSTANT);
+}
+
+void TileRenderer::render(const cv::Mat &depth, cv::Mat &output, const ColorTable &colors, cv::Mat *depthWarped, const Compositor *effects)
+{
+	assert(depth.type() == CV_16UC1);
+
+	output.create(m_outputSize, colors.outputType());
+
+	if (depthWarped)
+	{
+		depthWarped->create(m_outputSize, CV_16UC1);
+	}
+
+	// Tables are read alongside the output
+	const size_t rowBytes = m_outputSize.width * (m_positions.elemSize() + m_fractions.elemSize() + m_offsets.elemSize() + output.elemSize() + (depthWarped ? sizeof(uint16_t) : 0));
+	parallelForRows(m_outputSize.height, rowBytes, TileRows(m_positions, m_fractions, m_offsets, depth, output, colors, depthWarped, effects));
+}
+
+double TileRenderer::renderChanged(const cv::Mat &depth, cv::Mat &output, const ColorTable &colors, uint16_t thresholdInMM, cv::Mat *depthWarped, bool force)
+{
+	assert(depth.type() == CV_16UC1);
+
+	output.create(m_outputSize, colors.outputType());
+
+	if (depthWarped)
+	{
+		depthWarped->create(m_outputSize, CV_16UC1);
+	}
+
+	const uint8_t *depthWarpedData = depthWarped ? depthWarped->data : NULL;
+
+	if (force || m_reference.size() != depth.size() || output.data != m_lastOutput || depthWarpedData != m_lastDepthWarped)
+	{
+		// Buffers don't hold a rendering of the reference, start over
+		depth.copyTo(m_reference);
+		updateTileBlocks(depth.size());
+
+		m_lastOutput = output.data;
+		m_lastDepthWarped = depthWarpedData;
+
+		render(m_reference, output, colors, depthWarped);
+		return 1.;
+	}
+
+	std::fill(m_changedBlocks.begin(), m_changedBlocks.end(), 0);
+
+	const int blocksPerRow = (depth.cols + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const int blockRows = (depth.rows + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	parallelForRows(blockRows, depth.cols * BLOCK_SIZE * 2 * sizeof(uint16_t), BlockUpdate(depth, m_reference, thresholdInMM, m_changedBlocks));
+
+	m_dirtyTiles.clear();
+	for (size_t tile = 0; tile < m_tileBlocks.size(); ++tile)
+	{
+		const Rect &blocks = m_tileBlocks[tile];
+
+		bool dirty = false;
+		for (int blockRow = blocks.y; blockRow < blocks.y + blocks.height && !dirty; ++blockRow)
+		{
+			for (int blockCol = blocks.x; blockCol < blocks.x + blocks.width && !dirty; ++blockCol)
+			{
+				dirty = m_changedBlocks[blockRow * blocksPerRow + blockCol] != 0;
+			}
+		}
+
+		if (dirty)
+		{
+			m_dirtyTiles.push_back(static_cast<int>(tile));
+		}
+	}
+
+	if (!m_dirtyTiles.empty())
+	{
+		const TileRows tiles(m_positions, m_fractions, m_offsets, m_reference, output, colors, depthWarped, NULL);
+		const size_t tileBytes = TILE_WIDTH * TILE_HEIGHT * (m_positions.elemSize() + m_fractions.elemSize() + m_offsets.elemSize() + output.elemSize() + (depthWarped ? sizeof(uint16_t) : 0));
+		parallelForRows(static_cast<int>(m_dirtyTiles.size()), tileBytes, ListedTiles(tiles, m_dirtyTiles, m_outputSize));
+	}
+
+	return static_cast<double>(m_dirtyTiles.size()) / m_tileBlocks.size();
+}
@@ -0,0 +1,105 @@
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+#include "Colorize.h"
+#include "Compositor.h"
+
+/**
+ * @brief Renders the beamer image straight from the filtered sensor depth map.
+ * Fuses warpPerspective and sandboxNormalizeAndColor into a single sweep over
+ * tiles of the output: every output pixel is mapped back into the sensor image,
+ * the depth there bilinearly sampled and run through the color table. No beamer
+ * sized depth intermediates are produced unless requested.
+ *
+ * Sampling follows warpPerspective with INTER_LINEAR and a constant 0 border so
+ * the output equals the separate passes up to interpolation rounding.
+ *
+ * As the homography is constant the projective mapping is computed once per
+ * calibration and kept as fixed point remap tables in the format of cv::convertMaps
+ * (CV_16SC2 integer positions, CV_16UC1 sub pixel indices). The render sweep only
+ * does integer lookups and the same tables warp other images with cv::remap.
+ *
+ * Optional per pixel depth offsets correct a tilted sensor, see SandPlane. They are
+ * added to the samples before anything else sees them.
+ */
+class TileRenderer {
+public:
+	/**
+	 * @param homography Sensor to beamer homography as passed to warpPerspective
+	 * @param outputSize Beamer resolution
+	 */
+	TileRenderer(const cv::Mat &homography, const cv::Size &outputSize);
+
+	/**
+	 * @brief Replaces the sensor to beamer homography, e.g. after recalibration.
+	 * Rebuilds the remap tables.
+	 */
+	void setHomography(const cv::Mat &homography);
+
+	/**
+	 * @brief Sets offsets added to every warped depth value except dropouts.
+	 * @param offsets Offsets in mm (CV_16SC1) of beamer size, empty to disable
+	 */
+	void setDepthOffsets(const cv::Mat &offsets);
+
+	/**
+	 * @brief Adds the depth offsets to a depth map warped separately.
+	 */
+	void offsetDepth(cv::Mat &depthWarped) const;
+
+	/**
+	 * @brief Warps an image of sensor size with the cached tables.
+	 * Equivalent to warpPerspective with the homography and INTER_LINEAR.
+	 */
+	void warp(const cv::Mat &image, cv::Mat &warped) const;
+
+	/**
+	 * @param depth Filtered sensor depth map (CV_16UC1)
+	 * @param output Colorized beamer image of type colors.outputType(), reallocated only if needed
+	 * @param colors Depth to color mapping
+	 * @param depthWarped If not NULL also receives the warped and offset depth map, e.g. for the treasure hunt
+	 * @param effects If not NULL applied to every row right after it was colorized
+	 */
+	void render(const cv::Mat &depth, cv::Mat &output, const ColorTable &colors, cv::Mat *depthWarped = NULL, const Compositor *effects = NULL);
+
+	/**
+	 * @brief Renders only what changed since the last call, for mostly static sand.
+	 * Keeps the depth map the output was rendered from. Sensor blocks in which any pixel
+	 * differs from it by more than thresholdInMM are taken over and only output tiles
+	 * sampling from those blocks are rendered again. Small changes accumulate until they
+	 * cross the threshold. The output always equals render() of the kept depth map.
+	 *
+	 * output and depthWarped are updated in place, they must not be modified between calls.
+	 * Effects have to go on a copy, see Compositor::apply.
+	 *
+	 * @param thresholdInMM Largest depth change in mm a block is considered static with
+	 * @param force If true everything is rendered, e.g. after the color table changed
+	 * @return Fraction of output tiles rendered
+	 */
+	double renderChanged(const cv::Mat &depth, cv::Mat &output, const ColorTable &colors, uint16_t thresholdInMM, cv::Mat *depthWarped = NULL, bool force = false);
+
+private:
+	void updateTileBlocks(const cv::Size &depthSize);
+
+	const cv::Size m_outputSize;
+
+	cv::Mat m_positions; // CV_16SC2 integer source position per output pixel
+	cv::Mat m_fractions; // CV_16UC1 sub pixel offset per output pixel (y * INTER_TAB_SIZE + x)
+	cv::Mat m_offsets;   // CV_16SC1 depth offset per output pixel, empty if disabled
+
+	// Incremental rendering state
+	cv::Mat m_reference;                  // Depth map the output was last rendered from
+	std::vector<cv::Rect> m_tileSources;  // Source pixels every output tile samples
+	std::vector<cv::Rect> m_tileBlocks;   // Sensor blocks every output tile samples
+	std::vector<uint8_t> m_changedBlocks; // Per sensor block, set if taken over this frame
+	std::vector<int> m_dirtyTiles;        // Output tiles to render this frame
+	const uint8_t *m_lastOutput;          // Buffers rendered into last time
+	const uint8_t *m_lastDepthWarped;
+};
+
+#endif // TILE_RENDERER_H
@@ -0,0 +1,226 @@
+#define NOMINMAX
+
+#include "Treasure.h"
+#include "Settings.h"
+#include "ParallelRows.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+bool huntTreasure(cv::Mat &depthMap, cv::Mat &treasure, cv::Mat &display, int left, int top, int depth, double threshold)
+{
+	const int right = left + treasure.cols;
+	const int bottom = top + treasure.rows;
+
+	const uint16_t topOrig = settings.boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
+
+	assert(depthMap.type() == CV_16UC1);
+	assert(display.type() == CV_8UC3);
+	assert(display.type() == CV_8UC3);
+
+	size_t foundPx = 0;
+
+	for (int x = left; x < right; ++x)
+	{
+		for (int y = top; y < bottom; ++y)
+		{
+			const uint16_t val = settings.boxBottomDistanceInMM - std::min<uint16_t>(settings.boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, depthMap.at<uint16_t>(Point(x,y))));
+			if (val <= depth)
+			{
+				// Found pixel of treasure
+				Vec3b pval(treasure.at<Vec3b>(Point(x - left, y - top)));
+				if (pval != Vec3b(255,0,255))
+					display.at<Vec3b>(Point(x, y)) = pval;
+
+				++foundPx;
+			}
+		}
+	}
+
+	const double allPx = treasure.cols * treasure.rows;
+	return (foundPx / allPx >= threshold);
+}
+
+namespace {
+
+/**
+ * @brief Fills each row of the table with the running count of the pixels dug at
+ * least to the limit. The table covers the bounds, parts outside of the depth map stay 0.
+ */
+class DigSumRows : public RowBody {
+public:
+	DigSumRows(const cv::Mat &depth, const cv::Rect &bounds, cv::Mat &sums, uint16_t limit)
+		: m_depth(depth)
+		, m_bounds(bounds)
+		, m_sums(sums)
+		, m_limit(limit) {}
+
+	virtual void operator()(int begin, int end) const
+	{
+		// Columns of the bounds inside the depth map
+		const int first = std::max(0, -m_bounds.x);
+		const int last = std::max(first, std::min(m_bounds.width, m_depth.cols - m_bounds.x));
+
+		for (int row = begin; row < end; ++row)
+		{
+			int32_t *sums = m_sums.ptr<int32_t>(row + 1);
+
+			const int depthRow = m_bounds.y + row;
+			if (depthRow < 0 || depthRow >= m_depth.rows)
+			{
+				memset(sums, 0, (m_bounds.width + 1) * sizeof(int32_t));
+				continue;
+			}
+
+			const uint16_t *depth = m_depth.ptr<uint16_t>(depthRow) + m_bounds.x;
+
+			memset(sums, 0, (first + 1) * sizeof(int32_t));
+
+			int32_t rowSum = 0;
+			for (int col = first; col < last; ++col)
+			{
+				rowSum += depth[col] >= m_limit;
+				sums[col + 1] = rowSum;
+			}
+
+			std::fill(sums + last + 1, sums + m_bounds.width + 1, rowSum);
+		}
+	}
+
+private:
+	const cv::Mat &m_depth;
+	const cv::Rect m_bounds;
+	cv::Mat &m_sums;
+	const uint16_t m_limit;
+};
+
+}
+
+TreasureField::TreasureField(int digDepthInMM)
+	: m_digDepthInMM(digDepthInMM)
+{
+}
+
+size_t TreasureField::bury(const cv::Mat &sprite, int left, int top, double threshold)
+{
+	BuriedObject object;
+	object.sprite = Sprite(sprite);
+	object.rect = Rect(left, top, sprite.cols, sprite.rows);
+	object.threshold = threshold;
+	object.uncovered = 0.;
+
+	m_objects.push_back(object);
+	updateBounds();
+
+	return m_objects.size() - 1;
+}
+
+void TreasureField::move(size_t object, int left, int top)
+{
+	m_objects[object].rect.x = left;
+	m_objects[object].rect.y = top;
+	m_objects[object].uncovered = 0.;
+	updateBounds();
+}
+
+void TreasureField::clear()
+{
+	m_objects.clear();
+	updateBounds();
+}
+
+void TreasureField::updateBounds()
+{
+	m_bounds = Rect();
+	for (size_t i = 0; i < m_objects.size(); ++i)
+	{
+		m_bounds = (i == 0) ? m_objects[i].rect : (m_bounds | m_objects[i].rect);
+	}
+}
+
+int TreasureField::countUncovered(const cv::Rect &rect) const
+{
+	// Rect relative to m_bounds, inclusive-exclusive corners in the table
+	const int left = rect.x - m_bounds.x;
+	const int top = rect.y - m_bounds.y;
+	const int right = left + rect.width;
+	const int bottom = top + rect.height;
+
+	return m_sums.at<int32_t>(bottom, right) - m_sums.at<int32_t>(top, right)
+		 - m_sums.at<int32_t>(bottom, left) + m_sums.at<int32_t>(top, left);
+}
+
+uint16_t TreasureField::getDigLimit() const
+{
+	// Clamped depth below the surface is at most the dig depth from this distance on
+	const int boxBottom = settings.boxBottomDistanceInMM;
+	const int topOrig = boxBottom - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
+	const int limit = (boxBottom - m_digDepthInMM > topOrig + 1) ? boxBottom - m_digDepthInMM : 0;
+
+	return static_cast<uint16_t>(std::max(0, limit));
+}
+
+void TreasureField::draw(Compositor &compositor) const
+{
+	const uint16_t limit = getDigLimit();
+	for (size_t i = 0; i < m_objects.size(); ++i)
+	{
+		compositor.blit(m_objects[i].sprite, m_objects[i].rect.x, m_objects[i].rect.y, limit);
+	}
+}
+
+size_t TreasureField::hunt(const cv::Mat &depthMap)
+{
+	assert(depthMap.type() == CV_16UC1);
+
+	const Rect area = m_bounds & Rect(0, 0, depthMap.cols, depthMap.rows);
+	if (area.area() == 0)
+	{
+		for (size_t i = 0; i < m_objects.size(); ++i)
+			m_objects[i].uncovered = 0.;
+
+		return 0;
+	}
+
+	// Table covers the whole bounds so object rects index it directly
+	m_sums.create(m_bounds.height + 1, m_bounds.width + 1, CV_32SC1);
+	memset(m_sums.ptr<int32_t>(0), 0, m_sums.cols * sizeof(int32_t));
+
+	parallelForRows(m_bounds.height, m_bounds.width * (sizeof(uint16_t) + sizeof(int32_t)), DigSumRows(depthMap, m_bounds, m_sums, getDigLimit()));
+
+	// Accumulating the row sums downwards completes the table
+	for (int row = 1; row <= m_bounds.height; ++row)
+	{
+		const int32_t *above = m_sums.ptr<int32_t>(row - 1);
+		int32_t *sums = m_sums.ptr<int32_t>(row);
+
+		for (int col = 1; col < m_sums.cols; ++col)
+		{
+			sums[col] += above[col];
+		}
+	}
+
+	size_t found = 0;
+	for (size_t i = 0; i < m_objects.size(); ++i)
+	{
+		BuriedObject &object = m_objects[i];
+		object.uncovered = static_cast<double>(countUncovered(object.rect)) / object.rect.area();
+
+		if (object.uncovered >= object.threshold)
+			++found;
+	}
+
+	return found;
+}
+
+void invertMat(cv::Mat &mat)
+{
+	for (uchar *cur = mat.data; cur < mat.dataend; ++cur)
+	{
+		*cur = 255 - *cur;
+	}
+}
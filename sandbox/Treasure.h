@@ -0,0 +1,104 @@
+#ifndef TREASURE_H
+#define TREASURE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+#include "Compositor.h"
+
+/**
+ * @brief Uncovers the parts of the treasure no deeper than depth below the sand surface.
+ * Walks every pixel, reference for TreasureField.
+ * @param depthMap Warped depth map (CV_16UC1)
+ * @param treasure Treasure image (CV_8UC3), magenta pixels are transparent
+ * @param display Image the uncovered parts are drawn into (CV_8UC3)
+ * @param left Horizontal treasure position in the display
+ * @param top Vertical treasure position in the display
+ * @param depth Maximum depth below the surface in mm to count as uncovered
+ * @param threshold Fraction of the treasure that has to be uncovered
+ * @return True if the treasure was found
+ */
+bool huntTreasure(cv::Mat &depthMap, cv::Mat &treasure, cv::Mat &display, int left, int top, int depth = 50, double threshold = 0.7);
+
+/**
+ * @brief Game objects buried in the sand.
+ * Every frame the pixels dug deep enough are thresholded once and summed up into a
+ * summed-area table over the region holding objects. The uncovered part of any object
+ * is then a lookup of four sums, so the cost hardly depends on the number of objects.
+ * Sprites are drawn by the compositor only where the depth shows them uncovered.
+ *
+ * Results equal huntTreasure called for every object in order of burial.
+ */
+class TreasureField {
+public:
+	/**
+	 * @param digDepthInMM Maximum depth below the surface in mm to count as uncovered
+	 */
+	TreasureField(int digDepthInMM = 50);
+
+	/**
+	 * @param sprite Object image (CV_8UC3), magenta pixels are transparent
+	 * @param left Horizontal position in the display
+	 * @param top Vertical position in the display
+	 * @param threshold Fraction of the object that has to be uncovered for it to be found
+	 * @return Index of the object
+	 */
+	size_t bury(const cv::Mat &sprite, int left, int top, double threshold = 0.7);
+
+	void move(size_t object, int left, int top);
+	void clear();
+
+	size_t size() const { return m_objects.size(); }
+	const cv::Rect& getRect(size_t object) const { return m_objects[object].rect; }
+
+	/**
+	 * @brief Schedules blits of all objects, drawing their uncovered pixels.
+	 */
+	void draw(Compositor &compositor) const;
+
+	/**
+	 * @brief Determines the uncovered parts of all objects.
+	 * @param depthMap Warped depth map (CV_16UC1)
+	 * @return Number of found objects
+	 */
+	size_t hunt(const cv::Mat &depthMap);
+
+	/**
+	 * @return Uncovered fraction of the object in the last hunt
+	 */
+	double getUncovered(size_t object) const { return m_objects[object].uncovered; }
+	bool isFound(size_t object) const { return m_objects[object].uncovered >= m_objects[object].threshold; }
+
+private:
+	struct BuriedObject {
+		Sprite sprite;
+		cv::Rect rect;
+		double threshold;
+		double uncovered;
+	};
+
+	void updateBounds();
+	int countUncovered(const cv::Rect &rect) const;
+
+	/**
+	 * @return Smallest depth a pixel is uncovered at, 0 if all are
+	 */
+	uint16_t getDigLimit() const;
+
+	const int m_digDepthInMM;
+
+	std::vector<BuriedObject> m_objects;
+	cv::Rect m_bounds;  // Covers all objects
+
+	cv::Mat m_sums;     // CV_32SC1 summed-area table of the uncovered pixels in m_bounds, one larger in both directions
+};
+
+/**
+ * @brief Inverts every byte of the image in place.
+ * Reference for Compositor::invert.
+ */
+void invertMat(cv::Mat &mat);
+
+#endif // TREASURE_H
@@ -12,51 +12,54 @@
 #include <iomanip>
 #include <vector>
 #include <algorithm>
+#include <limits>
 
 #include <sstream>
 
 #include "Settings.h"
+#include "FrameSource.h"
+#include "SessionRecorder.h"
 #include "Fullscreen.h"
 #include "AveragingFilter.h"
 #include "MedianFilter.h"
+#include "HoleFiller.h"
 #include "HarrisCornerDetection.h"
 #include "HoughCornerDetection.h"
 #include "ManualCornerDetection.h"
+#include "CalibrationCache.h"
+#include "SandPlane.h"
 #include "Sound.h"
+#include "ParallelRows.h"
+#include "TileRenderer.h"
+#include "Colorize.h"
+#include "ColorProfiles.h"
+#include "Compositor.h"
+#include "FrameQueue.h"
+#include "StageTimers.h"
+#include "Treasure.h"
+#include "IdleGovernor.h"
 
 using namespace cv;
 using namespace std;
 
 
-bool initializeCapture(VideoCapture &capture)
+bool initializeCapture(Ptr<FrameSource> &capture)
 {
-	cout << "Opening device...";
-	capture.open(CV_CAP_OPENNI_ASUS);
-	if (!capture.isOpened())
-	{
-		cout << "failed" << endl;
-		return false;
-	}
-	cout << "ok" << endl;
-
-	cout << "Setting capture mode...";
-	if(!capture.set( CV_CAP_OPENNI_IMAGE_GENERATOR_OUTPUT_MODE, CV_CAP_OPENNI_VGA_30HZ ))
-	{
-		cout << "failed" << endl;
+	capture = createFrameSource(settings.frameSource, settings.realtime);
+	if (!capture->open())
 		return false;
-	}
 
-	cout << "ok" << endl;
 	cout << "Settings: " << endl <<
-            left << setw(20) << "FRAME_WIDTH" << capture.get( CV_CAP_PROP_FRAME_WIDTH ) << endl <<
-            left << setw(20) << "FRAME_HEIGHT" << capture.get( CV_CAP_PROP_FRAME_HEIGHT ) << endl <<
-            left << setw(20) << "FRAME_MAX_DEPTH" << capture.get( CV_CAP_PROP_OPENNI_FRAME_MAX_DEPTH ) << " mm" << endl <<
-            left << setw(20) << "FPS" << capture.get( CV_CAP_PROP_FPS ) << endl;
+            left << setw(20) << "SOURCE" << capture->name() << endl <<
+            left << setw(20) << "FRAME_WIDTH" << capture->get( CV_CAP_PROP_FRAME_WIDTH ) << endl <<
+            left << setw(20) << "FRAME_HEIGHT" << capture->get( CV_CAP_PROP_FRAME_HEIGHT ) << endl <<
+            left << setw(20) << "FRAME_MAX_DEPTH" << capture->get( CV_CAP_PROP_OPENNI_FRAME_MAX_DEPTH ) << " mm" << endl <<
+            left << setw(20) << "FPS" << capture->get( CV_CAP_PROP_FPS ) << endl;
 
 	return true;
 }
 
-bool grabAndStore(VideoCapture &capture, const std::string &prefix = std::string())
+bool grabAndStore(FrameSource &capture, const std::string &prefix = std::string())
 {
 	if(!capture.grab())
 		return false;
@@ -68,7 +71,6 @@ bool grabAndStore(VideoCapture &capture, const std::string &prefix = std::string
 	if(!imwrite(prefix + "bgr.png", img))
 		return false;
 
-	return true;
 	if(!capture.retrieve(img, CV_CAP_OPENNI_GRAY_IMAGE))
 		return false;
 
@@ -84,7 +86,7 @@ bool grabAndStore(VideoCapture &capture, const std::string &prefix = std::string
 	return true;
 }
 
-bool grabAndStoreMany(VideoCapture &capture, const int n = 30, const std::string &prefix = std::string())
+bool grabAndStoreMany(FrameSource &capture, const int n = 30, const std::string &prefix = std::string())
 {
 	for (int i = 0; i < n; ++i)
 	{
@@ -104,7 +106,7 @@ bool grabAndStoreMany(VideoCapture &capture, const int n = 30, const std::string
 	return true;
 }
 
-bool getHomography(VideoCapture &capture, Mat &homography)
+bool getHomography(FrameSource &capture, Mat &homography)
 {
 	vector<Point2f> calibPoints;
 	vector<Point2f> realPoints;
@@ -123,7 +125,28 @@ bool getHomography(VideoCapture &capture, Mat &homography)
 			settings.calibrationMode = MANUAL;
 		}
 	}
-
+	else if (settings.calibrationMode == AUTO_HOUGH_FAST) {
+		if(!getAutoCalibrationRectangleCornersHoughFast(capture, calibPoints, realPoints))
+		{
+			cerr << "Fast auto calibration failed, starting manual calibration" << endl;
+			settings.calibrationMode = MANUAL;
+		}
+	}
+	else if (settings.calibrationMode == FULL_FRAME) {
+		// No calibration, assume the sensor sees exactly the beamer area. Mostly useful for synthetic and recorded sources.
+		const float width = static_cast<float>(capture.get(CV_CAP_PROP_FRAME_WIDTH));
+		const float height = static_cast<float>(capture.get(CV_CAP_PROP_FRAME_HEIGHT));
+
+		calibPoints.push_back(Point2f(0, 0)); // Top left
+		calibPoints.push_back(Point2f(width, 0)); // Top right
+		calibPoints.push_back(Point2f(width, height)); // Bottom right
+		calibPoints.push_back(Point2f(0, height)); // Bottom left
+
+		realPoints.push_back(Point2f(0, 0)); // Top left
+		realPoints.push_back(Point2f(static_cast<float>(settings.beamerXres), 0)); // Top right
+		realPoints.push_back(Point2f(static_cast<float>(settings.beamerXres), static_cast<float>(settings.beamerYres))); // Bottom right
+		realPoints.push_back(Point2f(0, static_cast<float>(settings.beamerYres))); // Bottom left
+	}
 
 	if (settings.calibrationMode == MANUAL) {
 		calibPoints.clear();
@@ -140,8 +163,10 @@ bool getHomography(VideoCapture &capture, Mat &homography)
 	return true;
 }
 
-bool getDepthCorrection(VideoCapture &capture, Mat &homography, uint16_t &boxBottomDistanceInMM)
+bool getDepthCorrection(FrameSource &capture, Mat &homography, uint16_t &boxBottomDistanceInMM, SandPlane &plane)
 {
+	plane = SandPlane();
+
 	if (settings.sandPlaneDistanceInMM >= 0) {
 		cout << "Using manual settings for depth correction" << endl;
 		cout << "Sandbox sand level set to: " << settings.sandPlaneDistanceInMM << "mm" << endl;
@@ -157,6 +182,18 @@ bool getDepthCorrection(VideoCapture &capture, Mat &homography, uint16_t &boxBot
 	if(!capture.retrieve(rawDepthInMM, CV_CAP_OPENNI_DEPTH_MAP))
 		return false;
 
+	if (settings.planeCorrection && plane.fit(rawDepthInMM, homography, Size(settings.beamerXres, settings.beamerYres)))
+	{
+		// Heights are measured from the plane, its depth in the middle of the image is the sand level
+		const double center = plane.depthAtOutput(homography, settings.beamerXres / 2., settings.beamerYres / 2.);
+		cout << "Sandbox sand plane fitted, depth varies by " << cvRound(std::fabs(plane.depthAtOutput(homography, 0, 0) - plane.depthAtOutput(homography, settings.beamerXres, settings.beamerYres))) << "mm over the diagonal" << endl;
+		cout << "Sandbox sand level estimated at: " << cvRound(center) << "mm" << endl;
+
+		boxBottomDistanceInMM = saturate_cast<uint16_t>(center + settings.maxSandDepthInMM);
+		cout << "Sandbox box bottom level estimated at: " << boxBottomDistanceInMM << "mm" << endl;
+		return true;
+	}
+
 	Mat depthWarpedInMM;
 	warpPerspective(rawDepthInMM, depthWarpedInMM, homography, Size(settings.beamerXres, settings.beamerYres));
 	
@@ -179,63 +216,67 @@ bool getDepthCorrection(VideoCapture &capture, Mat &homography, uint16_t &boxBot
 	
 	boxBottomDistanceInMM = static_cast<uint16_t>(val);
 
-	//TODO: Perspective correction doesn't help with 3D issues. Should use 4 edge points for reconstructing 3d base plane but that can wait.
-
 	return true;
 }
 
-/**
- * @brief Combined normalize and colorization of the depth map.
- * Somewhat optimized version of normalization and colorization (single loop, less branches etc.) for
- * 7% more overall performance with somewhat reduced redability....
- *
- * @param depthWarped Source depth map
- * @param depthWarpedNormalized Destination image for colorized result.
- * @param boxBottomDistanceInMM Distance to box bottom from sensor in mm
- * @param colorBand Color band to use for mapping, empty for grayscale.
- * @return True if successfull
- */
-bool sandboxNormalizeAndColor(Mat &depthWarped, Mat& depthWarpedNormalized, uint16_t boxBottomDistanceInMM, Mat colorBand)
+bool loadCalibration(FrameSource &capture, Mat &homography, uint16_t &boxBottomDistanceInMM, SandPlane &plane)
 {
-	const bool colored = (colorBand.data != NULL);
+	if (settings.calibrationFile.empty())
+		return false;
 
-	const size_t rows = depthWarped.rows;
-	const size_t cols = depthWarped.cols;
-	depthWarpedNormalized = Mat(rows, cols, colored ? colorBand.type() : depthWarped.type());
+	if (settings.recalibrate)
+	{
+		cout << "Recalibrating, " << settings.calibrationFile << " will be replaced" << endl;
+		return false;
+	}
 
-	const uint16_t topOrig = boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
-	const uint16_t range = boxBottomDistanceInMM - topOrig;
+	CalibrationCache cache;
+	if (!cache.load(settings.calibrationFile))
+		return false;
 
-	if (colored)
-	{
-		uint16_t value;
-		uint8_t *target = depthWarpedNormalized.data;
-		for(uint16_t *current = (uint16_t*)depthWarped.data; current != (uint16_t*)depthWarped.dataend; ++current)
-		{
-			// Clip
-			value = boxBottomDistanceInMM - std::min<uint16_t>(boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, *current));
-			memcpy(target, colorBand.data + (value * 3), 3);
+	cout << "Validating calibration from " << settings.calibrationFile << endl;
 
-			target += 3;
-		}
-	}
-	else
-	{
-		uint16_t value;
-		uint16_t *target = (uint16_t*) depthWarpedNormalized.data;
-		const uint16_t scale = std::numeric_limits<uint16_t>::max() / range;
+	if(!capture.grab())
+		return false;
 
-		for(uint16_t *current = (uint16_t*)depthWarped.data; current != (uint16_t*)depthWarped.dataend; ++current)
-		{
-			// Clip
-			value = boxBottomDistanceInMM - std::min<uint16_t>(boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, *current));
-			*target = value * scale;
+	Mat rawDepthInMM;
+	if(!capture.retrieve(rawDepthInMM, CV_CAP_OPENNI_DEPTH_MAP))
+		return false;
 
-			++target;
-		}
+	if (!cache.matches(rawDepthInMM, settings.calibrationToleranceInMM))
+	{
+		cout << "Sandbox moved since the last calibration, calibrating again" << endl;
+		return false;
 	}
 
+	homography = cache.homography;
+	boxBottomDistanceInMM = cache.boxBottomDistanceInMM;
+	plane = SandPlane(cache.sandPlane);
+	cout << "Sandbox box bottom level loaded: " << boxBottomDistanceInMM << "mm" << endl;
+	return true;
+}
+
+bool saveCalibration(FrameSource &capture, const Mat &homography, uint16_t boxBottomDistanceInMM, const SandPlane &plane)
+{
+	if (settings.calibrationFile.empty())
+		return true;
+
+	if(!capture.grab())
+		return false;
+
+	Mat rawDepthInMM;
+	if(!capture.retrieve(rawDepthInMM, CV_CAP_OPENNI_DEPTH_MAP))
+		return false;
 
+	CalibrationCache cache;
+	cache.set(homography, boxBottomDistanceInMM, plane.coefficients(), rawDepthInMM);
+	if (!cache.save(settings.calibrationFile))
+	{
+		cerr << "Failed to save calibration to " << settings.calibrationFile << endl;
+		return false;
+	}
+
+	cout << "Saved calibration to " << settings.calibrationFile << endl;
 	return true;
 }
 
@@ -248,14 +289,37 @@ bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
 		"{d|depth|90|Maximum sand depth below plane in mm}"
 		"{t|top|200|Maximum sand height above plane in mm}"
 		"{g|ground|-1|Distance of the sand plane to the sensor. (-1 for automatic calibration.)}"
-		"{c|colors|NONE|Prefix for colorbands to use for coloring (-c col -> col0.png - col9.png). NONE for greyscale}"
+		"{c|colors|NONE|Prefix for colorbands to use for coloring (-c col -> col0.png - col9.png, any width is resampled to the sand range). NONE for greyscale}"
 		"{b|bgr|false|If true BGR color view is displayed}"
-		"{cal|calibration|1|Calibration mode. (0 for manual, 1 for hough circles, 2 for harris corners)}"
+		"{src|source|openni|Frame source. openni for the sensor, synthetic for generated terrain or a recorded session file to replay}"
+		"{rt|realtime|true|If false synthetic and replayed frames are processed as fast as possible instead of at sensor rate}"
+		"{rec|record|NONE|Record depth and BGR frames to the given session file. NONE to disable}"
+		"{rq|recordqueue|60|Number of frames buffered for the session writer thread}"
+		"{cal|calibration|1|Calibration mode. (0 for manual, 1 for hough circles, 2 for harris corners, 3 to map the full sensor frame onto the beamer, 4 for hough circles searched per quadrant on a downscaled image)}"
+		"{cs|calibrationstable|3|Consecutive frames a circle has to be found at the same position in by fast hough calibration}"
+		"{cf|calibrationfile|calibration.yml|Calibration is saved to and reused from this file while the live depth matches it. NONE to always calibrate, see -rc to replace it}"
+		"{rc|recalibrate|false|If true the calibration file is ignored and calibration runs with the mode from -cal. The result replaces the saved calibration}"
+		"{ct|calibrationtolerance|15|Median depth difference in mm up to which a saved calibration is reused}"
+		"{pc|planecorrection|true|If true a plane is fitted to the level sand during calibration and heights are measured from it, for a tilted sensor}"
 		"{avgd|averagingdepth|0|Averaging filter depth in frames. (0 = off)}"
 		"{avgs|averagingstepsize|1|Averaging filter step size.}"
+		"{avgi|averagingincremental|true|If true the average is updated with a running sum instead of being recomputed from the full history}"
 		"{medd|mediandepth|0|Median filter depth in frames. (0 = off)}"
 		"{meds|medianstepsize|1|Median filter step size.}"
+		"{hf|holefilling|true|If true sensor dropouts (0mm) are filled from valid neighbours after filtering}"
+		"{thr|threads|0|Number of threads for filtering and colorization. (0 = one per core)}"
+		"{fr|fused|true|If true warping and colorization are done in a single tiled pass}"
+		"{fade|colorfade|20|Number of frames switching between color profiles fades over. (0 switches instantly)}"
+		"{dt|dirtythreshold|2|With fused rendering only tiles whose depth changed by more than this many mm are rendered again. (-1 renders every frame fully)}"
+		"{pl|pipeline|true|If true capture, processing and display run on separate threads}"
+		"{qs|queuesize|2|Number of frames buffered between pipeline stages}"
+		"{qdo|queuedropoldest|true|If true a full pipeline queue drops its oldest frame, otherwise the earlier stage waits}"
+		"{it|idlethreshold|5|Depth change in mm that counts as motion. Without motion processing is suspended. (-1 to always process)}"
+		"{id|idledelay|10|Seconds without motion before processing is suspended}"
+		"{st|stagetiming|true|If true the time spent in every stage is measured and shown in the info window}"
+		"{stf|stagetimingfile|NONE|Write count and percentiles of every stage as CSV to the given file on exit. NONE to disable}"
 		"{east|eastereggshhhh|NONE|Nothing really, doesn't take the name without extension for a small png and a wav either}"
+		"{eastn|eastereggcount|1|Not how many of them are hidden either}"
 		"{h|help|false|Print help}";
 
 	CommandLineParser clp(argc, argv, keys);
@@ -290,6 +354,13 @@ bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
 	settings.maxSandDepthInMM = clp.get<int>("d");
 	settings.maxSandHeightInMM = clp.get<int>("t");
 
+	settings.frameSource = clp.get<std::string>("src");
+	settings.realtime = clp.get<bool>("rt");
+
+	settings.recordFile = clp.get<std::string>("rec");
+	if (settings.recordFile == "NONE") settings.recordFile.clear(); // No recording
+	settings.recordQueueSize = static_cast<size_t>(std::max(1, clp.get<int>("rq")));
+
 	settings.colorFile = clp.get<std::string>("c");
 	if (settings.colorFile == "NONE") settings.colorFile.clear(); // No color file
 
@@ -302,6 +373,7 @@ bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
 	{
 		settings.treasureSound = settings.treasureFile + ".wav";
 		settings.treasureFile = settings.treasureFile + ".png";
+		settings.treasureCount = static_cast<size_t>(std::max(1, clp.get<int>("eastn")));
 	}
 	
 
@@ -324,14 +396,23 @@ bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
 		quit = true;
 		return false;
 	}
+	settings.calibrationStableFrames = static_cast<size_t>(std::max(1, clp.get<int>("cs")));
+
+	settings.calibrationFile = clp.get<std::string>("cf");
+	if (settings.calibrationFile == "NONE") settings.calibrationFile.clear(); // Always calibrate
+	settings.recalibrate = clp.get<bool>("rc");
+	settings.calibrationToleranceInMM = std::max(0, clp.get<int>("ct"));
+	settings.planeCorrection = clp.get<bool>("pc");
 
 	settings.averagingDepth = static_cast<size_t>(std::max(0, clp.get<int>("avgd")));
 	settings.averagingStepsize = static_cast<size_t>(std::max(1, clp.get<int>("avgs")));
+	settings.averagingIncremental = clp.get<bool>("avgi");
 
 	if (settings.averagingDepth > 0)
 	{
 		cout << "Using average filter with depth " << settings.averagingDepth
-			 << " and stepsize " << settings.averagingStepsize << endl;
+			 << " and stepsize " << settings.averagingStepsize
+			 << (settings.averagingIncremental ? " (incremental)" : "") << endl;
 	}
 
 	settings.medianDepth = static_cast<size_t>(std::max(0, clp.get<int>("medd")));
@@ -351,41 +432,24 @@ bool parseSettingsFromCommandline(int argc, char **argv, bool &quit)
 		}
 	}
 
-	quit = false;
-	return true;
-}
-
-bool loadColorFile(const std::string &colorFile, Mat &colors)
-{
-	if (colorFile.empty()) {
-		cout << "No colorband given" << endl;
-		colors = Mat(); // Empty material
-		return true;
-	}
+	settings.holeFilling = clp.get<bool>("hf");
+	settings.threads = static_cast<size_t>(std::max(0, clp.get<int>("thr")));
+	settings.fusedRendering = clp.get<bool>("fr");
+	settings.colorFadeFrames = static_cast<size_t>(std::max(0, clp.get<int>("fade")));
+	settings.dirtyThresholdInMM = std::min(clp.get<int>("dt"), static_cast<int>(std::numeric_limits<uint16_t>::max()));
 
-	cout << "Loading color file " << colorFile << "...";
+	settings.pipeline = clp.get<bool>("pl");
+	settings.queueSize = static_cast<size_t>(std::max(1, clp.get<int>("qs")));
+	settings.queueDropOldest = clp.get<bool>("qdo");
 
-	colors = cv::imread(colorFile, 1);
-	if (colors.data == NULL) {
-		cout << "failed" << endl;
-		return false;
-	}
+	settings.idleThresholdInMM = std::min(clp.get<int>("it"), static_cast<int>(std::numeric_limits<uint16_t>::max()));
+	settings.idleDelayInSeconds = std::max(0., clp.get<double>("id"));
 
-	if(colors.rows != 1)
-	{
-		cout << "failed" << endl << "The colorband must only have one row" << endl;
-		return false;
-	}
+	settings.stageTiming = clp.get<bool>("st");
+	settings.stageTimingFile = clp.get<std::string>("stf");
+	if (settings.stageTimingFile == "NONE") settings.stageTimingFile.clear(); // No timing file
 
-	//TODO: Add ability to scale this if needed
-	const uint16_t fullRange = settings.maxSandDepthInMM + settings.maxSandHeightInMM;
-	if (colors.cols != fullRange)
-	{
-		cout << "failed" << endl << "For given sand depth and height limits colorband has to cover " << fullRange << "mm, covers " << colors.rows << "mm (px) as columns." << endl;
-		return false;
-	}
-	
-	cout << "ok" << endl;
+	quit = false;
 	return true;
 }
 
@@ -414,61 +478,490 @@ public:
 
 };
 
-void renderInfo(const std::string &window, Mat &infoMat, double fps)
+void renderInfo(const std::string &window, Mat &infoMat, double fps, double latencyInMs = -1, double maxLatencyInMs = -1, long dropped = 0, double idleFraction = -1, const StageSnapshot *now = NULL, const StageSnapshot *before = NULL)
 {
 	memset(infoMat.data, 255, infoMat.dataend - infoMat.data);
 
 	putText(infoMat, "Select this window and press ESC to quit", Point(5,15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,0,255,0));
 	stringstream ss;
 	ss.precision(5);
-	if (fps <= 0) ss << "FPS: ?";
+	if (fps < 0) ss << "FPS: ?";
 	else ss << "FPS: " << fps;
 
 	putText(infoMat, ss.str(), Point(5,100), FONT_HERSHEY_SIMPLEX, 1.0, Scalar(0,0,0,0));
 
+	if (latencyInMs >= 0)
+	{
+		stringstream ls;
+		ls.precision(3);
+		ls << "Latency: " << latencyInMs << "ms (max " << maxLatencyInMs << "ms)";
+		putText(infoMat, ls.str(), Point(5,140), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,0,0,0));
+
+		stringstream ds;
+		ds << "Dropped frames: " << dropped;
+		if (idleFraction >= 0) ds << "  Idle: " << static_cast<int>(idleFraction * 100. + .5) << "%";
+		putText(infoMat, ds.str(), Point(5,170), FONT_HERSHEY_SIMPLEX, 0.6, Scalar(0,0,0,0));
+	}
+
+	if (now)
+	{
+		// Stage breakdown in ms, columns placed individually as the font isn't monospaced
+		const char *HEADERS[] = { "stage", "p50", "p95", "p99", "max" };
+		const int COLUMNS[] = { 5, 120, 220, 320, 420 };
+
+		for (int column = 0; column < 5; ++column)
+		{
+			putText(infoMat, HEADERS[column], Point(COLUMNS[column], 210), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,0,255,0));
+		}
+
+		int y = 230;
+		for (int stage = 0; stage < STAGE_COUNT; ++stage)
+		{
+			const StageStatistics statistics = getStageStatistics(static_cast<TimedStage>(stage), *now, before);
+			if (statistics.count == 0)
+				continue; // Stage not in use
+
+			const double values[] = { statistics.p50InMs, statistics.p95InMs, statistics.p99InMs, statistics.maxInMs };
+
+			putText(infoMat, getStageName(static_cast<TimedStage>(stage)), Point(COLUMNS[0], y), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,0,0,0));
+			for (int column = 1; column < 5; ++column)
+			{
+				stringstream vs;
+				vs << fixed << setprecision(2) << values[column - 1];
+				putText(infoMat, vs.str(), Point(COLUMNS[column], y), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,0,0,0));
+			}
+
+			y += 20;
+		}
+	}
+
 	imshow(window, infoMat);
 }
 
-bool huntTreasure(Mat &depthMap, Mat &treasure, Mat &display, int left, int top, int depth = 50, double threshold = 0.7)
+/**
+ * @brief Frame as it leaves the capture stage.
+ */
+struct CapturedFrame {
+	CapturedFrame() : captureTicks(0) {}
+
+	Mat depth;
+	Mat bgr;
+	int64 captureTicks;
+};
+
+/**
+ * @brief Frame as it leaves the processing stage, ready for display.
+ */
+struct RenderedFrame {
+	RenderedFrame() : captureTicks(0) {}
+
+	Mat image;
+	Mat bgr;
+	Mat bgrWarped;
+	int64 captureTicks;
+};
+
+/**
+ * @brief Capture stage. Grabs the next frame and records it if enabled.
+ */
+bool captureFrame(FrameSource &capture, SessionRecorder &recorder, CapturedFrame &frame)
 {
-	const int right = left + treasure.cols;
-	const int bottom = top + treasure.rows;
+	{
+		ScopedStageTimer timer(STAGE_GRAB);
+		if (!capture.grab())
+		{
+			cerr << "Failed to grab frame" << endl;
+			return false;
+		}
+	}
 
-	const uint16_t topOrig = settings.boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
+	frame.captureTicks = cv::getTickCount();
 
-	assert(depthMap.type() == CV_16UC1);
-	assert(display.type() == CV_8UC3);
-	assert(display.type() == CV_8UC3);
+	{
+		ScopedStageTimer timer(STAGE_RETRIEVE);
+		if (settings.displayBGR || recorder.isRecording()) {
+			if (!capture.retrieve(frame.bgr, CV_CAP_OPENNI_BGR_IMAGE))
+			{
+				cerr << "Failed to retrieve" << endl;
+				return false;
+			}
+		}
 
-	size_t foundPx = 0;
+		if (!capture.retrieve(frame.depth, CV_CAP_OPENNI_DEPTH_MAP))
+		{
+			cerr << "Failed to retrieve valid depth mask" << endl;
+			return false;
+		}
+	}
 
-	for (int x = left; x < right; ++x)
+	if (recorder.isRecording())
 	{
-		for (int y = top; y < bottom; ++y)
+		// Only copies the frame, the writer thread encodes and stores it
+		ScopedStageTimer timer(STAGE_RECORD);
+		const uint64_t timestampInUs = static_cast<uint64_t>(frame.captureTicks / (cv::getTickFrequency() / 1000000.));
+		recorder.record(frame.depth, frame.bgr, timestampInUs);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Processing stage. Filters, warps and colorizes depth frames and runs the treasure hunt.
+ * Color profile and treasure can be changed from other threads while frames are processed.
+ */
+class FrameProcessor {
+public:
+	/**
+	 * @param depthOffsets Per pixel depth correction of beamer size, empty for none
+	 */
+	FrameProcessor(const Mat &homography, const Mat &depthOffsets, ColorProfiles &colorProfiles)
+		: m_colorProfiles(colorProfiles)
+		, m_renderer(homography, Size(settings.beamerXres, settings.beamerYres))
+		, m_fadeFrame(settings.colorFadeFrames)
+		, m_fadeWeight(-1)
+		, m_avgFilter(settings.averagingDepth, settings.averagingStepsize, settings.averagingIncremental)
+		, m_medFilter(settings.medianDepth, settings.medianStepsize)
+		, m_idleGovernor(static_cast<uint16_t>(std::max(0, settings.idleThresholdInMM)), settings.idleDelayInSeconds)
+		, m_random(cv::getTickCount())
+		, m_foundTreasures(0)
+		, m_winningShuffle(0)
+		, m_hideTreasure(0)
+	{
+		m_renderer.setDepthOffsets(depthOffsets);
+
+		// The first frame needs a table, usually the band finished loading during calibration
+		m_colorProfiles.setLimits(settings.boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM);
+		m_colorProfiles.acquireBlocking(m_colorTable);
+
+		if (settings.medianDepth > 0)
+		{
+			// Only the range the color table maps to colors matters, deep windows can use a histogram over it.
+			// Filtering happens before the depth correction, so the range grows by the offsets.
+			double minOffset = 0., maxOffset = 0.;
+			if (!depthOffsets.empty())
+			{
+				minMaxLoc(depthOffsets, &minOffset, &maxOffset);
+			}
+
+			const int topOrig = settings.boxBottomDistanceInMM - settings.maxSandDepthInMM - settings.maxSandHeightInMM;
+			const uint16_t minValue = saturate_cast<uint16_t>(topOrig + 1 - maxOffset);
+			const uint16_t maxValue = saturate_cast<uint16_t>(settings.boxBottomDistanceInMM - minOffset);
+			if (m_medFilter.enableIncremental(minValue, maxValue))
+			{
+				cout << "Using incremental histogram median" << endl;
+			}
+		}
+
+		if (!settings.treasureFile.empty())
+		{
+			const Mat treasure = imread(settings.treasureFile);
+			if (treasure.type() != CV_8UC3)
+			{
+				cerr << "Indegestible" << endl;
+				settings.treasureFile = std::string();
+			}
+			else
+			{
+				for (size_t i = 0; i < settings.treasureCount; ++i)
+				{
+					m_treasures.bury(treasure, 0, 0);
+				}
+
+				hideTreasures();
+			}
+		}
+	}
+
+	/**
+	 * @param in Captured frame, its BGR image is moved to out
+	 * @param out Frame to display
+	 * @return False if the frame was skipped as nothing moved, the last one is still valid then
+	 */
+	bool process(CapturedFrame &in, RenderedFrame &out)
+	{
+		if (settings.idleThresholdInMM >= 0)
+		{
+			// Pending input and the win animation need new frames
+			const bool busy = m_winningShuffle > 0 || atomicLoad(&m_hideTreasure) != 0 || m_colorProfiles.pending() || m_fadeFrame < settings.colorFadeFrames;
+			if (!m_idleGovernor.update(in.depth, busy))
+				return false;
+		}
+
+		out.captureTicks = in.captureTicks;
+
+		if (settings.displayBGR)
+		{
+			ScopedStageTimer timer(STAGE_BGR);
+			std::swap(in.bgr, out.bgr);
+			m_renderer.warp(out.bgr, out.bgrWarped);
+		}
+
+		const Mat *filteredDepthmap = &in.depth;
+		if (settings.averagingDepth > 0)
+		{
+			ScopedStageTimer timer(STAGE_FILTER);
+			m_avgFilter.addFrame(in.depth);
+			m_avgFilter.getFiltered(m_filteredDepthmap);
+			filteredDepthmap = &m_filteredDepthmap;
+		}
+		else if (settings.medianDepth > 0)
+		{
+			ScopedStageTimer timer(STAGE_FILTER);
+			m_medFilter.addFrame(in.depth);
+			m_medFilter.getFiltered<uint16_t>(m_filteredDepthmap);
+			filteredDepthmap = &m_filteredDepthmap;
+		}
+
+		if (settings.holeFilling)
+		{
+			// Dropouts would otherwise show up as speckles of the highest color
+			ScopedStageTimer timer(STAGE_FILL);
+			m_holeFiller.fill(*filteredDepthmap, m_filteredDepthmap);
+			filteredDepthmap = &m_filteredDepthmap;
+		}
+
+		if (atomicCompareExchange(&m_hideTreasure, 0, 1) == 1 && !settings.treasureFile.empty())
+		{
+			hideTreasures();
+		}
+
+		// Tables are rebuilt in the background and only swapped in between frames
+		m_colorProfiles.setLimits(settings.boxBottomDistanceInMM, settings.maxSandDepthInMM, settings.maxSandHeightInMM);
+		bool colorsChanged = false;
+		if (m_colorProfiles.acquire(m_nextColorTable))
+		{
+			colorsChanged = true;
+			if (settings.colorFadeFrames > 0 && m_colorTable.colored() && m_nextColorTable.colored())
+			{
+				// Fade from what is shown, also from the middle of another fade
+				m_previousColorTable.swap(m_colorTable);
+				m_fadeFrame = 0;
+				m_fadeWeight = -1;
+			}
+			else
+			{
+				m_colorTable.swap(m_nextColorTable);
+				m_fadeFrame = settings.colorFadeFrames;
+			}
+		}
+
+		if (m_fadeFrame < settings.colorFadeFrames)
+		{
+			// Blending the tables costs the same as any frame's lookups, the last step equals the new table
+			++m_fadeFrame;
+			const int weight = static_cast<int>(255 * m_fadeFrame / settings.colorFadeFrames);
+
+			// A new weight recolors every pixel, so these frames render in full instead of only
+			// the changed tiles ("render fade" in the benchmark). Fades longer than 255 frames
+			// repeat weights, those frames stay incremental.
+			if (weight != m_fadeWeight)
+			{
+				m_colorTable.blend(m_previousColorTable, m_nextColorTable, static_cast<uint8_t>(weight));
+				m_fadeWeight = weight;
+				colorsChanged = true;
+			}
+		}
+
+		// Warped depth is only needed for the treasure hunt
+		Mat *depthWarped = settings.treasureFile.empty() ? NULL : &m_depthWarped;
+
+		// Effects of this frame, applied while rendering
+		m_effects.clear();
+		if (!settings.treasureFile.empty())
+		{
+			m_treasures.draw(m_effects);
+		}
+
+		if (m_winningShuffle > 0)
+		{
+			if (m_winningShuffle % 10 < 5)
+			{
+				m_effects.invert();
+			}
+			--m_winningShuffle;
+		}
+
+		if (settings.fusedRendering && settings.dirtyThresholdInMM >= 0)
+		{
+			ScopedStageTimer timer(STAGE_RENDER);
+
+			// Persistent image only changes where the sand moved, effects go on the copy
+			m_renderer.renderChanged(*filteredDepthmap, m_rendered, m_colorTable, static_cast<uint16_t>(settings.dirtyThresholdInMM), depthWarped, colorsChanged);
+			m_effects.apply(m_rendered, out.image, depthWarped);
+		}
+		else if (settings.fusedRendering)
+		{
+			ScopedStageTimer timer(STAGE_RENDER);
+			m_renderer.render(*filteredDepthmap, out.image, m_colorTable, depthWarped, &m_effects);
+		}
+		else
 		{
-			const uint16_t val = settings.boxBottomDistanceInMM - std::min<uint16_t>(settings.boxBottomDistanceInMM, std::max<uint16_t>(topOrig + 1, depthMap.at<uint16_t>(Point(x,y))));
-			if (val <= depth)
 			{
-				// Found pixel of treasure
-				Vec3b pval(treasure.at<Vec3b>(Point(x - left, y - top)));
-				if (pval != Vec3b(255,0,255))
-					display.at<Vec3b>(Point(x, y)) = pval;
+				ScopedStageTimer timer(STAGE_WARP);
+				m_renderer.warp(*filteredDepthmap, m_depthWarped);
+				m_renderer.offsetDepth(m_depthWarped);
+			}
+
+			ScopedStageTimer timer(STAGE_COLORIZE);
+			m_colorTable.apply(m_depthWarped, out.image);
+			m_effects.apply(out.image, &m_depthWarped);
+		}
+
+		if (!settings.treasureFile.empty())
+		{
+			ScopedStageTimer timer(STAGE_TREASURE);
 
-				++foundPx;
+			// Effects are already applied, the win animation starts with the next frame
+			const size_t found = m_treasures.hunt(m_depthWarped);
+			if (found > m_foundTreasures)
+			{
+				if (m_treasures.size() == 1)
+					cout << "You found the treasure, press t to hide it again" << endl;
+				else
+					cout << "You found " << found << " of " << m_treasures.size() << " treasures, press t to hide them again" << endl;
+
+				m_winningShuffle = 30;
+				doPlaySound(settings.treasureSound);
 			}
+
+			// Treasures can be covered up again
+			m_foundTreasures = std::max(m_foundTreasures, found);
+		}
+
+		return true;
+	}
+
+	/**
+	 * @brief Switches the color profile once its table is ready.
+	 * @return False if there is no such profile
+	 */
+	bool selectColor(size_t num)
+	{
+		return m_colorProfiles.select(num);
+	}
+
+	/**
+	 * @brief Moves the treasures to new random positions with the next processed frame.
+	 */
+	void hideTreasure()
+	{
+		atomicStore(&m_hideTreasure, 1);
+	}
+
+	/**
+	 * @return Seconds processing was suspended as nothing moved
+	 */
+	double getIdleTime() const
+	{
+		return m_idleGovernor.getIdleTime();
+	}
+
+private:
+	void hideTreasures()
+	{
+		for (size_t i = 0; i < m_treasures.size(); ++i)
+		{
+			const Rect &rect = m_treasures.getRect(i);
+			m_treasures.move(i, m_random.uniform(0, settings.beamerXres - rect.width), m_random.uniform(0, settings.beamerYres - rect.height));
 		}
+
+		m_foundTreasures = 0;
+		cout << (m_treasures.size() == 1 ? "Find the treasure" : "Find the treasures") << endl;
+	}
+
+	ColorProfiles &m_colorProfiles;
+
+	TileRenderer m_renderer;
+	ColorTable m_colorTable;
+	ColorTable m_previousColorTable; // Fading from
+	ColorTable m_nextColorTable;     // Fading to
+	size_t m_fadeFrame;              // colorFadeFrames when not fading
+	int m_fadeWeight;                // Weight m_colorTable was blended with, -1 before the first step
+	Compositor m_effects;
+
+	AveragingFilter m_avgFilter;
+	MedianFilter m_medFilter;
+	HoleFiller m_holeFiller;
+
+	IdleGovernor m_idleGovernor;
+
+	Mat m_filteredDepthmap;
+	Mat m_depthWarped;
+	Mat m_rendered;
+
+	// Own generator, the C runtime seeds rand() per thread
+	RNG m_random;
+
+	TreasureField m_treasures;
+	size_t m_foundTreasures;
+	size_t m_winningShuffle;
+
+	// Set from the display thread
+	volatile long m_hideTreasure;
+};
+
+/**
+ * @brief State shared by the pipeline threads.
+ */
+struct Pipeline {
+	Pipeline(FrameSource &capture, SessionRecorder &recorder, FrameProcessor &processor, size_t queueSize, QueuePolicy policy)
+		: capture(capture)
+		, recorder(recorder)
+		, processor(processor)
+		, captured(queueSize, policy)
+		, rendered(queueSize, policy)
+		, stop(0) {}
+
+	FrameSource &capture;
+	SessionRecorder &recorder;
+	FrameProcessor &processor;
+
+	FrameQueue<CapturedFrame> captured;
+	FrameQueue<RenderedFrame> rendered;
+
+	volatile long stop;
+};
+
+void captureThread(void *arg)
+{
+	Pipeline &pipeline = *static_cast<Pipeline*>(arg);
+
+	CapturedFrame frame;
+	while (!atomicLoad(&pipeline.stop))
+	{
+		if (!captureFrame(pipeline.capture, pipeline.recorder, frame))
+			break;
+
+		if (!pipeline.captured.push(frame))
+			break;
 	}
 
-	const double allPx = treasure.cols * treasure.rows;
-	return (foundPx / allPx >= threshold);
+	pipeline.captured.close();
 }
 
-void invertMat(Mat &mat)
+void processThread(void *arg)
 {
-	for (uchar *cur = mat.data; cur < mat.dataend; ++cur)
+	Pipeline &pipeline = *static_cast<Pipeline*>(arg);
+
+	CapturedFrame in;
+	RenderedFrame out;
+	for (;;)
 	{
-		*cur = 255 - *cur;
+		if (pipeline.captured.pop(in, 100))
+		{
+			if (!pipeline.processor.process(in, out))
+				continue; // Idle, display keeps the last frame
+
+			if (!pipeline.rendered.push(out))
+				break;
+		}
+		else if (pipeline.captured.isClosed())
+		{
+			break;
+		}
 	}
+
+	pipeline.rendered.close();
 }
 
 int main( int argc, char* argv[] )
@@ -480,35 +973,61 @@ int main( int argc, char* argv[] )
 	if (quit)
 		return 0;
 
-	vector<Mat> colors;
-	for (size_t i = 0; i < 10; ++i)
+	// Colorbands load while the sensor starts and calibrates
+	ColorProfiles colorProfiles;
+	if (!colorProfiles.start(settings.colorFile))
 	{
-		stringstream ss;
-		ss << settings.colorFile << i << ".png";
-
-		Mat cf;
-		if(loadColorFile(ss.str(), cf))
-			colors.push_back(cf);
+		cerr << "Failed to start loading colorbands" << endl;
+		return 1;
 	}
 
-	if (colors.empty())
-	{
-		cout << "Displaying continous grey scale" << endl;
-		colors.push_back(Mat());
-	}
+	setWorkerThreads(settings.threads);
+	cout << "Using " << getWorkerThreads() << " worker thread(s)" << endl;
 
-	VideoCapture capture;
-	if (!initializeCapture(capture))
+	Ptr<FrameSource> captureSource;
+	if (!initializeCapture(captureSource))
 		return 1;
 
+	FrameSource &capture = *captureSource;
+
 	//grabAndStoreMany(capture, 10, "white");
 
 	Mat homography;
-	if(!getHomography(capture, homography))
-		return 1;
+	SandPlane plane;
+	if (loadCalibration(capture, homography, settings.boxBottomDistanceInMM, plane))
+	{
+		// A manually set sand level still overrides the saved one
+		if (settings.sandPlaneDistanceInMM >= 0)
+			getDepthCorrection(capture, homography, settings.boxBottomDistanceInMM, plane);
+	}
+	else
+	{
+		if(!getHomography(capture, homography))
+			return 1;
 
-	if(!getDepthCorrection(capture, homography, settings.boxBottomDistanceInMM))
-		return 1;
+		if(!getDepthCorrection(capture, homography, settings.boxBottomDistanceInMM, plane))
+			return 1;
+
+		saveCalibration(capture, homography, settings.boxBottomDistanceInMM, plane);
+	}
+
+	Mat depthOffsets;
+	if (settings.planeCorrection && plane.valid())
+	{
+		plane.getCorrection(homography, Size(settings.beamerXres, settings.beamerYres), settings.boxBottomDistanceInMM - settings.maxSandDepthInMM, depthOffsets);
+	}
+
+	SessionRecorder recorder(settings.recordQueueSize);
+	if (!settings.recordFile.empty())
+	{
+		cout << "Recording session to " << settings.recordFile << "...";
+		if (!recorder.start(settings.recordFile))
+		{
+			cout << "failed" << endl;
+			return 1;
+		}
+		cout << "ok" << endl;
+	}
 
 	const std::string BGR_IMAGE = "Bgr Image";
 	const std::string BGR_WARPED = "Warped BGR Image";
@@ -541,161 +1060,187 @@ int main( int argc, char* argv[] )
 
 	cout << "Enter mainloop" << endl;
 
+	setStageTimingEnabled(settings.stageTiming);
+
 	// Define loop variables here to prevent unneeded allocations
-	Mat infoMat(200,400, CV_8UC3);
+	Mat infoMat(settings.stageTiming ? 230 + 20 * STAGE_COUNT : 200, settings.stageTiming ? 500 : 400, CV_8UC3);
 
 	// Render dummy info
 	renderInfo(INFO_VIEW, infoMat, -1);
 
-	Mat depthMap;
-	Mat depthWarped;
-	Mat depthWarpedNormalized;
+	FrameProcessor processor(homography, depthOffsets, colorProfiles);
 
-	Mat bgrImage;
-	Mat bgrWarped;
+	Pipeline pipeline(capture, recorder, processor, settings.queueSize, settings.queueDropOldest ? QUEUE_DROP_OLDEST : QUEUE_BLOCK);
+	Thread captureWorker;
+	Thread processWorker;
 
-	AveragingFilter avgFilter(settings.averagingDepth, settings.averagingStepsize);
-	MedianFilter medFilter(settings.medianDepth, settings.medianStepsize);
+	if (settings.pipeline)
+	{
+		if (!captureWorker.start(captureThread, &pipeline) || !processWorker.start(processThread, &pipeline))
+		{
+			cerr << "Failed to start pipeline threads" << endl;
 
+			atomicStore(&pipeline.stop, 1);
+			pipeline.captured.close();
+			pipeline.rendered.close();
+			return 1;
+		}
+
+		cout << "Pipelined capture, processing and display with " << settings.queueSize << " frame queues ("
+			 << (settings.queueDropOldest ? "dropping oldest" : "blocking") << ")" << endl;
+	}
+
+	Stopwatch runtime;
 	Stopwatch timer;
 	size_t frames = 0;
+	double idleBefore = 0.;
 
-	Mat filteredDepthmap;
-
-	Mat treasure;
-	int treasureX;
-	int treasureY;
-	bool foundTreasure = false;
-	size_t winningShuffle = 0;
+	// Always on, unlike the stage timers
+	double latencySum = 0.;
+	double latencyMax = 0.;
 
-	size_t currentColor = 0;
+	// Info window shows the stage times since its last update
+	StageSnapshot stagesBefore;
+	StageSnapshot stagesNow;
+	takeStageSnapshot(stagesBefore);
 
-	if (!settings.treasureFile.empty())
-	{
-		treasure = imread(settings.treasureFile);
-		if (treasure.type() != CV_8UC3)
-		{
-			cerr << "Indegestible" << endl;
-			settings.treasureFile = std::string();
-		}
-		srand((unsigned int)(cv::getTickCount() & 0xFFFFFFFF));
-		treasureX = rand() % (settings.beamerXres - treasure.cols);
-		treasureY = rand() % (settings.beamerYres - treasure.rows);
+	CapturedFrame captured;
+	RenderedFrame rendered;
 
-		cout << "Find the treasure " << endl;
-		// DEBUGGING ONLY cout << treasureX << " " << treasureY << endl;
-	}
+	int result = 0;
 
 	for (;;)
 	{
-		if (!capture.grab())
+		bool haveFrame;
+		if (settings.pipeline)
 		{
-			cerr << "Failed to grab frame" << endl;
-			return 1;
+			// Short wait keeps the windows responsive while the pipeline works
+			haveFrame = pipeline.rendered.pop(rendered, 5);
+			if (!haveFrame && pipeline.rendered.isClosed())
+			{
+				cerr << "Pipeline stopped" << endl;
+				result = 1;
+				break;
+			}
 		}
-
-		if (timer.getTime() > 2.)
+		else
 		{
-			// Update info display every 2 seconds
-			const double took = timer.reset();
-			const double fps = frames / took;
-			frames = 0;
-			renderInfo(INFO_VIEW, infoMat, fps);
-		}
-
-		if (settings.displayBGR) {
-			if (!capture.retrieve(bgrImage, CV_CAP_OPENNI_BGR_IMAGE))
+			if (!captureFrame(capture, recorder, captured))
 			{
-				cerr << "Failed to retrieve" << endl;
-				return 1;
+				result = 1;
+				break;
 			}
 
-			warpPerspective(bgrImage, bgrWarped, homography, Size(settings.beamerXres, settings.beamerYres));
-			
-			imshow(BGR_WARPED, bgrWarped);
-			imshow(BGR_IMAGE, bgrImage);
+			haveFrame = processor.process(captured, rendered);
 		}
 
-		if (!capture.retrieve(depthMap, CV_CAP_OPENNI_DEPTH_MAP))
+		if (haveFrame)
 		{
-			cerr << "Failed to retrieve valid depth mask" << endl;
-			return 1;
-		}
+			{
+				ScopedStageTimer timer(STAGE_DISPLAY);
+				if (settings.displayBGR) {
+					imshow(BGR_WARPED, rendered.bgrWarped);
+					imshow(BGR_IMAGE, rendered.bgr);
+				}
 
+				imshow(SAND_NORMALIZED, rendered.image);
+			}
 
-		if (settings.averagingDepth > 0)
-		{
-			avgFilter.addFrame(depthMap);
-			avgFilter.getFiltered(filteredDepthmap);
-		}
-		else if (settings.medianDepth > 0)
-		{
-			medFilter.addFrame(depthMap);
-			medFilter.getFiltered<uint16_t>(filteredDepthmap);
+			// From grab to handing the image to the display
+			const int64 latencyTicks = cv::getTickCount() - rendered.captureTicks;
+			const double latency = static_cast<double>(latencyTicks) * 1000. / cv::getTickFrequency();
+			latencySum += latency;
+			latencyMax = std::max(latencyMax, latency);
+
+			if (isStageTimingEnabled())
+			{
+				addStageTime(STAGE_LATENCY, latencyTicks);
+			}
+
+			++frames;
 		}
-		else
+
+		if (timer.getTime() > 2.)
 		{
-			filteredDepthmap = depthMap;
-		}
+			// Update info display every 2 seconds
+			const double took = timer.reset();
+			const double fps = frames / took;
+			const long dropped = pipeline.captured.dropped() + pipeline.rendered.dropped();
 
-		warpPerspective(filteredDepthmap, depthWarped, homography, Size(settings.beamerXres, settings.beamerYres));
+			const double idle = processor.getIdleTime();
+			const double idleFraction = settings.idleThresholdInMM >= 0 ? std::min(1., (idle - idleBefore) / took) : -1.;
+			idleBefore = idle;
 
-		sandboxNormalizeAndColor(depthWarped, depthWarpedNormalized, settings.boxBottomDistanceInMM, colors[currentColor]);
+			const double latency = frames > 0 ? latencySum / frames : 0.;
 
-		if (!settings.treasureFile.empty())
-		{
-			if(huntTreasure(depthWarped, treasure, depthWarpedNormalized, treasureX, treasureY))
+			if (settings.stageTiming)
 			{
-				if (!foundTreasure)
-				{
-					cout << "You found the treasure, press t to hide it again" << endl;
-					foundTreasure = true;
-					winningShuffle = 30;
-					if (!settings.treasureFile.empty())
-						doPlaySound(settings.treasureSound);
-				}
+				takeStageSnapshot(stagesNow);
+				renderInfo(INFO_VIEW, infoMat, fps, latency, latencyMax, dropped, idleFraction, &stagesNow, &stagesBefore);
+				std::swap(stagesNow, stagesBefore);
 			}
-		}
-
-		if (winningShuffle > 0)
-		{
-			if (winningShuffle % 10 < 5)
+			else
 			{
-				invertMat(depthWarpedNormalized);
+				renderInfo(INFO_VIEW, infoMat, fps, latency, latencyMax, dropped, idleFraction);
 			}
-			--winningShuffle;
-		}
 
-		imshow(SAND_NORMALIZED, depthWarpedNormalized);
+			frames = 0;
+			latencySum = 0.;
+			latencyMax = 0.;
+		}
 
-		const int key = waitKey(1);  // Needed for event processing in OpenCV
+		int key;
+		{
+			ScopedStageTimer timer(STAGE_WAITKEY);
+			key = waitKey(1);  // Needed for event processing in OpenCV
+		}
 		if (key == 't')
 		{
-			treasureX = rand() % (settings.beamerXres - treasure.cols);
-			treasureY = rand() % (settings.beamerYres - treasure.rows);
-			cout << "Find the treasure ";
-			// DEBUGGING ONLY!!!! // cout << treasureX << " " << treasureY << endl;
-
-			foundTreasure = false;
+			processor.hideTreasure();
 		}
 		else if (key >= '0' && key <= '9')
 		{
 			size_t num = key - '0';
-			if (num < colors.size())
+			if (processor.selectColor(num))
 			{
 				cout << "Switching to color profile " << num << endl;
-				currentColor = num;
 			}
 		}
 		else if( key == 27 )
 		{
 			break;
 		}
+	}
+
+	atomicStore(&pipeline.stop, 1);
+	pipeline.captured.close();
+	pipeline.rendered.close();
 
-		++frames;
+	processWorker.join();
+	captureWorker.join();
+
+	// Writes what is still queued
+	recorder.stop();
+
+	if (settings.idleThresholdInMM >= 0)
+	{
+		cout << "Idle for " << processor.getIdleTime() << "s of " << runtime.getTime() << "s" << endl;
+	}
+
+	if (!settings.stageTimingFile.empty())
+	{
+		cout << "Writing stage timings to " << settings.stageTimingFile << "...";
+		if (writeStageStatistics(settings.stageTimingFile))
+		{
+			cout << "ok" << endl;
+		}
+		else
+		{
+			cout << "failed" << endl;
+		}
 	}
 
-	return 0;
+	return result;
 }
 
 